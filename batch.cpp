@@ -0,0 +1,207 @@
+#include "batch.h"
+#include "elf32.h"
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+using std::cerr;
+using std::endl;
+
+namespace
+{
+	/**
+	 * One thread's share of the job indices.  The owner takes from the
+	 * 	front and thieves take from the back, so the two only meet when
+	 * 	the share is nearly empty.
+	 **/
+	class job_queue
+	{
+	public:
+		void push(size_t i) { q.push_back(i); }
+
+		bool take(size_t& i)
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if (q.empty())
+				return false;
+			i = q.front();
+			q.pop_front();
+			return true;
+		}
+
+		bool steal(size_t& i)
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if (q.empty())
+				return false;
+			i = q.back();
+			q.pop_back();
+			return true;
+		}
+
+	private:
+		std::mutex m;
+		std::deque<size_t> q;
+	};
+
+	/// @return true If all of s is a hex number, which is stored in val.
+	bool parse_hex(const std::string& s, uint64_t& val)
+	{
+		std::istringstream iss(s);
+		return (iss >> std::hex >> val) && iss.eof();
+	}
+
+	/// @return s as a quoted JSON string.
+	std::string json_string(const std::string& s)
+	{
+		std::string out = "\"";
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+				out += std::string("\\") + c;
+			else if (uint8_t(c) < 0x20)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			}
+			else
+				out += c;
+		}
+		return out + "\"";
+	}
+}
+
+batch::batch(cpu_single_hart::engine_type e, uint64_t mem_size, uint64_t exec_limit)
+	: engine(e), default_mem_size(mem_size), default_exec_limit(exec_limit)
+{
+}
+
+bool batch::read_manifest(const std::string& fname)
+{
+	std::ifstream in(fname);
+	if (in.fail())
+	{
+		cerr << "Can’t open file '" << fname << "' for reading." << endl;
+		return false;
+	}
+
+	std::string line;
+	for (unsigned lineno = 1; std::getline(in, line); lineno++)
+	{
+		std::istringstream iss(line);
+		job j { "", default_mem_size, default_exec_limit };
+		if (!(iss >> j.image) || j.image[0] == '#')
+			continue;
+		std::string mem_size, exec_limit, extra;
+		iss >> mem_size >> exec_limit >> extra;
+		if (!extra.empty() || (!mem_size.empty() && !parse_hex(mem_size, j.mem_size))
+			|| (!exec_limit.empty() && !parse_hex(exec_limit, j.exec_limit)))
+		{
+			cerr << fname << ":" << lineno << ": expected 'image [hex-mem-size [hex-exec-limit]]'" << endl;
+			return false;
+		}
+		jobs.push_back(j);
+	}
+	return true;
+}
+
+void batch::run_job(size_t i)
+{
+	const job& j = jobs[i];
+	result& r = results[i];
+
+	memory mem(j.mem_size);
+	uint32_t start_pc = 0;
+	if (elf32::is_elf(j.image))
+	{
+		elf32 elf;
+		if (!elf.load(j.image, mem))
+			return;
+		start_pc = elf.get_entry();
+	}
+	else if (!mem.load_file(j.image, 0))
+		return;
+	r.loaded = true;
+
+	cpu_single_hart cpu(mem);
+	cpu.reset();
+	cpu.set_pc(start_pc);
+	cpu.set_sp(mem.get_size());
+	cpu.set_engine(engine);
+	cpu.execute(j.exec_limit);
+
+	r.halted = cpu.is_halted();
+	r.halt_reason = cpu.get_halt_reason();
+	r.insns = cpu.get_insn_counter();
+	r.pc = cpu.get_pc();
+	for (uint32_t reg = 0; reg < 32; reg++)
+		r.regs[reg] = cpu.get_reg(reg);
+}
+
+void batch::run(unsigned nthreads)
+{
+	if (nthreads == 0)
+		nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+	if (nthreads > jobs.size())
+		nthreads = std::max<size_t>(jobs.size(), 1);
+
+	results.assign(jobs.size(), result());
+
+	// hand each thread a contiguous run of the manifest
+	std::vector<job_queue> queues(nthreads);
+	for (size_t i = 0; i < jobs.size(); i++)
+		queues[i * nthreads / jobs.size()].push(i);
+
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < nthreads; t++)
+	{
+		threads.emplace_back([this, &queues, t, nthreads]
+		{
+			size_t i;
+			for (;;)
+			{
+				if (queues[t].take(i))
+				{
+					run_job(i);
+					continue;
+				}
+				// no job of our own is left, so look for one to steal
+				bool stolen = false;
+				for (unsigned v = 1; v < nthreads && !stolen; v++)
+					stolen = queues[(t + v) % nthreads].steal(i);
+				if (!stolen)
+					return;	// nothing is ever queued once the threads start
+				run_job(i);
+			}
+		});
+	}
+	for (std::thread& t : threads)
+		t.join();
+}
+
+void batch::report(std::ostream& os) const
+{
+	uint64_t total = 0;
+	os << "{\n\t\"jobs\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const result& r = results[i];
+		total += r.insns;
+		os << (i ? "," : "") << "\n\t\t{ \"image\": " << json_string(jobs[i].image)
+			<< ", \"loaded\": " << (r.loaded ? "true" : "false");
+		if (r.loaded)
+		{
+			os << ", \"halted\": " << (r.halted ? "true" : "false")
+				<< ", \"halt_reason\": " << json_string(r.halt_reason)
+				<< ", \"insns\": " << r.insns
+				<< ", \"pc\": \"" << hex::to_hex0x32(r.pc) << "\", \"regs\": [";
+			for (uint32_t reg = 0; reg < 32; reg++)
+				os << (reg ? ", " : "") << "\"" << hex::to_hex0x32(r.regs[reg]) << "\"";
+			os << "]";
+		}
+		os << " }";
+	}
+	os << "\n\t],\n\t\"insns\": " << total << "\n}" << endl;
+}
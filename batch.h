@@ -0,0 +1,83 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "cpu_single_hart.h"
+#include <string>
+#include <vector>
+
+/**
+ * Runs many independent programs, each on its own memory and
+ * 	cpu_single_hart, spread over a pool of host threads.
+ *
+ * The jobs come from a manifest with one job per line:
+ *
+ * 	image [hex-mem-size [hex-exec-limit]]
+ *
+ * Blank lines and lines starting with '#' are skipped, and the sizes left
+ * 	out default to the ones given to the constructor.  An image is loaded
+ * 	like the command line infile: an ELF32 file at its own addresses and
+ * 	anything else at address 0.
+ **/
+class batch
+{
+public:
+	/// One line of the manifest.
+	struct job
+	{
+		std::string image;
+		uint64_t mem_size;
+		uint64_t exec_limit;	///< 0 for no limit
+	};
+
+	/// What a job left behind.
+	struct result
+	{
+		bool loaded = { false };	///< false if the image could not be loaded
+		bool halted = { false };	///< false if the exec limit stopped it
+		std::string halt_reason;
+		uint64_t insns = { 0 };
+		uint32_t pc = { 0 };
+		int32_t regs[32] = {};
+	};
+
+	/**
+	 * @param e The engine that runs every job.
+	 * @param mem_size The memory size of jobs that do not give one.
+	 * @param exec_limit The exec limit of jobs that do not give one.
+	 **/
+	batch(cpu_single_hart::engine_type e, uint64_t mem_size, uint64_t exec_limit);
+
+	/**
+	 * @brief Append the jobs listed in the manifest fname.
+	 * @return false After printing why to std::cerr if the file can not be
+	 * 	read or a line can not be parsed.
+	 **/
+	bool read_manifest(const std::string& fname);
+
+	/**
+	 * @brief Run every job on nthreads threads.
+	 *
+	 * Each thread starts with an equal share of the jobs and, once its own
+	 * 	share is done, steals jobs from the back of the other threads'
+	 * 	shares, so a few long jobs do not leave the other threads idle.
+	 * @param nthreads The number of threads, or 0 for one per host core.
+	 **/
+	void run(unsigned nthreads);
+
+	/// @brief Write the results of every job, in manifest order, as a JSON document.
+	void report(std::ostream& os) const;
+
+	const std::vector<job>& get_jobs() const { return jobs; }
+	const std::vector<result>& get_results() const { return results; }
+
+private:
+	/// @brief Load and run jobs[i] and fill in results[i].
+	void run_job(size_t i);
+
+	cpu_single_hart::engine_type engine;
+	uint64_t default_mem_size;
+	uint64_t default_exec_limit;
+	std::vector<job> jobs;
+	std::vector<result> results;
+};
+
+#endif // BATCH_H
@@ -0,0 +1,400 @@
+//*********************************
+//
+// RISC-V Simulator
+//
+// Engine benchmark: runs a suite of guest programs on each execution
+// engine several times and reports millions of guest instructions per
+// host second.  Can save the results as a baseline and fail a later run
+// that is slower than it.
+//
+//*********************************
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include <stdlib.h>
+#include "cpu_single_hart.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+/**
+ * @brief ALU: a loop of adds, xors and shifts with a store, a load and two
+ * 	well predicted branches.
+ **/
+static const uint32_t alu_loop[] =
+{
+	0x00002437,	// lui	s0,0x2
+	0x00000513,	// addi	a0,zero,0
+	0x00000293,	// addi	t0,zero,0
+	0x00000313,	// outer:	addi	t1,zero,0
+	0x06400393,	// addi	t2,zero,100
+	0x00650533,	// inner:	add	a0,a0,t1
+	0x006545b3,	// xor	a1,a0,t1
+	0x00359613,	// slli	a2,a1,3
+	0x40c02023,	// sw	a2,0x400(zero)
+	0x40002683,	// lw	a3,0x400(zero)
+	0x00130313,	// addi	t1,t1,1
+	0xfe7344e3,	// blt	t1,t2,inner
+	0x00128293,	// addi	t0,t0,1
+	0xfc829ce3,	// bne	t0,s0,outer
+	0x00100073,	// ebreak
+};
+
+/**
+ * @brief Branchy: three branches a trip on the bits of a xorshift generator,
+ * 	so their directions are close to random.
+ **/
+static const uint32_t branch_loop[] =
+{
+	0x123455b7,	// lui	a1,0x12345
+	0x67858593,	// addi	a1,a1,0x678
+	0x00000513,	// addi	a0,zero,0
+	0x000402b7,	// lui	t0,0x40
+	0x00d59313,	// loop:	slli	t1,a1,13
+	0x0065c5b3,	// xor	a1,a1,t1
+	0x0115d313,	// srli	t1,a1,17
+	0x0065c5b3,	// xor	a1,a1,t1
+	0x00559313,	// slli	t1,a1,5
+	0x0065c5b3,	// xor	a1,a1,t1
+	0x0015f393,	// andi	t2,a1,1
+	0x00038663,	// beq	t2,zero,even
+	0x00b50533,	// add	a0,a0,a1
+	0x0080006f,	// jal	zero,next
+	0x40b50533,	// even:	sub	a0,a0,a1
+	0x0065f393,	// next:	andi	t2,a1,6
+	0x00039463,	// bne	t2,zero,skip
+	0x00150513,	// addi	a0,a0,1
+	0x0005c463,	// skip:	blt	a1,zero,neg
+	0x05554513,	// xori	a0,a0,0x55
+	0xfff28293,	// neg:	addi	t0,t0,-1
+	0xfa029ee3,	// bne	t0,zero,loop
+	0x00100073,	// ebreak
+};
+
+/**
+ * @brief Memory copy: copies 16 KiB a word at a time, four words a trip,
+ * 	256 times over.
+ **/
+static const uint32_t copy_loop[] =
+{
+	0x00002437,	// lui	s0,0x2
+	0x000064b7,	// lui	s1,0x6
+	0x00004937,	// lui	s2,0x4
+	0x00000293,	// addi	t0,zero,0
+	0x00540333,	// fill:	add	t1,s0,t0
+	0x00532023,	// sw	t0,0(t1)
+	0x00428293,	// addi	t0,t0,4
+	0xff229ae3,	// bne	t0,s2,fill
+	0x10000993,	// addi	s3,zero,256
+	0x000402b3,	// rep:	add	t0,s0,zero
+	0x00048333,	// add	t1,s1,zero
+	0x012403b3,	// add	t2,s0,s2
+	0x0002a603,	// copy:	lw	a2,0(t0)
+	0x0042a683,	// lw	a3,4(t0)
+	0x0082a703,	// lw	a4,8(t0)
+	0x00c2a783,	// lw	a5,12(t0)
+	0x00c32023,	// sw	a2,0(t1)
+	0x00d32223,	// sw	a3,4(t1)
+	0x00e32423,	// sw	a4,8(t1)
+	0x00f32623,	// sw	a5,12(t1)
+	0x01028293,	// addi	t0,t0,16
+	0x01030313,	// addi	t1,t1,16
+	0xfc72ece3,	// bltu	t0,t2,copy
+	0xfff98993,	// addi	s3,s3,-1
+	0xfc0992e3,	// bne	s3,zero,rep
+	0xffc32503,	// lw	a0,-4(t1)
+	0x00100073,	// ebreak
+};
+
+/**
+ * @brief Pointer chasing: links 64 KiB of words into one cycle with a
+ * 	large stride and then follows it, each load waiting on the last.
+ **/
+static const uint32_t chase_loop[] =
+{
+	0x00010437,	// lui	s0,0x10
+	0x000104b7,	// lui	s1,0x10
+	0x00000913,	// addi	s2,zero,0
+	0x000039b7,	// lui	s3,0x3
+	0x94c98993,	// addi	s3,s3,-0x6b4
+	0xffc48a13,	// addi	s4,s1,-4
+	0x013902b3,	// build:	add	t0,s2,s3
+	0x0142f2b3,	// and	t0,t0,s4
+	0x008282b3,	// add	t0,t0,s0
+	0x012403b3,	// add	t2,s0,s2
+	0x0053a023,	// sw	t0,0(t2)
+	0x00490913,	// addi	s2,s2,4
+	0xfe9914e3,	// bne	s2,s1,build
+	0x00040533,	// add	a0,s0,zero
+	0x002002b7,	// lui	t0,0x200
+	0x00052503,	// walk:	lw	a0,0(a0)
+	0x00052503,	// lw	a0,0(a0)
+	0x00052503,	// lw	a0,0(a0)
+	0x00052503,	// lw	a0,0(a0)
+	0xffc28293,	// addi	t0,t0,-4
+	0xfe0296e3,	// bne	t0,zero,walk
+	0x00100073,	// ebreak
+};
+
+/**
+ * @brief Calls: a recursive fib(25), pushing and popping a frame on each call.
+ **/
+static const uint32_t fib_calls[] =
+{
+	0x00010137,	// lui	sp,0x10
+	0x01900513,	// addi	a0,zero,25
+	0x008000ef,	// jal	ra,fib
+	0x00100073,	// ebreak
+	0x00200293,	// fib:	addi	t0,zero,2
+	0x02554e63,	// blt	a0,t0,done
+	0xff410113,	// addi	sp,sp,-12
+	0x00112023,	// sw	ra,0(sp)
+	0x00812223,	// sw	s0,4(sp)
+	0x00a12423,	// sw	a0,8(sp)
+	0xfff50513,	// addi	a0,a0,-1
+	0xfe5ff0ef,	// jal	ra,fib
+	0x00050433,	// add	s0,a0,zero
+	0x00812503,	// lw	a0,8(sp)
+	0xffe50513,	// addi	a0,a0,-2
+	0xfd5ff0ef,	// jal	ra,fib
+	0x00850533,	// add	a0,a0,s0
+	0x00412403,	// lw	s0,4(sp)
+	0x00012083,	// lw	ra,0(sp)
+	0x00c10113,	// addi	sp,sp,12
+	0x00008067,	// done:	jalr	zero,0(ra)
+};
+
+/// A guest program of the suite.
+struct program
+{
+	const char* name;
+	const uint32_t* code;
+	size_t len;	///< in words
+	uint32_t a0;	///< the result it leaves in a0 at the ebreak
+};
+
+#define PROGRAM(n, c, a0) { n, c, sizeof(c) / sizeof(c[0]), a0 }
+
+static const program programs[] =
+{
+	PROGRAM("alu", alu_loop, 0x026ac000),
+	PROGRAM("branch", branch_loop, 0x3b8de693),
+	PROGRAM("copy", copy_loop, 0x00003ffc),
+	PROGRAM("chase", chase_loop, 0x00010000),
+	PROGRAM("calls", fib_calls, 0x00012511),
+};
+
+static constexpr uint64_t mem_size = 0x20000;	///< big enough for every program
+
+/// An engine with the name -e and the baseline file know it by.
+struct engine
+{
+	const char* name;
+	cpu_single_hart::engine_type type;
+};
+
+static const engine engines[] =
+{
+	{ "tick", cpu_single_hart::engine_tick },
+	{ "threaded", cpu_single_hart::engine_threaded },
+	{ "block", cpu_single_hart::engine_block },
+	{ "jit", cpu_single_hart::engine_jit },
+};
+
+/**
+ * @brief Standard errors printed when the command line is used improperly.
+ **/
+static void usage()
+{
+	cerr << "Usage : bench [-e engine] [-n runs] [-w baseline-file] [-b baseline-file] [-t percent] [program...]\n";
+	cerr << "-e run this engine: tick, threaded, block or jit, and may be repeated ( default = all of them )\n";
+	cerr << "-n times to run each program on each engine ( default = 5 )\n";
+	cerr << "-w save the mean MIPS of each program and engine to this file\n";
+	cerr << "-b compare the mean MIPS against a file saved by -w, and exit 1 if any is\n";
+	cerr << "   slower by more than -t percent\n";
+	cerr << "-t the slowdown -b allows, in percent ( default = 10 )\n";
+	cerr << "programs: alu, branch, copy, chase, calls ( default = all of them )\n";
+	exit(1);
+}
+
+/**
+ * @brief Load program p into a fresh memory and run it to its ebreak on engine e.
+ * @param ips Set to the guest insns executed per host second.
+ * @return false If it halted for another reason or left the wrong result in a0.
+ **/
+static bool measure(const program& p, cpu_single_hart::engine_type e, double& ips)
+{
+	memory mem(mem_size);
+	for (uint32_t i = 0; i < p.len; i++)
+		mem.set32(i * 4, p.code[i]);
+
+	cpu_single_hart cpu(mem);
+	cpu.reset();
+	cpu.set_engine(e);
+
+	// run() reports the halt reason and insn count on cout
+	std::ostringstream discard;
+	std::streambuf* out = cout.rdbuf(discard.rdbuf());
+	auto start = std::chrono::steady_clock::now();
+	cpu.run(0);
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	cout.rdbuf(out);
+
+	ips = cpu.get_insn_counter() / secs.count();
+	return cpu.get_halt_reason() == " EBREAK instruction " && uint32_t(cpu.get_reg(10)) == p.a0;
+}
+
+/**
+ * @brief Read a baseline file of "program engine mips" lines.
+ * @return false If the file could not be read.
+ **/
+static bool load_baseline(const std::string& fname, std::map<std::string, double>& baseline)
+{
+	std::ifstream in(fname);
+	if (!in)
+	{
+		cerr << "Can’t open file '" << fname << "' for reading." << endl;
+		return false;
+	}
+	std::string name, engine;
+	double mips;
+	while (in >> name >> engine >> mips)
+		baseline[name + " " + engine] = mips;
+	return true;
+}
+
+/**
+ * @brief usage: bench [options] [program...]
+ **/
+int main(int argc, char **argv)
+{
+	std::vector<const engine*> run_engines;
+	unsigned runs = 5;
+	double threshold = 10;
+	std::string save_file;
+	std::string baseline_file;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:e:n:t:w:")) != -1)
+	{
+		std::istringstream iss(optarg ? optarg : "");
+		switch (opt)
+		{
+		case 'b': baseline_file = optarg; break;
+		case 'e':
+			{
+				const engine* found = nullptr;
+				for (const engine& e : engines)
+					if (optarg == std::string(e.name))
+						found = &e;
+				if (!found)
+					usage();
+				run_engines.push_back(found);
+			}
+			break;
+		case 'n': iss >> runs; break;
+		case 't': iss >> threshold; break;
+		case 'w': save_file = optarg; break;
+		default: usage();
+		}
+	}
+	if (runs == 0)
+		usage();
+	if (run_engines.empty())
+		for (const engine& e : engines)
+			run_engines.push_back(&e);
+
+	std::vector<const program*> run_programs;
+	for (int i = optind; i < argc; i++)
+	{
+		const program* found = nullptr;
+		for (const program& p : programs)
+			if (argv[i] == std::string(p.name))
+				found = &p;
+		if (!found)
+			usage();
+		run_programs.push_back(found);
+	}
+	if (run_programs.empty())
+		for (const program& p : programs)
+			run_programs.push_back(&p);
+
+	std::map<std::string, double> baseline;
+	if (!baseline_file.empty() && !load_baseline(baseline_file, baseline))
+		return 1;
+
+	std::ofstream save;
+	if (!save_file.empty())
+	{
+		save.open(save_file);
+		if (!save)
+		{
+			cerr << "Can’t open file '" << save_file << "' for writing." << endl;
+			return 1;
+		}
+	}
+
+	bool failed = false;
+	cout << std::fixed;
+	cout.precision(1);
+	cout << "program engine        mean MIPS  stddev     min     max" << endl;
+	for (const program* p : run_programs)
+	{
+		for (const engine* e : run_engines)
+		{
+			std::vector<double> mips;
+			bool ok = true;
+			for (unsigned i = 0; i < runs; i++)
+			{
+				double ips;
+				ok = measure(*p, e->type, ips) && ok;
+				mips.push_back(ips / 1e6);
+			}
+
+			double mean = 0;
+			for (double m : mips)
+				mean += m;
+			mean /= mips.size();
+			double var = 0;
+			for (double m : mips)
+				var += (m - mean) * (m - mean);
+			double stddev = mips.size() > 1 ? std::sqrt(var / (mips.size() - 1)) : 0;
+			auto range = std::minmax_element(mips.begin(), mips.end());
+
+			cout << std::left << std::setw(8) << p->name << std::setw(10) << e->name << std::right
+				<< std::setw(13) << mean << std::setw(8) << stddev
+				<< std::setw(8) << *range.first << std::setw(8) << *range.second;
+			if (!ok)
+			{
+				cout << "  wrong result";
+				failed = true;
+			}
+
+			std::string key = std::string(p->name) + " " + e->name;
+			auto base = baseline.find(key);
+			if (base != baseline.end())
+			{
+				double change = 100 * (mean - base->second) / base->second;
+				cout << "  " << std::showpos << change << std::noshowpos << "% vs " << base->second;
+				if (change < -threshold)
+				{
+					cout << "  REGRESSION";
+					failed = true;
+				}
+			}
+			cout << endl;
+
+			if (save)
+				save << key << " " << mean << "\n";
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,250 @@
+#include "binary_trace.h"
+#include <algorithm>
+
+constexpr char binary_trace::magic[8];
+
+namespace
+{
+	/// @brief Append v to p as a varint, 7 bits a byte, low bits first.
+	char* put_varint(char* p, uint32_t v)
+	{
+		while (v >= 0x80)
+		{
+			*p++ = char(v | 0x80);
+			v >>= 7;
+		}
+		*p++ = char(v);
+		return p;
+	}
+
+	/// @brief Append v to p as 4 bytes, little-endian.
+	char* put_word(char* p, uint32_t v)
+	{
+		for (int i = 0; i < 4; i++, v >>= 8)
+			*p++ = char(v);
+		return p;
+	}
+}
+
+binary_trace::hart_state& binary_trace::get_hart(uint32_t hart)
+{
+	if (hart >= harts.size())
+		harts.resize(hart + 1);
+	return harts[hart];
+}
+
+bool binary_trace::cached(uint32_t pc, uint32_t insn)
+{
+	uint64_t& e = insn_cache[(pc >> 2) & (insn_cache_size - 1)];
+	uint64_t want = uint64_t(pc) << 32 | insn;
+	if (e == want)
+		return true;
+	e = want;
+	return false;
+}
+
+binary_trace_writer::binary_trace_writer(std::ostream& o, uint64_t mem_size, uint32_t nharts) : out(o.rdbuf())
+{
+	char buf[sizeof(magic) + 12];
+	char* p = std::copy(magic, magic + sizeof(magic), buf);
+	p = put_word(p, mem_size);
+	p = put_word(p, mem_size >> 32);
+	p = put_word(p, nharts);
+	out->sputn(buf, p - buf);
+}
+
+void binary_trace_writer::start(uint32_t hart, const registerfile& regs)
+{
+	hart_state& h = get_hart(hart);
+	h.started = true;
+	current_hart = hart;
+
+	char buf[1 + 5 + 32 * 4];
+	char* p = buf;
+	*p++ = char(start_flag);
+	p = put_varint(p, hart);
+	for (int i = 0; i < 32; i++)
+	{
+		h.regs[i] = regs.get(i);
+		p = put_word(p, h.regs[i]);
+	}
+	out->sputn(buf, p - buf);
+}
+
+void binary_trace_writer::write(const trace_record& r)
+{
+	hart_state& h = get_hart(r.hart);
+	uint8_t flags = 0;
+	char buf[1 + 5 * 6 + 4];
+	char* p = buf + 1;
+
+	if (r.hart != current_hart)
+	{
+		flags |= hart_flag;
+		p = put_varint(p, r.hart);
+		current_hart = r.hart;
+	}
+	if (r.pc != h.pc + 4)
+	{
+		flags |= pc_flag;
+		p = put_varint(p, zigzag(r.pc - (h.pc + 4)));
+	}
+	h.pc = r.pc;
+	if (!cached(r.pc, r.insn))
+	{
+		flags |= insn_flag;
+		p = put_word(p, r.insn);
+	}
+	if (r.rd_written)
+	{
+		int32_t& rd = h.regs[rd_of(r.insn)];
+		flags |= rd_flag;
+		p = put_varint(p, zigzag(uint32_t(r.rd_value) - uint32_t(rd)));
+		rd = r.rd_value;
+	}
+	if (r.mem)
+	{
+		flags |= mem_flag;
+		p = put_varint(p, zigzag(r.mem_addr - h.mem_addr));
+		p = put_varint(p, zigzag(r.mem_value - h.mem_value));
+		h.mem_addr = r.mem_addr;
+		h.mem_value = r.mem_value;
+	}
+
+	buf[0] = char(flags);
+	out->sputn(buf, p - buf);
+}
+
+bool binary_trace_reader::read_varint(uint32_t& v)
+{
+	v = 0;
+	for (int shift = 0; shift < 35; shift += 7)
+	{
+		int c = in->sbumpc();
+		if (c == EOF)
+			return false;
+		v |= uint32_t(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool binary_trace_reader::read_word(uint32_t& v)
+{
+	unsigned char b[4];
+	if (in->sgetn(reinterpret_cast<char*>(b), 4) != 4)
+		return false;
+	v = b[0] | b[1] << 8 | b[2] << 16 | uint32_t(b[3]) << 24;
+	return true;
+}
+
+bool binary_trace_reader::read_header()
+{
+	char m[sizeof(magic)];
+	uint32_t lo, hi;
+	if (in->sgetn(m, sizeof(m)) != sizeof(m) || !std::equal(m, m + sizeof(m), magic)
+		|| !read_word(lo) || !read_word(hi) || !read_word(nharts))
+		return false;
+	mem_size = uint64_t(hi) << 32 | lo;
+	return true;
+}
+
+bool binary_trace_reader::next(trace_record& r)
+{
+	if (pending)
+	{
+		get_hart(pending_hart).regs[pending_rd] = pending_value;
+		pending = false;
+	}
+
+	for (;;)
+	{
+		int c = in->sbumpc();
+		if (c == EOF)
+			return false;
+		uint8_t flags = c;
+		uint32_t v;
+
+		if (flags == start_flag)
+		{
+			if (!read_varint(current_hart))
+				break;
+			hart_state& h = get_hart(current_hart);
+			h.started = true;
+			for (int i = 0; i < 32; i++)
+			{
+				if (!read_word(v))
+				{
+					truncated = true;
+					return false;
+				}
+				h.regs[i] = v;
+			}
+			continue;
+		}
+		if (flags & ~(hart_flag | pc_flag | insn_flag | rd_flag | mem_flag))
+			break;
+
+		if ((flags & hart_flag) && !read_varint(current_hart))
+			break;
+		hart_state& h = get_hart(current_hart);
+		if (!h.started)
+			break;
+		r.hart = current_hart;
+
+		r.pc = h.pc + 4;
+		if (flags & pc_flag)
+		{
+			if (!read_varint(v))
+				break;
+			r.pc += unzigzag(v);
+		}
+		h.pc = r.pc;
+
+		if (flags & insn_flag)
+		{
+			if (!read_word(r.insn))
+				break;
+			cached(r.pc, r.insn);
+		}
+		else
+		{
+			uint64_t e = insn_cache[(r.pc >> 2) & (insn_cache_size - 1)];
+			if (e >> 32 != r.pc)
+				break;
+			r.insn = uint32_t(e);
+		}
+
+		r.rd_written = flags & rd_flag;
+		if (r.rd_written)
+		{
+			uint32_t rd = rd_of(r.insn);
+			if (!read_varint(v) || rd == 0)
+				break;
+			r.rd_value = uint32_t(h.regs[rd]) + unzigzag(v);
+			pending = true;
+			pending_hart = current_hart;
+			pending_rd = rd;
+			pending_value = r.rd_value;
+		}
+		else
+			r.rd_value = h.regs[rd_of(r.insn)];
+
+		r.mem = flags & mem_flag;
+		if (r.mem)
+		{
+			uint32_t a, d;
+			if (!read_varint(a) || !read_varint(d))
+				break;
+			h.mem_addr += unzigzag(a);
+			h.mem_value += unzigzag(d);
+		}
+		r.mem_addr = h.mem_addr;
+		r.mem_value = h.mem_value;
+		return true;
+	}
+
+	truncated = true;
+	return false;
+}
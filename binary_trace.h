@@ -0,0 +1,173 @@
+#ifndef BINARY_TRACE_H
+#define BINARY_TRACE_H
+#include "registerfile.h"
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+/**
+ * One insn as it appears in a binary trace.
+ **/
+struct trace_record
+{
+	uint32_t hart;	///< the mhartid of the hart that ran it
+	uint32_t pc;
+	uint32_t insn;
+	bool rd_written;	///< rd changed, to rd_value
+	int32_t rd_value;
+	bool mem;	///< the insn read or wrote memory at mem_addr
+	uint32_t mem_addr;
+	uint32_t mem_value;	///< the value read, or for a store or sc.w the value written
+};
+
+/**
+ * The state that the writer and the reader of a binary trace both keep, so
+ * 	that each record can be written as the difference from what came
+ * 	before it.
+ *
+ * A trace is a header (the magic "RV32ITR", a version byte, the memory size
+ * 	as 8 bytes and the number of harts as 4, little-endian) followed by
+ * 	records.  Each record starts with a byte of flags saying which of
+ * 	these follow it, in this order:
+ *
+ * 	- hart_flag: the hart that ran the insn when it is not the one that
+ * 	  ran the previous one, as a varint.
+ * 	- pc_flag: the pc less the previous pc of that hart + 4, as a zigzag varint.
+ * 	- insn_flag: the insn as 4 bytes, when it is not the one last seen at
+ * 	  that pc in a small direct-mapped cache.
+ * 	- rd_flag: the new rd less the old, as a zigzag varint.  rd is not
+ * 	  recorded when the insn left it as it was.
+ * 	- mem_flag: the memory address and value less the previous ones of
+ * 	  that hart, as zigzag varints.
+ *
+ * A record whose flags are just start_flag instead gives the hart as a
+ * 	varint and then all 32 of its registers as 4 bytes each, and comes
+ * 	before the first insn of each hart.  The common insn, one that runs
+ * 	straight on from the last, hits the cache and changes rd by a little,
+ * 	takes 2 bytes.
+ **/
+class binary_trace
+{
+public:
+	static constexpr char magic[8] = { 'R', 'V', '3', '2', 'I', 'T', 'R', 1 };
+
+protected:
+	static constexpr uint8_t hart_flag = 0x01;
+	static constexpr uint8_t pc_flag = 0x02;
+	static constexpr uint8_t insn_flag = 0x04;
+	static constexpr uint8_t rd_flag = 0x08;
+	static constexpr uint8_t mem_flag = 0x10;
+	static constexpr uint8_t start_flag = 0x80;
+
+	static constexpr size_t insn_cache_size = 4096;	///< entries, a power of two
+
+	struct hart_state
+	{
+		bool started = { false };
+		uint32_t pc = { 0 };	///< of the hart's last insn
+		uint32_t mem_addr = { 0 };
+		uint32_t mem_value = { 0 };
+		int32_t regs[32] = {};
+	};
+
+	/// @brief Return the state of hart, making room for it if needed.
+	hart_state& get_hart(uint32_t hart);
+
+	/// @return true If insn was the last insn seen at pc, remembering it if not.
+	bool cached(uint32_t pc, uint32_t insn);
+
+	static uint32_t zigzag(int32_t v) { return uint32_t(v) << 1 ^ uint32_t(v >> 31); }
+	static int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+	static uint32_t rd_of(uint32_t insn) { return (insn >> 7) & 0x1f; }
+
+	std::vector<hart_state> harts;
+	uint32_t current_hart = { 0 };
+	std::vector<uint64_t> insn_cache = std::vector<uint64_t>(insn_cache_size, ~uint64_t(0));	///< pc << 32 | insn
+};
+
+/**
+ * Writes the insns that harts run to a stream as a binary trace.
+ *
+ * The registers of a hart are only followed through the insns written
+ * 	for it, so they must not be changed by other means once its first
+ * 	insn has been written.
+ **/
+class binary_trace_writer : public binary_trace
+{
+public:
+	/**
+	 * @param out Where the trace goes.  It should be opened in binary mode.
+	 * @param mem_size The size of the memory the harts run on.
+	 * @param nharts The number of harts that will write to the trace.
+	 **/
+	binary_trace_writer(std::ostream& out, uint64_t mem_size, uint32_t nharts);
+
+	/// @return true If the registers of hart have already been written.
+	bool is_started(uint32_t hart) { return get_hart(hart).started; }
+
+	/// @brief Write the registers of hart as they are before its first insn.
+	void start(uint32_t hart, const registerfile& regs);
+
+	/// @brief Write r, which must be for a hart that has been started.
+	void write(const trace_record& r);
+
+private:
+	std::streambuf* out;
+};
+
+/**
+ * Reads back the insns written by a binary_trace_writer.
+ **/
+class binary_trace_reader : public binary_trace
+{
+public:
+	/**
+	 * @param in The trace.  It should be opened in binary mode.
+	 **/
+	explicit binary_trace_reader(std::istream& in) : in(in.rdbuf()) {}
+
+	/**
+	 * @brief Read the header.
+	 * @return false If the stream does not start with a binary trace header.
+	 **/
+	bool read_header();
+
+	uint64_t get_mem_size() const { return mem_size; }
+	uint32_t get_nharts() const { return nharts; }
+
+	/**
+	 * @brief Read the next insn into r.
+	 * @return false At the end of the trace, or if the rest of it is not
+	 * 	a valid record.
+	 **/
+	bool next(trace_record& r);
+
+	/// @return true If the trace ended with a record cut short or not valid.
+	bool is_truncated() const { return truncated; }
+
+	/**
+	 * @return The registers of hart as they were before the insn that next()
+	 * 	last read for it ran.
+	 **/
+	const int32_t* get_regs(uint32_t hart) { return get_hart(hart).regs; }
+
+private:
+	/// @brief Read a varint into v.
+	bool read_varint(uint32_t& v);
+	/// @brief Read 4 bytes, little-endian, into v.
+	bool read_word(uint32_t& v);
+
+	std::streambuf* in;
+	uint64_t mem_size = { 0 };
+	uint32_t nharts = { 0 };
+	bool truncated = { false };
+
+	// the rd change of the last record is applied when the next one is read
+	bool pending = { false };
+	uint32_t pending_hart = { 0 };
+	uint32_t pending_rd = { 0 };
+	int32_t pending_value = { 0 };
+};
+
+#endif // BINARY_TRACE_H
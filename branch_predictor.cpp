@@ -0,0 +1,422 @@
+#include "branch_predictor.h"
+#include "hex.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+	/// @return true If n is a power of two from 1 up to max.
+	bool is_size(uint32_t n, uint32_t max)
+	{
+		return n && !(n & (n - 1)) && n <= max;
+	}
+
+	/// @brief Move a two-bit counter towards taken or not.
+	void train(uint8_t& c, bool taken)
+	{
+		if (taken && c < 3)
+			c++;
+		else if (!taken && c > 0)
+			c--;
+	}
+
+	/// A table of two-bit counters indexed by pc.
+	class bimodal_predictor : public branch_predictor
+	{
+	public:
+		bimodal_predictor(const std::string& name, uint32_t entries)
+			: branch_predictor(name), counters(entries, 1), mask(entries - 1) {}
+
+		outcome predict(const transfer& t) override
+		{
+			if (t.k != kind_cond)
+				return outcome_none;
+			uint8_t& c = counters[(t.pc >> 2) & mask];
+			bool guess = c >= 2;
+			train(c, t.taken);
+			return guess == t.taken ? outcome_right : outcome_wrong;
+		}
+
+	private:
+		std::vector<uint8_t> counters;
+		uint32_t mask;
+	};
+
+	/// Two-bit counters indexed by pc xor the recent branch directions.
+	class gshare_predictor : public branch_predictor
+	{
+	public:
+		gshare_predictor(const std::string& name, uint32_t entries, uint32_t history_bits)
+			: branch_predictor(name), counters(entries, 1), mask(entries - 1),
+			history_mask(history_bits < 32 ? (uint32_t(1) << history_bits) - 1 : UINT32_MAX) {}
+
+		outcome predict(const transfer& t) override
+		{
+			if (t.k != kind_cond)
+				return outcome_none;
+			uint8_t& c = counters[((t.pc >> 2) ^ history) & mask];
+			bool guess = c >= 2;
+			train(c, t.taken);
+			history = ((history << 1) | t.taken) & history_mask;
+			return guess == t.taken ? outcome_right : outcome_wrong;
+		}
+
+	private:
+		std::vector<uint8_t> counters;
+		uint32_t mask;
+		uint32_t history_mask;
+		uint32_t history = { 0 };
+	};
+
+	/**
+	 * A small TAGE: a bimodal base table and four tagged tables indexed by
+	 * 	pc hashed with 5, 15, 44 and 130 branch directions.  The longest
+	 * 	history that matches gives the prediction, and a misprediction takes
+	 * 	an entry in a longer table that is not being useful.
+	 **/
+	class tage_predictor : public branch_predictor
+	{
+	public:
+		explicit tage_predictor(const std::string& name)
+			: branch_predictor(name), base(1 << base_bits, 1), history(history_size, 0)
+		{
+			static const uint32_t lengths[ntables] = { 5, 15, 44, 130 };
+			for (int i = 0; i < ntables; i++)
+			{
+				tables[i].assign(1 << table_bits, entry());
+				length[i] = lengths[i];
+				index_hash[i] = folded(lengths[i], table_bits);
+				tag_hash[i] = folded(lengths[i], tag_bits);
+				tag_hash2[i] = folded(lengths[i], tag_bits - 1);
+			}
+		}
+
+		outcome predict(const transfer& t) override
+		{
+			if (t.k != kind_cond)
+				return outcome_none;
+
+			uint32_t index[ntables];
+			uint16_t tag[ntables];
+			int provider = -1;
+			int alt = -1;
+			for (int i = ntables - 1; i >= 0; i--)
+			{
+				index[i] = ((t.pc >> 2) ^ (t.pc >> (2 + table_bits)) ^ index_hash[i].value) & ((1 << table_bits) - 1);
+				tag[i] = ((t.pc >> 2) ^ tag_hash[i].value ^ (tag_hash2[i].value << 1)) & ((1 << tag_bits) - 1);
+				if (tables[i][index[i]].tag == tag[i])
+				{
+					if (provider < 0)
+						provider = i;
+					else if (alt < 0)
+						alt = i;
+				}
+			}
+
+			uint8_t& b = base[(t.pc >> 2) & ((1 << base_bits) - 1)];
+			bool base_guess = b >= 2;
+			bool alt_guess = alt >= 0 ? tables[alt][index[alt]].ctr >= 0 : base_guess;
+			bool guess = provider >= 0 ? tables[provider][index[provider]].ctr >= 0 : base_guess;
+
+			if (provider >= 0)
+			{
+				entry& e = tables[provider][index[provider]];
+				if (guess != alt_guess)
+				{
+					if (guess == t.taken && e.u < 3)
+						e.u++;
+					else if (guess != t.taken && e.u > 0)
+						e.u--;
+				}
+				if (t.taken && e.ctr < 3)
+					e.ctr++;
+				else if (!t.taken && e.ctr > -4)
+					e.ctr--;
+			}
+			else
+				train(b, t.taken);
+
+			// take an entry in a longer table, or age them so one comes free
+			if (guess != t.taken && provider < ntables - 1)
+			{
+				bool taken_one = false;
+				for (int i = provider + 1; i < ntables && !taken_one; i++)
+				{
+					entry& e = tables[i][index[i]];
+					if (e.u == 0)
+					{
+						e.tag = tag[i];
+						e.ctr = t.taken ? 0 : -1;
+						taken_one = true;
+					}
+				}
+				if (!taken_one)
+					for (int i = provider + 1; i < ntables; i++)
+						tables[i][index[i]].u--;
+			}
+
+			// now and then forget which entries were useful
+			if ((++updates & ((1 << 18) - 1)) == 0)
+				for (int i = 0; i < ntables; i++)
+					for (entry& e : tables[i])
+						e.u >>= 1;
+
+			push_history(t.taken);
+			return guess == t.taken ? outcome_right : outcome_wrong;
+		}
+
+	private:
+		static constexpr int ntables = 4;
+		static constexpr int base_bits = 12;
+		static constexpr int table_bits = 10;
+		static constexpr int tag_bits = 9;
+		static constexpr uint32_t history_size = 256;	///< a power of two above the longest length
+
+		struct entry
+		{
+			int8_t ctr = { 0 };	///< -4 up to 3, taken when not negative
+			uint8_t u = { 0 };	///< 0 up to 3, how useful it has been
+			uint16_t tag = { 0xffff };	///< matches no tag when empty
+		};
+
+		/// A history of some length folded down to width bits, kept up to date one bit at a time.
+		struct folded
+		{
+			folded() {}
+			folded(uint32_t l, uint32_t w) : length(l), width(w) {}
+
+			void update(uint32_t in, uint32_t out)
+			{
+				value = (value << 1) | in;
+				value ^= out << (length % width);
+				value ^= value >> width;
+				value &= (1 << width) - 1;
+			}
+
+			uint32_t value = { 0 };
+			uint32_t length = { 0 };
+			uint32_t width = { 1 };
+		};
+
+		void push_history(bool taken)
+		{
+			history_pos = (history_pos + 1) & (history_size - 1);
+			history[history_pos] = taken;
+			for (int i = 0; i < ntables; i++)
+			{
+				uint32_t out = history[(history_pos - length[i]) & (history_size - 1)];
+				index_hash[i].update(taken, out);
+				tag_hash[i].update(taken, out);
+				tag_hash2[i].update(taken, out);
+			}
+		}
+
+		std::vector<uint8_t> base;
+		std::vector<entry> tables[ntables];
+		uint32_t length[ntables];
+		folded index_hash[ntables];
+		folded tag_hash[ntables];
+		folded tag_hash2[ntables];
+		std::vector<uint8_t> history;	///< the directions, round a ring
+		uint32_t history_pos = { 0 };
+		uint64_t updates = { 0 };
+	};
+
+	/// A direct-mapped table of the targets of taken transfers, tagged by pc.
+	class btb_predictor : public branch_predictor
+	{
+	public:
+		btb_predictor(const std::string& name, uint32_t entries)
+			: branch_predictor(name), slots(entries), mask(entries - 1) {}
+
+		outcome predict(const transfer& t) override
+		{
+			// a branch not taken needs no target
+			if (!t.taken)
+				return outcome_none;
+			slot& s = slots[(t.pc >> 2) & mask];
+			bool right = s.valid && s.pc == t.pc && s.target == t.target;
+			s.valid = true;
+			s.pc = t.pc;
+			s.target = t.target;
+			return right ? outcome_right : outcome_wrong;
+		}
+
+	private:
+		struct slot
+		{
+			bool valid = { false };
+			uint32_t pc = { 0 };
+			uint32_t target = { 0 };
+		};
+
+		std::vector<slot> slots;
+		uint32_t mask;
+	};
+
+	/// A stack of return addresses, pushed by calls and popped by returns, that wraps when full.
+	class ras_predictor : public branch_predictor
+	{
+	public:
+		ras_predictor(const std::string& name, uint32_t depth)
+			: branch_predictor(name), stack(depth), mask(depth - 1) {}
+
+		outcome predict(const transfer& t) override
+		{
+			if (t.k == kind_call)
+			{
+				stack[top++ & mask] = t.pc + 4;
+				if (used < stack.size())
+					used++;
+				return outcome_none;
+			}
+			if (t.k != kind_ret)
+				return outcome_none;
+			if (used == 0)
+				return outcome_wrong;
+			used--;
+			return stack[--top & mask] == t.target ? outcome_right : outcome_wrong;
+		}
+
+	private:
+		std::vector<uint32_t> stack;
+		uint32_t mask;
+		uint32_t top = { 0 };
+		uint32_t used = { 0 };
+	};
+}
+
+std::unique_ptr<branch_predictor> branch_predictor::create(const std::string& spec)
+{
+	std::vector<std::string> fields;
+	std::istringstream iss(spec);
+	std::string field;
+	while (std::getline(iss, field, ':'))
+		fields.push_back(field);
+	if (fields.empty())
+		return nullptr;
+
+	std::vector<uint32_t> args;
+	for (size_t i = 1; i < fields.size(); i++)
+	{
+		std::istringstream as(fields[i]);
+		uint32_t a;
+		char extra;
+		if (!(as >> a) || as >> extra)
+			return nullptr;
+		args.push_back(a);
+	}
+	auto arg = [&args](size_t i, uint32_t dflt) { return i < args.size() ? args[i] : dflt; };
+	const std::string& type = fields[0];
+
+	if (type == "bimodal" && args.size() <= 1)
+	{
+		uint32_t entries = arg(0, 4096);
+		if (is_size(entries, 1 << 24))
+			return std::unique_ptr<branch_predictor>(new bimodal_predictor("bimodal:" + std::to_string(entries), entries));
+	}
+	else if (type == "gshare" && args.size() <= 2)
+	{
+		uint32_t entries = arg(0, 4096);
+		uint32_t bits = arg(1, 12);
+		if (is_size(entries, 1 << 24) && bits <= 32)
+			return std::unique_ptr<branch_predictor>(new gshare_predictor("gshare:" + std::to_string(entries)
+				+ ":" + std::to_string(bits), entries, bits));
+	}
+	else if (type == "tage" && args.empty())
+		return std::unique_ptr<branch_predictor>(new tage_predictor("tage"));
+	else if (type == "btb" && args.size() <= 1)
+	{
+		uint32_t entries = arg(0, 512);
+		if (is_size(entries, 1 << 24))
+			return std::unique_ptr<branch_predictor>(new btb_predictor("btb:" + std::to_string(entries), entries));
+	}
+	else if (type == "ras" && args.size() <= 1)
+	{
+		uint32_t depth = arg(0, 16);
+		if (is_size(depth, 1 << 16))
+			return std::unique_ptr<branch_predictor>(new ras_predictor("ras:" + std::to_string(depth), depth));
+	}
+	return nullptr;
+}
+
+void branch_model::add(std::unique_ptr<branch_predictor> p)
+{
+	predictors.push_back(std::move(p));
+	counts.push_back(totals());
+}
+
+void branch_model::note(const branch_predictor::transfer& t)
+{
+	bool added;
+	uint32_t i = site_index.find(t.pc, added);
+	if (added)
+		sites.push_back({ t.pc, t.k, 0, std::vector<uint64_t>(predictors.size()) });
+	site& s = sites[i];
+	s.count++;
+
+	for (size_t p = 0; p < predictors.size(); p++)
+	{
+		branch_predictor::outcome o = predictors[p]->predict(t);
+		if (o == branch_predictor::outcome_none)
+			continue;
+		counts[p].predicted++;
+		if (o == branch_predictor::outcome_wrong)
+		{
+			counts[p].wrong++;
+			s.wrong[p]++;
+		}
+	}
+}
+
+void branch_model::report(std::ostream& os, size_t n) const
+{
+	static const char* const kind_names[] = { "branch", "jump", "call", "ret", "indirect" };
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2);
+	os << "Branch predictors:" << std::setw(24) << "predicted" << std::setw(14) << "mispredicted" << std::endl;
+	for (size_t p = 0; p < predictors.size(); p++)
+	{
+		const totals& c = counts[p];
+		os << "  #" << std::left << std::setw(3) << p + 1 << std::setw(22) << predictors[p]->get_name() << std::right
+			<< std::setw(14) << c.predicted << std::setw(14) << c.wrong
+			<< std::setw(8) << (c.predicted ? 100.0 * c.wrong / c.predicted : 0.0) << "%" << std::endl;
+	}
+	os.flags(flags);
+	os.precision(precision);
+
+	// the sites that cost most over all the predictors
+	std::vector<const site*> worst;
+	for (const site& s : sites)
+		worst.push_back(&s);
+	auto total = [](const site* s)
+	{
+		uint64_t sum = 0;
+		for (uint64_t w : s->wrong)
+			sum += w;
+		return sum;
+	};
+	std::stable_sort(worst.begin(), worst.end(), [&total](const site* a, const site* b) { return total(a) > total(b); });
+	while (!worst.empty() && total(worst.back()) == 0)
+		worst.pop_back();
+	worst.resize(std::min(n, worst.size()));
+	if (worst.empty())
+		return;
+
+	os << "Top " << worst.size() << " mispredicted transfers:" << std::endl;
+	os << "  " << std::left << std::setw(12) << "pc" << std::setw(10) << "kind" << std::right << std::setw(14) << "count";
+	for (size_t p = 0; p < predictors.size(); p++)
+		os << std::setw(11) << "#" + std::to_string(p + 1);
+	os << std::endl;
+	for (const site* s : worst)
+	{
+		os << "  " << std::left << std::setw(12) << hex::to_hex0x32(s->pc) << std::setw(10) << kind_names[s->k]
+			<< std::right << std::setw(14) << s->count;
+		for (uint64_t w : s->wrong)
+			os << std::setw(11) << w;
+		os << std::endl;
+	}
+}
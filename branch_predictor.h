@@ -0,0 +1,128 @@
+#ifndef BRANCH_PREDICTOR_H
+#define BRANCH_PREDICTOR_H
+#include "pc_index.h"
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * One model of how a front end would have predicted the control transfers
+ * 	of a run, shown each transfer in turn as the hart makes it.
+ **/
+class branch_predictor
+{
+public:
+	/// The kinds of control transfer the hart reports.
+	enum kind
+	{
+		kind_cond,	///< a conditional branch
+		kind_jump,	///< a jal that does not link
+		kind_call,	///< a jal or jalr that links to ra or t0
+		kind_ret,	///< a jalr through ra or t0 that does not link
+		kind_indirect	///< any other jalr
+	};
+
+	/// A control transfer, as made.
+	struct transfer
+	{
+		uint32_t pc;
+		uint32_t target;	///< where it went, pc + 4 for a branch not taken
+		kind k;
+		bool taken;	///< always true but for a branch not taken
+	};
+
+	/// What a predictor made of a transfer.
+	enum outcome
+	{
+		outcome_none,	///< it does not predict transfers like this one
+		outcome_right,
+		outcome_wrong
+	};
+
+	virtual ~branch_predictor() {}
+
+	/// @return true If r is ra or t0, the registers a call links through.
+	static bool is_link(uint32_t r) { return r == 1 || r == 5; }
+
+	/// @return The kind of a jal that writes rd.
+	static kind jal_kind(uint32_t rd) { return is_link(rd) ? kind_call : kind_jump; }
+
+	/// @return The kind of a jalr that writes rd and jumps through rs1.
+	static kind jalr_kind(uint32_t rd, uint32_t rs1)
+	{
+		return is_link(rd) ? kind_call : rd == 0 && is_link(rs1) ? kind_ret : kind_indirect;
+	}
+
+	/**
+	 * @brief Make a predictor from a spec: bimodal[:entries],
+	 * 	gshare[:entries[:history-bits]], tage, btb[:entries] or ras[:depth].
+	 * 	Every count is a power of two.
+	 * @return null If spec names no predictor or one that can't be built.
+	 **/
+	static std::unique_ptr<branch_predictor> create(const std::string& spec);
+
+	/// @return The spec the predictor was made from, with its defaults filled in.
+	const std::string& get_name() const { return name; }
+
+	/// @brief Predict t, then learn from what it did.
+	virtual outcome predict(const transfer& t) = 0;
+
+protected:
+	explicit branch_predictor(const std::string& n) : name(n) {}
+
+private:
+	std::string name;
+};
+
+/**
+ * A set of branch predictors that all see the same run, with their counts
+ * 	overall and by branch address.
+ **/
+class branch_model
+{
+public:
+	/// @brief Add p to the predictors shown each transfer, before the first is noted.
+	void add(std::unique_ptr<branch_predictor> p);
+
+	/// @return true If no predictor has been added.
+	bool empty() const { return predictors.empty(); }
+	size_t get_count() const { return predictors.size(); }
+	/// @return The transfers predictor p got wrong.
+	uint64_t get_wrong(size_t p) const { return counts[p].wrong; }
+
+	/// @brief Show t to every predictor and count what each made of it.
+	void note(const branch_predictor::transfer& t);
+
+	/**
+	 * @brief Print the predictions and mispredictions of each predictor,
+	 * 	and then the n transfer addresses mispredicted most, summed over
+	 * 	the predictors, with each predictor's count there.
+	 **/
+	void report(std::ostream& os, size_t n) const;
+
+private:
+	/// The counts for one predictor.
+	struct totals
+	{
+		uint64_t predicted = { 0 };
+		uint64_t wrong = { 0 };
+	};
+
+	/// The counts for the transfers at one address.
+	struct site
+	{
+		uint32_t pc;
+		branch_predictor::kind k;
+		uint64_t count;
+		std::vector<uint64_t> wrong;	///< by predictor
+	};
+
+	std::vector<std::unique_ptr<branch_predictor>> predictors;
+	std::vector<totals> counts;	///< by predictor
+	std::vector<site> sites;
+	pc_index site_index;	///< pc to sites
+};
+
+#endif // BRANCH_PREDICTOR_H
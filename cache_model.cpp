@@ -0,0 +1,230 @@
+#include "cache_model.h"
+#include <iomanip>
+#include <sstream>
+
+constexpr uint32_t cache_model::max_ways;
+constexpr uint32_t cache_model::valid;
+constexpr uint32_t cache_model::dirty;
+constexpr uint32_t cache_model::tag_shift;
+
+namespace
+{
+	/// @return log2(n), or -1 if n is not a power of two.
+	int log2_exact(uint64_t n)
+	{
+		if (n == 0 || (n & (n - 1)))
+			return -1;
+		int bits = 0;
+		while (n >>= 1)
+			bits++;
+		return bits;
+	}
+
+	/// @brief Parse a decimal byte count with an optional k suffix for KiB.
+	bool parse_bytes(const std::string& s, uint32_t& n)
+	{
+		std::istringstream iss(s);
+		uint64_t v;
+		if (!(iss >> v))
+			return false;
+		char suffix;
+		if (iss >> suffix)
+		{
+			if (suffix != 'k' && suffix != 'K')
+				return false;
+			v *= 1024;
+			if (iss >> suffix)
+				return false;
+		}
+		if (v > UINT32_MAX)
+			return false;
+		n = v;
+		return true;
+	}
+}
+
+bool cache_model::parse_config(const std::string& s, config& c)
+{
+	std::vector<std::string> fields;
+	std::istringstream iss(s);
+	std::string field;
+	while (std::getline(iss, field, ':'))
+		fields.push_back(field);
+	if (fields.size() < 3 || fields.size() > 4)
+		return false;
+
+	config r;
+	if (!parse_bytes(fields[0], r.size) || !parse_bytes(fields[1], r.ways) || !parse_bytes(fields[2], r.line_size))
+		return false;
+	if (fields.size() == 4)
+	{
+		if (fields[3] == "lru")
+			r.policy = policy_lru;
+		else if (fields[3] == "plru")
+			r.policy = policy_plru;
+		else if (fields[3] == "random")
+			r.policy = policy_random;
+		else
+			return false;
+	}
+
+	if (log2_exact(r.size) < 0 || log2_exact(r.ways) < 0 || log2_exact(r.line_size) < 0)
+		return false;
+	if (r.ways > max_ways || r.line_size < 4 || uint64_t(r.ways) * r.line_size > r.size)
+		return false;
+	c = r;
+	return true;
+}
+
+cache_model::cache_model(const config& c)
+	: cfg(c), policy(c.policy), ways(c.ways)
+{
+	line_bits = log2_exact(c.line_size);
+	way_bits = log2_exact(c.ways);
+	set_bits = log2_exact(c.size) - line_bits - way_bits;
+	set_mask = (uint32_t(1) << set_bits) - 1;
+	tags.resize(size_t(1) << (set_bits + way_bits));
+
+	// lru starts with the ways in order, way 0 the most recent
+	uint64_t order = 0;
+	for (uint32_t w = 0; w < ways; w++)
+		order |= uint64_t(w) << (4 * w);
+	repl.assign(size_t(1) << set_bits, policy == policy_lru ? order : 0);
+}
+
+void cache_model::lookup(uint32_t addr, uint32_t len, bool write)
+{
+	access_line(addr >> line_bits, write);
+	if (((addr ^ (addr + len - 1)) >> line_bits) != 0)
+		access_line((addr + len - 1) >> line_bits, write);
+}
+
+void cache_model::access_line(uint32_t line, bool write)
+{
+	if (line == last_line)
+	{
+		hits++;
+		*last_tag |= uint32_t(write) * dirty;
+		return;
+	}
+	last_line = line;
+
+	uint32_t set = line & set_mask;
+	uint32_t key = (line >> set_bits) << tag_shift | valid;
+	uint32_t* t = &tags[size_t(set) << way_bits];
+	for (uint32_t w = 0; w < ways; w++)
+	{
+		if ((t[w] & ~dirty) == key)
+		{
+			hits++;
+			last_tag = &t[w];
+			t[w] |= uint32_t(write) * dirty;
+			// the line already the most recent in its set needs no update
+			if ((repl[set] & 0xf) != w)
+				touch(set, w);
+			return;
+		}
+	}
+	miss(set, key, write);
+}
+
+void cache_model::miss(uint32_t set, uint32_t key, bool write)
+{
+	misses++;
+	uint32_t* t = &tags[size_t(set) << way_bits];
+
+	uint32_t w = 0;
+	while (w < ways && (t[w] & valid))
+		w++;
+	if (w == ways)
+	{
+		w = victim(set);
+		evictions++;
+		if (t[w] & dirty)
+			writebacks++;
+	}
+
+	t[w] = write ? key | dirty : key;
+	last_tag = &t[w];
+	touch(set, w);
+}
+
+void cache_model::touch(uint32_t set, uint32_t w)
+{
+	uint64_t& s = repl[set];
+	if (policy == policy_lru)
+	{
+		// take w out of the order and put it back at the front
+		uint32_t p = 0;
+		while (((s >> (4 * p)) & 0xf) != w)
+			p++;
+		uint64_t newer = s & ((uint64_t(1) << (4 * p)) - 1);
+		uint64_t older = p + 1 < max_ways ? s >> (4 * (p + 1)) << (4 * (p + 1)) : 0;
+		s = older | newer << 4 | w;
+	}
+	else if (policy == policy_plru)
+	{
+		// point each node on the path to w at the other half
+		uint32_t node = 0;
+		for (int level = way_bits - 1; level >= 0; level--)
+		{
+			uint32_t b = (w >> level) & 1;
+			if (b)
+				s &= ~(uint64_t(1) << (4 + node));
+			else
+				s |= uint64_t(1) << (4 + node);
+			node = 2 * node + 1 + b;
+		}
+		s = (s & ~uint64_t(0xf)) | w;
+	}
+	else
+		s = w;
+}
+
+uint32_t cache_model::victim(uint32_t set)
+{
+	uint64_t s = repl[set];
+	switch (policy)
+	{
+	case policy_lru:
+		return (s >> (4 * (ways - 1))) & 0xf;
+	case policy_plru:
+		{
+			uint32_t w = 0;
+			uint32_t node = 0;
+			for (uint32_t level = 0; level < way_bits; level++)
+			{
+				uint32_t b = (s >> (4 + node)) & 1;
+				w = w << 1 | b;
+				node = 2 * node + 1 + b;
+			}
+			return w;
+		}
+	default:
+		// xorshift32
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		return rng & (ways - 1);
+	}
+}
+
+void cache_model::report(std::ostream& os, const std::string& name) const
+{
+	static const char* const policy_names[] = { "lru", "plru", "random" };
+	uint64_t accesses = hits + misses;
+	auto share = [accesses](uint64_t count) { return accesses ? 100.0 * count / accesses : 0.0; };
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2);
+	os << name << ": " << cfg.size << " bytes, " << cfg.ways << "-way, " << cfg.line_size << "-byte lines, "
+		<< policy_names[cfg.policy] << std::endl;
+	os << "  accesses    " << std::setw(14) << accesses << std::endl;
+	os << "  hits        " << std::setw(14) << hits << std::setw(8) << share(hits) << "%" << std::endl;
+	os << "  misses      " << std::setw(14) << misses << std::setw(8) << share(misses) << "%" << std::endl;
+	os << "  evictions   " << std::setw(14) << evictions << std::endl;
+	os << "  writebacks  " << std::setw(14) << writebacks << std::endl;
+	os.flags(flags);
+	os.precision(precision);
+}
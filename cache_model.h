@@ -0,0 +1,116 @@
+#ifndef CACHE_MODEL_H
+#define CACHE_MODEL_H
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * A model of one set-associative, write-back, write-allocate cache that
+ * 	counts the hits, misses, evictions and write-backs of the accesses it is
+ * 	shown.  It holds no data, only the tags.
+ *
+ * The tags are one 32-bit word per line, with the valid and dirty bits
+ * 	packed below the tag, and the replacement state is one 64-bit word per
+ * 	set, so a lookup touches two small arrays.  Most accesses are to the
+ * 	same line as the one before, which is already the most recent in its
+ * 	set, and those skip the lookup altogether.
+ **/
+class cache_model
+{
+public:
+	/// How the line to evict from a full set is chosen.
+	enum policy_type
+	{
+		policy_lru,	///< the least recently used line
+		policy_plru,	///< a tree of bits that points away from recent use
+		policy_random	///< any line
+	};
+
+	/// The geometry of a cache.  Every count is a power of two.
+	struct config
+	{
+		uint32_t size = { 16384 };	///< in bytes
+		uint32_t ways = { 4 };	///< 1 up to max_ways
+		uint32_t line_size = { 32 };	///< in bytes, at least 4
+		policy_type policy = { policy_lru };
+	};
+
+	static constexpr uint32_t max_ways = 16;
+
+	/**
+	 * @brief Parse a cache given as "size:ways:line-size[:policy]", with the
+	 * 	sizes in bytes and a k suffix for KiB, and the policy lru, plru or
+	 * 	random.
+	 * @return false If s is not in that form or is not a geometry that
+	 * 	can be built.
+	 **/
+	static bool parse_config(const std::string& s, config& c);
+
+	explicit cache_model(const config& c);
+
+	/**
+	 * @brief Look up the len bytes at addr, and on a miss bring in the line.
+	 * 	An access that spans two lines looks up both.
+	 * @param write true For a store, which leaves the line dirty.
+	 **/
+	void access(uint32_t addr, uint32_t len, bool write)
+	{
+		uint32_t line = addr >> line_bits;
+		if (line == last_line && ((addr + len - 1) >> line_bits) == line)
+		{
+			hits++;
+			*last_tag |= uint32_t(write) * dirty;
+			return;
+		}
+		lookup(addr, len, write);
+	}
+
+	uint64_t get_hits() const { return hits; }
+	uint64_t get_misses() const { return misses; }
+	uint64_t get_evictions() const { return evictions; }
+	uint64_t get_writebacks() const { return writebacks; }
+
+	/// @brief Print the geometry and the counts, under the name given.
+	void report(std::ostream& os, const std::string& name) const;
+
+private:
+	static constexpr uint32_t valid = 1;
+	static constexpr uint32_t dirty = 2;
+	static constexpr uint32_t tag_shift = 2;	///< below it are the valid and dirty bits
+
+	/// @brief The body of access() for all but a repeat of the last line.
+	void lookup(uint32_t addr, uint32_t len, bool write);
+
+	/// @brief Look up line, the address over the line size.
+	void access_line(uint32_t line, bool write);
+
+	/// @brief Bring the line with key into set, evicting one if the set is full.
+	void miss(uint32_t set, uint32_t key, bool write);
+
+	/// @brief Note a use of way w of set in its replacement state.
+	void touch(uint32_t set, uint32_t w);
+
+	/// @return The way of a full set to evict.
+	uint32_t victim(uint32_t set);
+
+	config cfg;
+	policy_type policy;
+	uint32_t ways;
+	uint32_t line_bits;
+	uint32_t set_bits;
+	uint32_t way_bits;
+	uint32_t set_mask;
+	std::vector<uint32_t> tags;	///< by set then way: tag, dirty, valid
+	std::vector<uint64_t> repl;	///< by set: the ways in 4-bit fields, most recent lowest, for lru; the tree over the most recent way for plru
+	uint32_t rng = { 0x2545f491 };
+	uint32_t last_line = { UINT32_MAX };	///< the line accessed last, UINT32_MAX before any
+	uint32_t* last_tag = { nullptr };	///< its tag
+
+	uint64_t hits = { 0 };
+	uint64_t misses = { 0 };
+	uint64_t evictions = { 0 };
+	uint64_t writebacks = { 0 };
+};
+
+#endif // CACHE_MODEL_H
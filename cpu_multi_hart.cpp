@@ -0,0 +1,115 @@
+#include "cpu_multi_hart.h"
+#include <algorithm>
+#include <thread>
+
+using std::cout;
+using std::endl;
+
+cpu_multi_hart::cpu_multi_hart(memory& m, unsigned nharts) : mem(m)
+{
+	for (unsigned i = 0; i < std::max(nharts, 1u); i++)
+	{
+		harts.emplace_back(new cpu_single_hart(mem));
+		harts.back()->set_mhartid(i);
+	}
+}
+
+void cpu_multi_hart::reset()
+{
+	for (auto& h : harts)
+		h->reset();
+}
+
+void cpu_multi_hart::set_pc(uint32_t addr)
+{
+	for (auto& h : harts)
+		h->set_pc(addr);
+}
+
+void cpu_multi_hart::set_engine(cpu_single_hart::engine_type e)
+{
+	for (auto& h : harts)
+		h->set_engine(e);
+}
+
+void cpu_multi_hart::set_show_instructions(bool b)
+{
+	for (auto& h : harts)
+		h->set_show_instructions(b);
+}
+
+void cpu_multi_hart::set_show_registers(bool b)
+{
+	for (auto& h : harts)
+		h->set_show_registers(b);
+}
+
+void cpu_multi_hart::set_trace_stream(std::ostream* os)
+{
+	for (auto& h : harts)
+		h->set_trace_stream(os);
+}
+
+void cpu_multi_hart::set_binary_trace(binary_trace_writer* t)
+{
+	for (auto& h : harts)
+		h->set_binary_trace(t);
+}
+
+void cpu_multi_hart::run(uint64_t exec_limit)
+{
+	uint64_t slice = (mem.get_size() / harts.size()) & ~uint64_t(15);
+	for (size_t i = 0; i < harts.size(); i++)
+		harts[i]->set_sp(mem.get_size() - i * slice);
+
+	if (harts[0]->is_tracing())
+	{
+		// one insn from each hart in turn, so each trace line stays whole
+		bool running = true;
+		while (running)
+		{
+			running = false;
+			for (size_t i = 0; i < harts.size(); i++)
+			{
+				cpu_single_hart& h = *harts[i];
+				if (h.is_halted() || (exec_limit && h.get_insn_counter() >= exec_limit))
+					continue;
+				h.tick("[" + std::to_string(i) + "]");
+				running = true;
+			}
+		}
+		harts[0]->get_trace_stream().flush();
+	}
+	else
+	{
+		std::vector<std::thread> threads;
+		for (auto& h : harts)
+		{
+			cpu_single_hart* hp = h.get();
+			threads.emplace_back([hp, exec_limit] { hp->execute(exec_limit); });
+		}
+		for (std::thread& t : threads)
+			t.join();
+	}
+
+	for (size_t i = 0; i < harts.size(); i++)
+	{
+		cout << "Hart " << i << " execution terminated. Reason: " << harts[i]->get_halt_reason() << endl;
+		cout << "Hart " << i << ": " << harts[i]->get_insn_counter() << " instructions executed" << endl;
+	}
+	cout << get_insn_counter() << " instructions executed by " << harts.size() << " harts" << endl;
+}
+
+void cpu_multi_hart::dump() const
+{
+	for (size_t i = 0; i < harts.size(); i++)
+		harts[i]->dump("[" + std::to_string(i) + "]");
+}
+
+uint64_t cpu_multi_hart::get_insn_counter() const
+{
+	uint64_t n = 0;
+	for (auto& h : harts)
+		n += h->get_insn_counter();
+	return n;
+}
@@ -0,0 +1,53 @@
+#ifndef CPU_MULTI_HART_H
+#define CPU_MULTI_HART_H
+#include "cpu_single_hart.h"
+#include <vector>
+
+/**
+ * Several harts sharing one memory, each run on its own host thread.
+ *
+ * Hart i has mhartid i and its own stack.  The memory is split into nharts
+ * 	equal slices counting down from the end, and hart i's sp starts at
+ * 	the top of slice i.
+ **/
+class cpu_multi_hart
+{
+public:
+	/**
+	 * @param mem The memory that every hart shares.
+	 * @param nharts The number of harts, at least 1.
+	 **/
+	cpu_multi_hart(memory& mem, unsigned nharts);
+
+	void reset();
+	void set_pc(uint32_t addr);
+	void set_engine(cpu_single_hart::engine_type e);
+	void set_show_instructions(bool b);
+	void set_show_registers(bool b);
+	void set_trace_stream(std::ostream* os);
+	void set_binary_trace(binary_trace_writer* t);
+
+	/**
+	 * @brief Run every hart until it halts or has executed exec_limit insns,
+	 * 	then print why each one stopped and the totals.
+	 *
+	 * Each hart runs on its own thread.  When tracing, the harts are
+	 * 	instead stepped one insn at a time in turn on the calling thread
+	 * 	so that their output lines do not interleave.
+	 * @param exec_limit The insn count at which each hart stops, or 0 for no limit.
+	 **/
+	void run(uint64_t exec_limit);
+
+	/// @brief Print the registers of every hart, each line headed by its hart id.
+	void dump() const;
+
+	unsigned get_nharts() const { return harts.size(); }
+	/// @return The insns executed by all harts together.
+	uint64_t get_insn_counter() const;
+
+private:
+	memory& mem;
+	std::vector<std::unique_ptr<cpu_single_hart>> harts;
+};
+
+#endif // CPU_MULTI_HART_H
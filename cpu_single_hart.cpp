@@ -1,10 +1,179 @@
 #include "cpu_single_hart.h"
+#include "stack_sampler.h"
+
+bool cpu_single_hart::parse_engine(const std::string& name, engine_type& e)
+{
+	if (name == "tick")
+		e = engine_tick;
+	else if (name == "threaded")
+		e = engine_threaded;
+	else if (name == "block")
+		e = engine_block;
+	else if (name == "jit")
+		e = engine_jit;
+	else
+		return false;
+	return true;
+}
+
+const char* cpu_single_hart::get_engine_name(engine_type e)
+{
+	static const char* const names[] = { "tick", "threaded", "block", "jit" };
+	return names[e];
+}
 
 void cpu_single_hart::run(uint64_t exec_limit) 
 {
 	regs.set(2, mem.get_size());
+	execute(exec_limit);
+	get_trace_stream().flush();
+	cout << "Execution terminated. Reason: " << get_halt_reason() << endl;
+	cout << rv32i_hart::get_insn_counter() << " instructions executed" << endl;
+	if (is_profiling())
+		get_profile()->report(cout, profile_top);
+	if (get_l1i())
+		get_l1i()->report(cout, "L1I");
+	if (get_l1d())
+		get_l1d()->report(cout, "L1D");
+	if (get_branch_model())
+		get_branch_model()->report(cout, 10);
+	if (get_pipeline())
+		get_pipeline()->report(cout);
+	if (phases)
+		phases->report(cout, rv32i_hart::get_insn_counter());
+}
+
+void cpu_single_hart::execute(uint64_t exec_limit)
+{
+	if (phases)
+		run_phases(exec_limit);
+	else
+		run_sampled(engine, exec_limit);
+}
+
+void cpu_single_hart::run_phases(uint64_t exec_limit)
+{
+	const phase_sampler::config& c = phases->get_config();
+	profile* counts = get_profile();
+	cache_model* insn_cache = get_l1i();
+	cache_model* data_cache = get_l1d();
+	branch_model* predictors = get_branch_model();
+	pipeline_model* pipeline = get_pipeline();
+	auto detail = [&](bool on)
+	{
+		set_profile(on ? counts : nullptr);
+		set_caches(on ? insn_cache : nullptr, on ? data_cache : nullptr);
+		set_branch_model(on ? predictors : nullptr);
+		set_pipeline(on ? pipeline : nullptr);
+	};
+	auto run_to = [&](engine_type e, uint64_t n)
+	{
+		if (exec_limit && n > exec_limit)
+			n = exec_limit;
+		if (n > get_insn_counter())
+			run_sampled(e, n);
+	};
+
+	if (!phases->has_metrics())
+	{
+		if (pipeline)
+			phases->add_metric("CPI", 1);
+		if (insn_cache)
+			phases->add_metric("L1I misses/1k insns", 1000);
+		if (data_cache)
+			phases->add_metric("L1D misses/1k insns", 1000);
+		if (predictors)
+			for (size_t p = 0; p < predictors->get_count(); p++)
+				phases->add_metric("#" + std::to_string(p + 1) + " mispredicts/1k", 1000);
+	}
+
+	std::vector<uint64_t> before;
+	std::vector<uint64_t> after;
+	while (!is_halted() && (exec_limit == 0 || get_insn_counter() < exec_limit))
+	{
+		uint64_t start = get_insn_counter();
+		uint64_t window = start + c.skip;
+		uint64_t end = window + c.window;
+
+		detail(false);
+		run_to(engine_jit, window - c.warmup);
+		detail(true);
+		run_to(engine, window);
+		read_events(before);
+		run_to(engine, end);
+		read_events(after);
+
+		// a window cut short by a halt or the limit is left out
+		if (get_insn_counter() == end)
+		{
+			for (size_t i = 0; i < after.size(); i++)
+				after[i] -= before[i];
+			phases->add_window(after);
+		}
+		if (get_block_vectors())
+			get_block_vectors()->end_interval();
+	}
+}
 
-	if (exec_limit == 0){
+void cpu_single_hart::read_events(std::vector<uint64_t>& v) const
+{
+	v.clear();
+	if (get_pipeline())
+		v.push_back(get_pipeline()->get_cycles());
+	if (get_l1i())
+		v.push_back(get_l1i()->get_misses());
+	if (get_l1d())
+		v.push_back(get_l1d()->get_misses());
+	if (get_branch_model())
+		for (size_t p = 0; p < get_branch_model()->get_count(); p++)
+			v.push_back(get_branch_model()->get_wrong(p));
+}
+
+void cpu_single_hart::run_sampled(engine_type e, uint64_t exec_limit)
+{
+	// generated code does not record coverage, calls, branches or blocks, so the blocks stand in for it
+	if (e == engine_jit && (is_recording_coverage() || get_sampler() || get_branch_model() || get_block_vectors()))
+		e = engine_block;
+	// only the interpreters that step one insn at a time count a profile,
+	// 	show fetches to a cache or time insns, and generated code does no
+	// 	cache lookups
+	if ((e == engine_block || e == engine_jit) && (is_profiling() || get_l1i() || get_l1d() || get_pipeline()))
+		e = engine_threaded;
+
+	stack_sampler* s = get_sampler();
+	if (!s)
+	{
+		run_engine(e, exec_limit);
+		return;
+	}
+
+	// stop the engine every so often to sample the call stack
+	if (!s->is_started())
+		s->start(get_pc());
+	while (!is_halted() && (exec_limit == 0 || get_insn_counter() < exec_limit))
+	{
+		uint64_t next = get_insn_counter() + s->next_interval();
+		if (exec_limit && next > exec_limit)
+			next = exec_limit;
+		run_engine(e, next);
+		if (get_insn_counter() == next)
+			s->sample(get_pc());
+	}
+}
+
+void cpu_single_hart::run_engine(engine_type e, uint64_t exec_limit)
+{
+	if (e == engine_threaded && !is_tracing())
+		run_fast(exec_limit);
+	else if (e == engine_block && !is_tracing())
+		run_blocks(exec_limit);
+	else if (e == engine_jit && !is_tracing())
+	{
+		if (!jit)
+			jit.reset(new rv32i_jit);
+		jit->run(*this, exec_limit);
+	}
+	else if (exec_limit == 0){
 		while (!is_halted())
 			rv32i_hart::tick();
 	}
@@ -12,6 +181,18 @@ void cpu_single_hart::run(uint64_t exec_limit)
 		while (!is_halted() && get_insn_counter() < exec_limit)
 			rv32i_hart::tick();
 	}
-	cout << "Execution terminated. Reason: " << get_halt_reason() << endl;
-	cout << rv32i_hart::get_insn_counter() << " instructions executed" << endl;
+}
+
+void cpu_single_hart::save_checkpoint(checkpoint& c)
+{
+	save_state(c.hart);
+	mem.take_snapshot(c.mem);
+}
+
+bool cpu_single_hart::restore_checkpoint(const checkpoint& c)
+{
+	if (!mem.restore_snapshot(c.mem))
+		return false;
+	restore_state(c.hart);
+	return true;
 }
@@ -1,9 +1,109 @@
+#ifndef CPU_SINGLE_HART_H
+#define CPU_SINGLE_HART_H
 #include "rv32i_hart.h"
+#include "rv32i_jit.h"
 
 class cpu_single_hart : public rv32i_hart
 {
 	public:
+		/**
+		 * The execution engines that run() can use when nothing is being traced.
+		 **/
+		enum engine_type
+		{
+			engine_tick,	///< one tick() per insn, the same loop used for tracing
+			engine_threaded,	///< rv32i_hart::run_fast()
+			engine_block,	///< rv32i_hart::run_blocks()
+			engine_jit	///< rv32i_jit::run(), x86-64 Linux only
+		};
+
 		cpu_single_hart(memory &mem) : rv32i_hart(mem) {}	
+		void set_engine(engine_type e) { engine = e; }
+		engine_type get_engine() const { return engine; }
+		void set_sp(uint32_t sp) { regs.set(2, sp); }
+		/// @brief Have run() report the n handlers and pcs that ran most when profiling.
+		void set_profile_top(size_t n) { profile_top = n; }
+
+		/**
+		 * @brief Run in the phases p plans, or run every insn the same way
+		 * 	if p is null.
+		 *
+		 * Each phase fast-forwards on the jit, or the fastest engine the
+		 * 	hooks still on allow, with the profile, caches, branch model
+		 * 	and pipeline model off.  It then turns them back on for the
+		 * 	warm-up and the window, which run on the selected engine, and
+		 * 	adds what they counted in the window to p.
+		 **/
+		void set_phases(phase_sampler* p) { phases = p; }
+		phase_sampler* get_phases() const { return phases; }
+
+		/**
+		 * @brief Parse an engine name as given to the -e option.
+		 * @param name The engine name.
+		 * @param e Set to the engine named by name.
+		 * @return false If name is not the name of an engine.
+		 **/
+		static bool parse_engine(const std::string& name, engine_type& e);
+
+		/// @return The name of e, as parse_engine() takes it.
+		static const char* get_engine_name(engine_type e);
+
+		/**
+		 * @brief Run until the hart halts or exec_limit insns have executed.
+		 * @note Tracing always runs on tick() whatever engine is selected,
+		 * 	and profiling or a cache model runs the block and jit engines as
+		 * 	threaded.  The counts of each are printed after the halt.  With
+		 * 	a stack_sampler the engine is stopped to take each sample, and
+		 * 	with it or a branch_model the jit engine runs as block.
+		 **/
 		void run(uint64_t exec_limit);
+
+		/**
+		 * @brief Run like run() but without setting sp or printing why the
+		 * 	hart stopped, for callers that manage several harts.
+		 **/
+		void execute(uint64_t exec_limit);
+
+		/// The whole machine: the hart's state and the memory contents.
+		struct checkpoint
+		{
+			rv32i_hart::state hart;
+			memory::snapshot mem;
+		};
+
+		/**
+		 * @brief Save the hart and its memory into c.
+		 * @note Later restores only copy back the memory pages stored to
+		 * 	after this, so restoring is cheap when a run touches few pages.
+		 **/
+		void save_checkpoint(checkpoint& c);
+
+		/**
+		 * @brief Put the hart and its memory back as they were when c was saved.
+		 * @return false If c was saved from a hart on another memory.
+		 **/
+		bool restore_checkpoint(const checkpoint& c);
+
+	private:
+		/**
+		 * @brief Run on engine e, or the one that stands in for it with the
+		 * 	hooks that are on, stopping for each stack sample.
+		 **/
+		void run_sampled(engine_type e, uint64_t exec_limit);
+
+		/// @brief Run phase after phase until the hart halts or the insn counter reaches exec_limit.
+		void run_phases(uint64_t exec_limit);
+
+		/// @brief Read the count of each event the phases measure into v, in add_metric() order.
+		void read_events(std::vector<uint64_t>& v) const;
+
+		/// @brief Run on engine e until the hart halts or the insn counter reaches exec_limit.
+		void run_engine(engine_type e, uint64_t exec_limit);
+
+		engine_type engine = { engine_threaded };
+		size_t profile_top = { 10 };
+		std::unique_ptr<rv32i_jit> jit;	///< made on the first run with engine_jit
+		phase_sampler* phases = { nullptr };
 };
 
+#endif // CPU_SINGLE_HART_H
@@ -0,0 +1,179 @@
+#include "elf32.h"
+#include <algorithm>
+
+using std::cerr;
+using std::endl;
+
+namespace
+{
+	// The few ELF constants and field offsets that the loader needs.
+	const uint8_t elfclass32 = 1;
+	const uint8_t elfdata2lsb = 1;
+	const uint16_t et_exec = 2;
+	const uint16_t em_riscv = 243;
+	const uint32_t pt_load = 1;
+	const uint32_t sht_symtab = 2;
+	const uint8_t stt_notype = 0;
+	const uint8_t stt_object = 1;
+	const uint8_t stt_func = 2;
+
+	const uint32_t ehdr_size = 52;
+	const uint32_t phdr_size = 32;
+	const uint32_t shdr_size = 40;
+	const uint32_t sym_size = 16;
+
+	/// @return The little-endian 16-bit value at off, or 0 if it is past the end of file.
+	uint16_t le16(const std::vector<uint8_t>& file, uint64_t off)
+	{
+		if (off + 2 > file.size())
+			return 0;
+		return file[off] | file[off + 1] << 8;
+	}
+
+	/// @return The little-endian 32-bit value at off, or 0 if it is past the end of file.
+	uint32_t le32(const std::vector<uint8_t>& file, uint64_t off)
+	{
+		if (off + 4 > file.size())
+			return 0;
+		return le16(file, off) | uint32_t(le16(file, off + 2)) << 16;
+	}
+}
+
+bool elf32::is_elf(const std::string& fname)
+{
+	ifstream inFile(fname, std::ios::binary);
+	char magic[4];
+	return inFile.read(magic, sizeof(magic)) && memcmp(magic, "\x7f" "ELF", 4) == 0;
+}
+
+bool elf32::load(const std::string& fname, memory& mem)
+{
+	ifstream inFile(fname, std::ios::binary | std::ios::ate);
+	if (inFile.fail())
+	{
+		cerr << "Can’t open file '" << fname << "' for reading." << endl;
+		return false;
+	}
+	std::streamoff len = inFile.tellg();
+	std::vector<uint8_t> file(len > 0 ? len : 0);
+	inFile.seekg(0);
+	if (len < 0 || !inFile.read(reinterpret_cast<char*>(file.data()), file.size()))
+	{
+		cerr << "Can’t read file '" << fname << "'." << endl;
+		return false;
+	}
+
+	if (file.size() < ehdr_size || memcmp(file.data(), "\x7f" "ELF", 4) != 0
+		|| file[4] != elfclass32 || file[5] != elfdata2lsb || le16(file, 16) != et_exec || le16(file, 18) != em_riscv)
+	{
+		cerr << "'" << fname << "' is not a little-endian RISC-V ELF32 executable." << endl;
+		return false;
+	}
+
+	entry = le32(file, 24);
+	uint32_t phoff = le32(file, 28);
+	uint16_t phentsize = le16(file, 42);
+	uint16_t phnum = le16(file, 44);
+	if (phentsize < phdr_size || uint64_t(phoff) + uint64_t(phnum) * phentsize > file.size())
+	{
+		cerr << "'" << fname << "' has a truncated program header table." << endl;
+		return false;
+	}
+
+	for (uint16_t i = 0; i < phnum; i++)
+	{
+		uint64_t ph = phoff + uint64_t(i) * phentsize;
+		if (le32(file, ph) != pt_load)
+			continue;
+
+		uint32_t offset = le32(file, ph + 4);
+		uint32_t vaddr = le32(file, ph + 8);
+		uint32_t filesz = le32(file, ph + 16);
+		uint32_t memsz = le32(file, ph + 20);
+		if (filesz > memsz || uint64_t(offset) + filesz > file.size())
+		{
+			cerr << "'" << fname << "' has a malformed PT_LOAD segment." << endl;
+			return false;
+		}
+		if (!mem.write_bytes(vaddr, file.data() + offset, filesz)
+			|| !mem.zero_bytes(vaddr + filesz, memsz - filesz))
+		{
+			cerr << "Program too big." << endl;
+			return false;
+		}
+	}
+
+	read_symbols(file);
+	return true;
+}
+
+void elf32::read_symbols(const std::vector<uint8_t>& file)
+{
+	symbols.clear();
+	labels.clear();
+
+	uint32_t shoff = le32(file, 32);
+	uint16_t shentsize = le16(file, 46);
+	uint16_t shnum = le16(file, 48);
+	if (shentsize < shdr_size || uint64_t(shoff) + uint64_t(shnum) * shentsize > file.size())
+		return;
+
+	for (uint16_t i = 0; i < shnum; i++)
+	{
+		uint64_t sh = shoff + uint64_t(i) * shentsize;
+		if (le32(file, sh + 4) != sht_symtab)
+			continue;
+
+		uint32_t offset = le32(file, sh + 16);
+		uint32_t size = le32(file, sh + 20);
+		uint32_t link = le32(file, sh + 24);
+		if (link >= shnum || uint64_t(offset) + size > file.size())
+			continue;
+		uint64_t strsh = shoff + uint64_t(link) * shentsize;
+		uint32_t stroff = le32(file, strsh + 16);
+		uint32_t strsize = le32(file, strsh + 20);
+		if (uint64_t(stroff) + strsize > file.size())
+			continue;
+
+		for (uint32_t s = 0; s + sym_size <= size; s += sym_size)
+		{
+			uint64_t sym = offset + uint64_t(s);
+			uint32_t name = le32(file, sym);
+			uint8_t type = file[sym + 12] & 0xf;
+			uint16_t shndx = le16(file, sym + 14);
+			if (shndx == 0 || name == 0 || name >= strsize
+				|| (type != stt_notype && type != stt_object && type != stt_func))
+				continue;
+
+			const char* str = reinterpret_cast<const char*>(&file[stroff + name]);
+			std::string n(str, strnlen(str, strsize - name));
+			// skip the assembler's local labels and mapping symbols
+			if (n.empty() || n[0] == '$' || n.compare(0, 2, ".L") == 0)
+				continue;
+			symbols.push_back(symbol { le32(file, sym + 4), le32(file, sym + 8), n });
+		}
+	}
+
+	std::stable_sort(symbols.begin(), symbols.end(),
+		[](const symbol& a, const symbol& b) { return a.addr < b.addr; });
+	for (size_t i = 0; i < symbols.size(); i++)
+		if (symbols[i].size == 0)
+			labels.push_back(i);
+}
+
+const elf32::symbol* elf32::find_symbol(uint32_t addr) const
+{
+	auto it = std::upper_bound(symbols.begin(), symbols.end(), addr,
+		[](uint32_t a, const symbol& s) { return a < s.addr; });
+	if (it == symbols.begin())
+		return nullptr;
+	--it;
+	if (it->size == 0 || addr - it->addr < it->size)
+		return &*it;
+
+	// past the end of a sized symbol, so fall back on a label further down
+	auto l = std::upper_bound(labels.begin(), labels.end(), size_t(it - symbols.begin()));
+	if (l == labels.begin())
+		return nullptr;
+	return &symbols[*(l - 1)];
+}
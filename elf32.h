@@ -0,0 +1,63 @@
+#ifndef ELF32_H
+#define ELF32_H
+#include "memory.h"
+#include <string>
+#include <vector>
+
+/**
+ * Loads a little-endian ELF32 RISC-V executable into the simulated memory
+ * 	and keeps its symbol table for turning addresses back into names.
+ **/
+class elf32
+{
+public:
+	/// A named address from the symbol table.
+	struct symbol
+	{
+		uint32_t addr;
+		uint32_t size;	///< 0 for labels whose extent is not known
+		std::string name;
+	};
+
+	/**
+	 * @param fname The name of a file to check.
+	 * @return true If fname can be opened and starts with the ELF magic number.
+	 **/
+	static bool is_elf(const std::string& fname);
+
+	/**
+	 * @brief Load the PT_LOAD segments of fname into mem and read its symbols.
+	 *
+	 * Each segment is copied to its p_vaddr and the part of it past the end
+	 * 	of the file (.bss) is zeroed.
+	 * @param fname The name of the ELF file to read.
+	 * @param mem The simulated memory to load the segments into.
+	 * @return true If the file is a RISC-V ELF32 executable whose segments all
+	 * 	fit in mem.
+	 * @return false After printing why to std::cerr otherwise.
+	 **/
+	bool load(const std::string& fname, memory& mem);
+
+	/// @return The address at which execution starts.
+	uint32_t get_entry() const { return entry; }
+
+	/**
+	 * @return The nearest symbol at or below addr if addr falls inside it,
+	 * 	or else the closest one below addr that has no size, or null if
+	 * 	there is neither.
+	 **/
+	const symbol* find_symbol(uint32_t addr) const;
+
+	/// @return The symbols ordered by address.
+	const std::vector<symbol>& get_symbols() const { return symbols; }
+
+private:
+	/// @brief Read the function, object and label symbols out of the SHT_SYMTAB section.
+	void read_symbols(const std::vector<uint8_t>& file);
+
+	uint32_t entry = { 0 };
+	std::vector<symbol> symbols;	///< sorted by addr so that lookups can bisect
+	std::vector<size_t> labels;	///< the indices of the symbols with no size, in symbols order
+};
+
+#endif // ELF32_H
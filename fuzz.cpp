@@ -0,0 +1,378 @@
+//*********************************
+//
+// RISC-V Simulator
+//
+// Coverage-guided fuzzer: runs a guest program over and over from one
+// checkpoint, each time with a mutated input written into its memory, and
+// keeps the inputs that reach new branch edges.
+//
+//*********************************
+#include <iostream>
+#include <chrono>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "cpu_single_hart.h"
+#include "elf32.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static constexpr uint32_t map_size = 1 << 16;	///< edge counters per run
+
+/**
+ * @brief Standard errors printed when the command line is used improperly.
+ **/
+static void usage()
+{
+	cerr << "Usage : fuzz [-a hex-input-addr] [-e engine] [-l hex-exec-limit] [-m hex-mem-size] [-n runs] [-s hex-input-size] [-r seed] infile corpus-dir\n";
+	cerr << "-a write each input here ( default = 0x1000 )\n";
+	cerr << "-e execution engine: tick, threaded, block or jit ( default = block )\n";
+	cerr << "-l stop a run that has not hit ebreak after this many insns ( default = 0x10000 )\n";
+	cerr << "-m specify memory size ( default = 0x10000 )\n";
+	cerr << "-n stop after this many runs ( default = run until killed )\n";
+	cerr << "-s the largest input ( default = 0x100 )\n";
+	cerr << "-r seed for the mutations ( default = the time )\n";
+	cerr << "Each run starts at the entry point with a0 = the input address and a1 = its length.\n";
+	cerr << "A run that halts on anything but ebreak is a crash, and its input is saved\n";
+	cerr << "in corpus-dir/crashes if it reached new edges.\n";
+	exit(1);
+}
+
+namespace
+{
+	/// xorshift64*, plenty for picking mutations
+	class rng
+	{
+	public:
+		explicit rng(uint64_t seed) : s(seed ? seed : 1) {}
+		uint64_t next()
+		{
+			s ^= s >> 12;
+			s ^= s << 25;
+			s ^= s >> 27;
+			return s * 0x2545f4914f6cdd1dull;
+		}
+		/// @return A number in [0, n).
+		uint32_t below(uint32_t n) { return n ? next() % n : 0; }
+	private:
+		uint64_t s;
+	};
+
+	/**
+	 * The bucket that each edge count falls into, so that a loop running a
+	 * 	few more times does not count as a new path.
+	 **/
+	struct bucket_table
+	{
+		uint8_t b[256];
+		bucket_table()
+		{
+			for (int i = 0; i < 256; i++)
+				b[i] = i == 0 ? 0 : i == 1 ? 1 : i == 2 ? 2 : i == 3 ? 4 : i < 8 ? 8 :
+					i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+		}
+	};
+	const bucket_table buckets;
+
+	/**
+	 * @brief Bucket the counts in trace and clear the bits they set in virgin.
+	 * @return The number of bytes of virgin that changed.
+	 **/
+	uint32_t merge_coverage(uint8_t* trace, uint8_t* virgin)
+	{
+		uint32_t changed = 0;
+		for (uint32_t i = 0; i < map_size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, &trace[i], 8);
+			if (!word)
+				continue;	// most of the map is untouched
+			for (uint32_t j = i; j < i + 8; j++)
+			{
+				uint8_t hit = buckets.b[trace[j]];
+				if (hit & virgin[j])
+				{
+					virgin[j] &= ~hit;
+					changed++;
+				}
+			}
+		}
+		return changed;
+	}
+
+	/**
+	 * @brief Apply a few random byte-level mutations to input.
+	 * @param other Another corpus entry to splice from.
+	 **/
+	void mutate(std::vector<uint8_t>& input, const std::vector<uint8_t>& other, uint32_t max_size, rng& r)
+	{
+		static const int8_t interesting[] = { 0, 1, -1, 16, 32, 64, 100, 127, -128, 0x7f, 0x20, '\n', '0', 'A' };
+
+		for (uint32_t n = 1 + r.below(4); n > 0; n--)
+		{
+			uint32_t at = r.below(input.size());
+			switch (r.below(input.empty() ? 1 : 7))
+			{
+			case 0:	// insert a random byte
+				if (input.size() < max_size)
+					input.insert(input.begin() + r.below(input.size() + 1), r.next());
+				break;
+			case 1:	// flip a bit
+				input[at] ^= 1 << r.below(8);
+				break;
+			case 2:	// set a random byte
+				input[at] = r.next();
+				break;
+			case 3:	// add a small number
+				input[at] += r.below(35) - 17;
+				break;
+			case 4:	// an interesting value
+				input[at] = interesting[r.below(sizeof(interesting))];
+				break;
+			case 5:	// delete a run
+				input.erase(input.begin() + at, input.begin() + std::min<size_t>(input.size(), at + 1 + r.below(8)));
+				break;
+			case 6:	// overwrite with a run of the other input
+				if (!other.empty())
+				{
+					uint32_t from = r.below(other.size());
+					uint32_t len = std::min<size_t>(other.size() - from, input.size() - at);
+					memcpy(&input[at], &other[from], len);
+				}
+				break;
+			}
+		}
+	}
+
+	/**
+	 * @brief Read up to max_size bytes of the regular file fname into input.
+	 * @return false If fname is not a regular file or can not be read.
+	 **/
+	bool read_input(const std::string& fname, uint32_t max_size, std::vector<uint8_t>& input)
+	{
+		struct stat st;
+		if (stat(fname.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			return false;
+		ifstream in(fname, std::ios::binary);
+		if (in.fail())
+			return false;
+		input.assign(max_size, 0);
+		in.read(reinterpret_cast<char*>(input.data()), max_size);
+		input.resize(in.gcount());
+		return true;
+	}
+
+	/**
+	 * Saves inputs to a directory as prefix<n>, with n counting on from the
+	 * 	highest already there so that a later session never overwrites the
+	 * 	inputs of an earlier one.
+	 **/
+	class input_dir
+	{
+	public:
+		input_dir(const std::string& d, const char* p) : dir(d), prefix(p)
+		{
+			size_t len = strlen(prefix);
+			if (DIR* dp = opendir(dir.c_str()))
+			{
+				while (dirent* e = readdir(dp))
+				{
+					if (strncmp(e->d_name, prefix, len) != 0 || !isdigit((unsigned char)e->d_name[len]))
+						continue;
+					uint64_t n = strtoull(e->d_name + len, nullptr, 10);
+					if (n >= next)
+						next = n + 1;
+				}
+				closedir(dp);
+			}
+		}
+
+		/// @brief Write input to the next free name, skipping any that exist.
+		void save(const std::vector<uint8_t>& input)
+		{
+			int fd;
+			std::string fname;
+			do
+			{
+				char name[32];
+				snprintf(name, sizeof(name), "%s%06llu", prefix, (unsigned long long)next++);
+				fname = dir + "/" + name;
+				fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+			} while (fd < 0 && errno == EEXIST);
+			if (fd < 0)
+			{
+				cerr << "Can’t open file '" << fname << "' for writing." << endl;
+				return;
+			}
+			const uint8_t* p = input.data();
+			size_t left = input.size();
+			while (left > 0)
+			{
+				ssize_t n = write(fd, p, left);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				p += n;
+				left -= n;
+			}
+			if (close(fd) != 0 || left > 0)
+				cerr << "Can’t write file '" << fname << "'." << endl;
+		}
+
+	private:
+		std::string dir;
+		const char* prefix;
+		uint64_t next = { 0 };	///< the index to try first for the next input
+	};
+}
+
+/**
+ * @brief usage: fuzz [options] infile corpus-dir
+ **/
+int main(int argc, char **argv)
+{
+	uint64_t memory_limit = 0x10000;
+	uint64_t exec_limit = 0x10000;
+	uint32_t input_addr = 0x1000;
+	uint32_t max_size = 0x100;
+	uint64_t runs = 0;
+	uint64_t seed = std::chrono::steady_clock::now().time_since_epoch().count();
+	cpu_single_hart::engine_type engine = cpu_single_hart::engine_block;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "a:e:l:m:n:r:s:")) != -1)
+	{
+		std::istringstream iss(optarg ? optarg : "");
+		switch (opt)
+		{
+		case 'a': iss >> std::hex >> input_addr; break;
+		case 'e':
+			if (!cpu_single_hart::parse_engine(optarg, engine))
+				usage();
+			break;
+		case 'l': iss >> std::hex >> exec_limit; break;
+		case 'm': iss >> std::hex >> memory_limit; break;
+		case 'n': iss >> runs; break;
+		case 'r': iss >> seed; break;
+		case 's': iss >> std::hex >> max_size; break;
+		default: usage();
+		}
+	}
+	if (optind + 2 != argc || exec_limit == 0)
+		usage();
+	std::string corpus_dir = argv[optind + 1];
+	std::string crash_dir = corpus_dir + "/crashes";
+	mkdir(corpus_dir.c_str(), 0777);
+	mkdir(crash_dir.c_str(), 0777);
+
+	memory mem(memory_limit);
+	uint32_t start_pc = 0;
+	if (elf32::is_elf(argv[optind]))
+	{
+		elf32 elf;
+		if (!elf.load(argv[optind], mem))
+			usage();
+		start_pc = elf.get_entry();
+	}
+	else if (!mem.load_file(argv[optind], 0))
+		usage();
+	if (uint64_t(input_addr) + max_size > mem.get_size())
+	{
+		cerr << "The input region does not fit in the memory." << endl;
+		return 1;
+	}
+
+	// every run starts from here
+	cpu_single_hart cpu(mem);
+	cpu.reset();
+	cpu.set_pc(start_pc);
+	cpu.set_sp(mem.get_size());
+	cpu.set_engine(engine);
+	std::vector<uint8_t> trace(map_size);
+	std::vector<uint8_t> virgin(map_size, 0xff);
+	cpu.set_coverage(trace.data(), map_size);
+	cpu_single_hart::checkpoint start;
+	cpu.save_checkpoint(start);
+
+	std::vector<std::vector<uint8_t>> corpus;
+	if (DIR* d = opendir(corpus_dir.c_str()))
+	{
+		while (dirent* e = readdir(d))
+		{
+			std::vector<uint8_t> input;
+			if (e->d_name[0] != '.' && read_input(corpus_dir + "/" + e->d_name, max_size, input))
+				corpus.push_back(input);
+		}
+		closedir(d);
+	}
+	size_t seeds = corpus.size();
+	if (corpus.empty())
+		corpus.push_back(std::vector<uint8_t>(1, 0));
+
+	input_dir saved_corpus(corpus_dir, "id_");
+	input_dir saved_crashes(crash_dir, "crash_");
+	rng r(seed);
+	uint64_t crashes = 0;
+	uint64_t new_crashes = 0;	///< the crashes that took a new path, whose inputs are saved
+	uint64_t hangs = 0;
+	uint32_t edges = 0;
+	auto began = std::chrono::steady_clock::now();
+	auto last_report = began;
+
+	// the seeds run once as they are before any mutation
+	for (uint64_t run = 0; runs == 0 || run < runs; run++)
+	{
+		std::vector<uint8_t> input = corpus[run < seeds ? run : r.below(corpus.size())];
+		if (run >= seeds)
+			mutate(input, corpus[r.below(corpus.size())], max_size, r);
+
+		cpu.restore_checkpoint(start);
+		memset(trace.data(), 0, map_size);
+		mem.write_bytes(input_addr, input.data(), input.size());
+		cpu.set_reg(10, input_addr);
+		cpu.set_reg(11, input.size());
+		cpu.execute(exec_limit);
+
+		uint32_t found = merge_coverage(trace.data(), virgin.data());
+		if (!cpu.is_halted())
+			hangs++;
+		else if (cpu.get_halt_reason().find("EBREAK") == std::string::npos)
+		{
+			// only keep a crash that took a new path to get there
+			if (found)
+			{
+				saved_crashes.save(input);
+				new_crashes++;
+			}
+			crashes++;
+		}
+		else if (found && run >= seeds)
+		{
+			saved_corpus.save(input);
+			corpus.push_back(input);
+		}
+		edges += found;
+
+		auto now = std::chrono::steady_clock::now();
+		if ((run & 0xfff) == 0 && now - last_report > std::chrono::seconds(2))
+		{
+			std::chrono::duration<double> secs = now - began;
+			cerr << run + 1 << " runs, " << uint64_t((run + 1) / secs.count()) << "/s, corpus " << corpus.size()
+				<< ", edges " << edges << ", crashes " << crashes << " (" << new_crashes << " saved), hangs " << hangs << endl;
+			last_report = now;
+		}
+	}
+
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - began;
+	cout << runs << " runs in " << secs.count() << " s (" << uint64_t(runs / secs.count()) << "/s)" << endl;
+	cout << "corpus " << corpus.size() << ", edges " << edges << ", crashes " << crashes << " (" << new_crashes
+		<< " saved), hangs " << hangs << endl;
+	return 0;
+}
@@ -1,41 +1,93 @@
 #include "hex.h"
+#include <cstring>
+
+namespace
+{
+	/// The two hex digits of every byte value, so each byte is one lookup.
+	struct digit_pairs
+	{
+		char pair[256][2];
+		digit_pairs()
+		{
+			static const char digits[] = "0123456789abcdef";
+			for (int i = 0; i < 256; i++)
+			{
+				pair[i][0] = digits[i >> 4];
+				pair[i][1] = digits[i & 0xf];
+			}
+		}
+	};
+	const digit_pairs table;
+}
+
+char* hex::put_hex8(char* buf, uint8_t i)
+{
+	memcpy(buf, table.pair[i], 2);
+	return buf + 2;
+}
+
+char* hex::put_hex32(char* buf, uint32_t i)
+{
+	memcpy(buf, table.pair[i >> 24], 2);
+	memcpy(buf + 2, table.pair[(i >> 16) & 0xff], 2);
+	memcpy(buf + 4, table.pair[(i >> 8) & 0xff], 2);
+	memcpy(buf + 6, table.pair[i & 0xff], 2);
+	return buf + 8;
+}
+
+char* hex::put_hex0x32(char* buf, uint32_t i)
+{
+	buf[0] = '0';
+	buf[1] = 'x';
+	return put_hex32(buf + 2, i);
+}
+
+char* hex::put_hex0x20(char* buf, uint32_t i)
+{
+	char digits[8];
+	put_hex32(digits, i);
+	buf[0] = '0';
+	buf[1] = 'x';
+	memcpy(buf + 2, digits + 3, 5);
+	return buf + 7;
+}
+
+char* hex::put_hex0x12(char* buf, uint32_t i)
+{
+	char digits[8];
+	put_hex32(digits, i);
+	buf[0] = '0';
+	buf[1] = 'x';
+	memcpy(buf + 2, digits + 5, 3);
+	return buf + 5;
+}
 
 std::string hex::to_hex8(uint8_t i) 
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint16_t>(i);
-	return os.str();
+	char buf[2];
+	return std::string(buf, put_hex8(buf, i));
 }
 
 std::string hex::to_hex32(uint32_t i) 
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(8) << static_cast<uint32_t>(i);
-	return os.str();
+	char buf[8];
+	return std::string(buf, put_hex32(buf, i));
 }
 
 std::string hex::to_hex0x32(uint32_t i) 
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(8) << static_cast<uint32_t>(i);
-	return "0x" + os.str();
+	char buf[10];
+	return std::string(buf, put_hex0x32(buf, i));
 }
 
 std::string hex::to_hex0x20(uint32_t i)
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(5) << i;
-	return "0x" + os.str();
+	char buf[7];
+	return std::string(buf, put_hex0x20(buf, i));
 }
 
 std::string hex::to_hex0x12(uint32_t i)
 {
-	std::ostringstream os;
-	os << std::hex << std::setfill('0') << std::setw(3) << i;
-
-	std::string s = os.str();
-	s.resize(3);
-
-	//std::cout << std::endl << os.str() << std::endl;
-	return "0x" + s;
+	char buf[5];
+	return std::string(buf, put_hex0x12(buf, i));
 }
@@ -27,8 +27,27 @@ public:
 	**/
 	static std::string to_hex0x32(uint32_t i);
 
+	/// @return The low 20 bits of i as five hex digits with prefix '0x'.
 	static std::string to_hex0x20(uint32_t i);
+	/// @return The low 12 bits of i as three hex digits with prefix '0x'.
 	static std::string to_hex0x12(uint32_t i);
+
+	/**
+	* @defgroup putX Format into a buffer
+	* Write the same digits as the matching to_hexX into buf, two at a time
+	* 	from a table, without a stream or any allocation.
+	*
+	* @param buf Where to write.  It must have room for the digits; no '\0' is added.
+	* @param i A number to be printed.
+	* @return The char just past the last one written.
+	* 	@{
+	**/
+	static char* put_hex8(char* buf, uint8_t i);	///< 2 chars
+	static char* put_hex32(char* buf, uint32_t i);	///< 8 chars
+	static char* put_hex0x32(char* buf, uint32_t i);	///< 10 chars
+	static char* put_hex0x20(char* buf, uint32_t i);	///< 7 chars
+	static char* put_hex0x12(char* buf, uint32_t i);	///< 5 chars
+	/**@}*/
 };
 
 #endif // HEX_H
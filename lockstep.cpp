@@ -0,0 +1,192 @@
+#include "lockstep.h"
+#include "hex.h"
+#include "rv32i_decode.h"
+#include <algorithm>
+#include <iomanip>
+
+constexpr uint64_t lockstep::max_listed;
+
+lockstep::lockstep(cpu_single_hart& t, memory& tm, cpu_single_hart& r, memory& rm, uint64_t n)
+	: test(t), test_mem(tm), ref(r), ref_mem(rm), interval(n)
+{
+}
+
+bool lockstep::run(uint64_t exec_limit, std::ostream& os)
+{
+	const char* name = cpu_single_hart::get_engine_name(test.get_engine());
+	test.save_checkpoint(test_start);
+	ref.save_checkpoint(ref_start);
+	start_insns = test.get_insn_counter();
+	if (!agree())
+	{
+		os << "Lockstep: " << name << " and the reference differ before the first insn" << std::endl;
+		report_differences(os);
+		return false;
+	}
+
+	uint64_t good = test.get_insn_counter();
+	while (!test.is_halted() && (exec_limit == 0 || good < exec_limit))
+	{
+		uint64_t next = good + interval;
+		if (exec_limit && next > exec_limit)
+			next = exec_limit;
+		run_to(next);
+		checks++;
+		if (!agree_since_check())
+		{
+			os << "Lockstep: " << name << " differs from the reference at check " << checks << ", after insns " << good
+				<< " to " << next << std::endl;
+			report_differences(os);
+			locate(good, next, os);
+			return false;
+		}
+		good = test.get_insn_counter();
+	}
+	os << "Lockstep: " << name << " agreed with the reference at all " << checks << " checks, every " << interval
+		<< " insns, over " << good << " insns" << std::endl;
+	return true;
+}
+
+bool lockstep::same_harts() const
+{
+	if (test.get_pc() != ref.get_pc() || test.get_insn_counter() != ref.get_insn_counter()
+		|| test.is_halted() != ref.is_halted() || test.get_halt_reason() != ref.get_halt_reason())
+		return false;
+	for (uint32_t r = 0; r < 32; r++)
+		if (test.get_reg(r) != ref.get_reg(r))
+			return false;
+	return true;
+}
+
+bool lockstep::agree() const
+{
+	uint32_t addr;
+	return same_harts() && !test_mem.find_difference(ref_mem, addr);
+}
+
+bool lockstep::agree_since_check()
+{
+	// they agreed at the last check, so only pages stored to since can differ
+	stored.clear();
+	test_mem.take_stored_pages(stored);
+	ref_mem.take_stored_pages(stored);
+	std::sort(stored.begin(), stored.end());
+	stored.erase(std::unique(stored.begin(), stored.end()), stored.end());
+	uint32_t addr;
+	return same_harts() && !test_mem.find_difference(ref_mem, stored, addr);
+}
+
+void lockstep::run_to(uint64_t n)
+{
+	// execute() takes 0 as no limit
+	if (n == 0)
+		return;
+	test.execute(n);
+	ref.run_reference(n);
+}
+
+void lockstep::locate(uint64_t good, uint64_t bad, std::ostream& os)
+{
+	const char* name = cpu_single_hart::get_engine_name(test.get_engine());
+	uint64_t lo = good;
+	uint64_t hi = bad;
+	test.restore_checkpoint(test_start);
+	ref.restore_checkpoint(ref_start);
+	run_to(lo);
+	if (!agree())
+	{
+		// run in one go the engine went wrong sooner
+		hi = lo;
+		lo = start_insns;
+		test.restore_checkpoint(test_start);
+		ref.restore_checkpoint(ref_start);
+	}
+
+	// they agree at lo and differ when run from lo to hi in one go
+	cpu_single_hart::checkpoint test_lo;
+	cpu_single_hart::checkpoint ref_lo;
+	test.save_checkpoint(test_lo);
+	ref.save_checkpoint(ref_lo);
+	run_to(hi);
+	bool differ = !agree();
+	test.restore_checkpoint(test_lo);
+	ref.restore_checkpoint(ref_lo);
+	if (!differ)
+	{
+		os << "They did not differ again when run a second time from insn " << lo << std::endl;
+		return;
+	}
+
+	// halve the insns while either half still differs on its own, which
+	// 	stops early when the engine only goes wrong running a whole block
+	while (hi - lo > 1)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		run_to(mid);
+		if (!agree())
+		{
+			hi = mid;
+			test.restore_checkpoint(test_lo);
+			ref.restore_checkpoint(ref_lo);
+			continue;
+		}
+		cpu_single_hart::checkpoint test_mid;
+		cpu_single_hart::checkpoint ref_mid;
+		test.save_checkpoint(test_mid);
+		ref.save_checkpoint(ref_mid);
+		run_to(hi);
+		differ = !agree();
+		test.restore_checkpoint(differ ? test_mid : test_lo);
+		ref.restore_checkpoint(differ ? ref_mid : ref_lo);
+		if (!differ)
+			break;
+		lo = mid;
+		test.save_checkpoint(test_lo);
+		ref.save_checkpoint(ref_lo);
+	}
+
+	if (hi - lo == 1)
+		os << "They first differ after insn " << hi << ":" << std::endl;
+	else
+		os << "They first differ after insns " << lo + 1 << " to " << hi << ", which " << name
+			<< " only gets wrong when it runs them together:" << std::endl;
+	for (uint64_t n = lo + 1; n <= hi && !ref.is_halted(); n++)
+	{
+		uint32_t pc = ref.get_pc();
+		uint32_t insn = ref_mem.get32(pc);
+		if (n - lo <= max_listed)
+			os << "  " << hex::to_hex32(pc) << ": " << hex::to_hex32(insn) << "  " << rv32i_decode::decode(pc, insn) << std::endl;
+		ref.run_reference(n);
+	}
+	if (hi - lo > max_listed)
+		os << "  ... and " << hi - lo - max_listed << " more" << std::endl;
+	test.execute(hi);
+	report_differences(os);
+}
+
+void lockstep::report_differences(std::ostream& os) const
+{
+	const char* name = cpu_single_hart::get_engine_name(test.get_engine());
+	auto differ = [&](const std::string& what, const std::string& r, const std::string& t)
+	{
+		os << "  " << std::left << std::setw(18) << what << std::right << " reference " << r << "  " << name << " " << t << std::endl;
+	};
+	auto state = [](const cpu_single_hart& h) { return h.is_halted() ? "halted:" + h.get_halt_reason() : std::string("running"); };
+
+	if (test.get_insn_counter() != ref.get_insn_counter())
+		differ("insns", std::to_string(ref.get_insn_counter()), std::to_string(test.get_insn_counter()));
+	if (state(test) != state(ref))
+		differ("state", state(ref), state(test));
+	if (test.get_pc() != ref.get_pc())
+		differ("pc", hex::to_hex0x32(ref.get_pc()), hex::to_hex0x32(test.get_pc()));
+	for (uint32_t r = 0; r < 32; r++)
+		if (test.get_reg(r) != ref.get_reg(r))
+			differ("x" + std::to_string(r), hex::to_hex0x32(ref.get_reg(r)), hex::to_hex0x32(test.get_reg(r)));
+	uint32_t addr;
+	if (test_mem.find_difference(ref_mem, addr))
+	{
+		// the word holding the lowest byte that differs
+		uint32_t word = addr & ~uint32_t(3);
+		differ("m32(" + hex::to_hex0x32(word) + ")", hex::to_hex0x32(ref_mem.get32(word)), hex::to_hex0x32(test_mem.get32(word)));
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+#include "cpu_single_hart.h"
+#include <ostream>
+#include <vector>
+
+/**
+ * Runs a hart on the engine under test in lockstep with a reference hart
+ * 	that runs every insn through rv32i_hart::run_reference(), each on its
+ * 	own memory loaded with the same image, and checks that they agree.  The
+ * 	reference reads and decodes each insn afresh, so decoding, the
+ * 	decoded-insn cache and its invalidation are checked along with the
+ * 	engine itself.
+ *
+ * Every interval insns both stop and their pcs, registers, halt states and
+ * 	insn counts are compared, along with the pages either stored to since
+ * 	the last check.  When they differ, both are run again from the start
+ * 	to the last check they agreed at, and the insns between that and the
+ * 	check that failed are halved from checkpoints until the one insn they
+ * 	first differ after is found.  So a long interval costs little and still
+ * 	finds the insn precisely.
+ *
+ * The block and jit engines only run a block whole when it ends by the
+ * 	insn they were asked to stop at, and run the insns before that one at
+ * 	a time.  So they should be checked with an interval longer than their
+ * 	blocks, and a difference that only comes of running a whole block is
+ * 	narrowed down to that block rather than one insn.
+ **/
+class lockstep
+{
+public:
+	/**
+	 * @param test The hart under test, set up to run on its engine.
+	 * @param ref The reference, set up the same way on another memory
+	 * 	of the same size.  Its engine is not used.
+	 * @param interval The insns between checks, 1 to check after every one.
+	 **/
+	lockstep(cpu_single_hart& test, memory& test_mem, cpu_single_hart& ref, memory& ref_mem, uint64_t interval);
+
+	/**
+	 * @brief Run both until they halt or exec_limit insns have executed,
+	 * 	or until they differ.
+	 * @param os Where the result goes: the insns and checks run if the
+	 * 	harts agreed, or the insn they first differ after and each
+	 * 	difference.
+	 * @param exec_limit The insn count at which to stop, or 0 for no limit.
+	 * @return true If the harts agreed at every check.
+	 **/
+	bool run(uint64_t exec_limit, std::ostream& os);
+
+private:
+	/// @return true If the harts' pcs, registers, halt states and insn counts are the same.
+	bool same_harts() const;
+
+	/// @return true If the harts and all of their memories are the same.
+	bool agree() const;
+
+	/**
+	 * @return true If the harts and the pages stored to in either memory
+	 * 	since the last check are the same.
+	 **/
+	bool agree_since_check();
+
+	/// @brief Run both harts until the insn counter reaches n.
+	void run_to(uint64_t n);
+
+	/**
+	 * @brief Find the insn after good, where they agreed, that they first
+	 * 	differ after, and report it with the differences it made.
+	 **/
+	void locate(uint64_t good, uint64_t bad, std::ostream& os);
+
+	/// @brief Print each way the harts differ.
+	void report_differences(std::ostream& os) const;
+
+	cpu_single_hart& test;
+	memory& test_mem;
+	cpu_single_hart& ref;
+	memory& ref_mem;
+	uint64_t interval;
+	uint64_t checks = { 0 };
+	uint64_t start_insns = { 0 };	///< the insn counter before running
+	cpu_single_hart::checkpoint test_start;	///< as they were before running
+	cpu_single_hart::checkpoint ref_start;
+	std::vector<uint32_t> stored;	///< the pages stored to since the last check
+
+	static constexpr uint64_t max_listed = 32;	///< insns shown when they only differ after several
+};
+
+#endif // LOCKSTEP_H
@@ -15,6 +15,17 @@
 //#include "memory.h"
 //#include "registerfile.h"
 #include"cpu_single_hart.h"
+#include "cpu_multi_hart.h"
+#include "elf32.h"
+#include "batch.h"
+#include "trace_writer.h"
+#include "stack_sampler.h"
+#include "cache_model.h"
+#include "branch_predictor.h"
+#include "pipeline_model.h"
+#include "phase_sampler.h"
+#include "lockstep.h"
+#include <fstream>
 
 using std::cout;
 using std::endl;
@@ -26,12 +37,50 @@ using std::cerr;
 
 static void usage()
 {
-	cout << "Usage : rv32i [-d ] [ -i] [-r] [- z] [-l exec - limit ] [-m hex - mem - size ] infile\n";
+	cout << "Usage : rv32i [-a hex - load - addr ] [-d ] [-e engine] [ -i] [-r] [- z] [-l exec - limit ] [-m hex - mem - size ] [-n harts] [-p top-n] [-f profile-file] [-g folded-file] [-c sample-period] [-I icache] [-D dcache] [-B predictor]... [-P pipeline] [-S skip:window[:warm-up]] [-V bbv-file] [-L interval] [-t trace-file] [-s hex-trace-buffer] [-x] [-w binary-trace-file] infile\n";
+	cout << "        rv32i -b manifest [-j threads] [-o report] [-e engine] [-l exec - limit ] [-m hex - mem - size ]\n";
+	cout << "-b run every job in a manifest of 'image [hex-mem-size [hex-exec-limit]]' lines\n";
+	cout << "   and write a JSON report of each job's halt reason, insn count and registers\n";
+	cout << "-a load the file at this address and start execution there ( default = 0 )\n";
+	cout << "   an ELF32 RISC-V infile is loaded at its own addresses and started at its entry point instead\n";
+	cout << "-B model a branch predictor and show its mispredictions after simulation; give it again to\n";
+	cout << "   run several side by side: bimodal[:entries], gshare[:entries[:history-bits]], tage,\n";
+	cout << "   btb[:entries] or ras[:depth] ( defaults bimodal:4096, gshare:4096:12, btb:512, ras:16 )\n";
+	cout << "-c sample the call stack for -g about every this many insns ( default = 10000 )\n";
 	cout << "-d show disassembly before program execution\n";
+	cout << "-D model an L1 data cache given as size:ways:line-size[:lru|plru|random], e.g. 16k:4:32:plru,\n";
+	cout << "   and show its hits and misses after simulation; it runs the block and jit engines as threaded\n";
+	cout << "-e execution engine when not tracing: tick, threaded, block or jit ( default = threaded )\n";
+	cout << "-f count the insns run by handler and pc and write every count to this file\n";
+	cout << "-g sample the guest call stack and write it to this file as folded stacks for flamegraphs\n";
 	cout << "-i show instruction printing during execution\n";
+	cout << "-I model an L1 insn cache, given as for -D\n";
+	cout << "-j number of threads running batch jobs ( default = one per core )\n";
+	cout << "-L run the engine against a reference that decodes each insn afresh from memory, each on its\n";
+	cout << "   own copy of memory, comparing the pc, registers and stored-to pages every this many insns,\n";
+	cout << "   and show the first insn they differ after; give block and jit more than a block's insns\n";
+	cout << "   ( e.g. 1000 ), since they run one insn at a time up to each check; needs a single hart\n";
+	cout << "   and none of -B, -D, -f, -g, -I, -i, -P, -p, -r, -S and -w\n";
 	cout << "-l maximum number of instructions to exec\n";
-	cout << "-m specify memory size ( default = 0 x100 )\n";
-	cout << "-r show register printing during executio\n";	
+	cout << "-n number of harts, each run on its own thread ( default = 1 )\n";
+	cout << "-o write the batch report to this file ( default = standard output )\n";
+	cout << "-P time the run on a 5-stage in-order pipeline and show its cycles, CPI and stalls; give\n";
+	cout << "   default or comma-separated key=value: ex, mem ( cycles, default 1 ), branch, jal, jalr\n";
+	cout << "   ( penalties, default 2, 1, 2 ), miss ( L1 miss penalty, default 10 ), forward=on|off\n";
+	cout << "   and predict=predictor as for -B ( default predicts branches not taken )\n";
+	cout << "-p count the insns run by handler and pc and show the top-n of each ( -f alone shows 10 )\n";
+	cout << "   profiling runs the block and jit engines as threaded, and needs a single hart\n";
+	cout << "   as do -g and -B, which run the jit engine as block, -D, -I and -P\n";
+	cout << "-m specify memory size, up to 100000000 ( default = 0 x100 )\n";
+	cout << "-r show register printing during executio\n";
+	cout << "-S run in phases: skip insns on the fastest engine with -p, -B, -D, -I and -P off, then run\n";
+	cout << "   warm-up insns and a window of insns with them on, and repeat; estimate the whole run from\n";
+	cout << "   the windows, with 95% confidence intervals\n";
+	cout << "-s trace buffer size in bytes ( default = 0x400000 )\n";
+	cout << "-t write the -i/-r trace to this file ( default = standard output )\n";
+	cout << "-V with -S, write the basic block vector of each phase to this file for SimPoint\n";
+	cout << "-w write a compact binary trace of every insn to this file, for trace_render\n";
+	cout << "-x drop trace lines when the trace buffer is full instead of waiting\n";	
 	cout << "-z show a dump of the regs & memory after simulation\n";
 	exit(1);
 }
@@ -39,18 +88,122 @@ static void usage()
 /**
  * @brief a loop which prints addresses and fullword values from simulated memory
  * @param mem The simulated memory
+ * @param elf The symbols to label the listing with.
  **/
-static void disassemble(const memory& mem)
+static void disassemble(const memory& mem, const elf32& elf)
 {
 
-	for (uint32_t i = 0; i < mem.get_size(); i+= 4)
+	for (uint64_t i = 0; i < mem.get_size(); i+= 4)
 	{	
-		cout << hex::to_hex32(i) << ": " << hex::to_hex32(mem.get32(i)) << "  "; 
-		cout << rv32i_decode::decode(i, mem.get32(i)) << endl;
+		const elf32::symbol* sym = elf.find_symbol(i);
+		if (sym && sym->addr + 4 > i)
+			cout << sym->name << ":\n";
+		uint32_t insn = mem.get32(i);
+		char buf[20];
+		char* p = hex::put_hex32(buf, i);
+		*p++ = ':';
+		*p++ = ' ';
+		p = hex::put_hex32(p, insn);
+		*p++ = ' ';
+		*p++ = ' ';
+		cout.write(buf, p - buf);
+		cout << rv32i_decode::decode(i, insn) << '\n';
 	}
 	return;
 }
 
+/**
+ * @brief Set cpu up as the command line asked, run it, and dump it if -z was given.
+ * @param cpu A cpu_single_hart or cpu_multi_hart over mem.
+ * @param trace Where the -i/-r trace goes.
+ * @param btrace Where the -w trace goes, or null.
+ **/
+template <class CPU>
+static void simulate(CPU& cpu, memory& mem, uint32_t start_pc, cpu_single_hart::engine_type engine,
+	bool iFlag, bool rFlag, bool zFlag, uint64_t exec_limit, std::ostream* trace, binary_trace_writer* btrace)
+{
+	cpu.reset();
+	cpu.set_pc(start_pc);
+	cpu.set_engine(engine);
+	cpu.set_trace_stream(trace);
+	cpu.set_binary_trace(btrace);
+
+	if (iFlag)
+		cpu.set_show_instructions(true);
+
+	if (rFlag)
+		cpu.set_show_registers(true);
+
+
+	cpu.run(exec_limit);
+
+	if (zFlag){
+		cpu.dump();
+		mem.dump();
+	}
+}
+
+/**
+ * @brief Run every job in manifest and write the report.
+ * @param report The file to write the report to, or empty for standard output.
+ * @return The exit status for main.
+ **/
+static int run_batch(const std::string& manifest, const std::string& report, unsigned nthreads,
+	cpu_single_hart::engine_type engine, uint64_t memory_limit, uint64_t exec_limit)
+{
+	batch b(engine, memory_limit, exec_limit);
+	if (!b.read_manifest(manifest))
+		usage();
+	b.run(nthreads);
+
+	if (report.empty())
+	{
+		b.report(cout);
+		return 0;
+	}
+	std::ofstream out(report);
+	b.report(out);
+	if (!out)
+	{
+		cerr << "Can’t write file '" << report << "'." << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Run the engine in lockstep with the reference on a second copy of the image in mem.
+ * @param image The infile mem was loaded from.
+ * @return The exit status for main: 1 if they differed.
+ **/
+static int run_lockstep(memory& mem, const std::string& image, uint32_t load_addr, uint32_t start_pc,
+	cpu_single_hart::engine_type engine, uint64_t memory_limit, uint64_t exec_limit, uint64_t interval, bool zFlag)
+{
+	memory ref_mem(memory_limit);
+	elf32 elf;
+	if (elf32::is_elf(image) ? !elf.load(image, ref_mem) : !ref_mem.load_file(image, load_addr))
+		usage();
+
+	cpu_single_hart test(mem);
+	cpu_single_hart ref(ref_mem);
+	for (cpu_single_hart* cpu : { &test, &ref })
+	{
+		cpu->reset();
+		cpu->set_pc(start_pc);
+		cpu->set_sp(mem.get_size());
+	}
+	test.set_engine(engine);
+
+	lockstep l(test, mem, ref, ref_mem, interval);
+	bool agreed = l.run(exec_limit, cout);
+	if (zFlag)
+	{
+		test.dump();
+		mem.dump();
+	}
+	return agreed ? 0 : 1;
+}
+
 /**
  * @brief The entry point which utilises hex and memory classes to simulate memory.
  * @param argc The number of command line arguments passed in.
@@ -58,30 +211,183 @@ static void disassemble(const memory& mem)
  **/
 int main(int argc, char **argv)
 {
-	uint32_t memory_limit = 0x100;	// default memory size is 256 bytes
+	uint64_t memory_limit = 0x100;	// default memory size is 256 bytes
 
 	bool dFlag = false;
 	bool iFlag = false;
 	bool rFlag = false;
 	bool zFlag = false;
 	uint32_t exec_limit = 0;
+	uint32_t load_addr = 0;
+	unsigned nharts = 1;
+	std::string manifest;
+	std::string report;
+	unsigned nthreads = 0;
+	std::string trace_name;
+	std::string binary_name;
+	size_t profile_top = 0;
+	std::string profile_name;
+	std::string folded_name;
+	uint64_t sample_period = 10000;
+	std::unique_ptr<cache_model::config> l1i_config;
+	std::unique_ptr<cache_model::config> l1d_config;
+	branch_model branches;
+	std::unique_ptr<pipeline_model::config> pipeline_config;
+	std::unique_ptr<phase_sampler::config> phase_config;
+	std::string vectors_name;
+	uint64_t lockstep_interval = 0;
+	size_t trace_buffer = trace_writer::default_ring_size;
+	trace_writer::full_policy trace_policy = trace_writer::wait_when_full;
+	cpu_single_hart::engine_type engine = cpu_single_hart::engine_threaded;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "l:dirm:z")) != -1)
+	while ((opt = getopt(argc, argv, "a:b:c:e:f:g:j:l:dim:n:o:p:rs:t:w:xzB:D:I:L:P:S:V:")) != -1)
 	{
 		switch(opt)
 		{
+			case 'a': //load the file somewhere other than 0
+				{
+					std::istringstream iss(optarg);
+					iss >> std::hex >> load_addr;
+					break;
+				}
 			case 'm':
 				{ //set the given mem size
 					std::istringstream iss(optarg);
 					iss >> std::hex >> memory_limit;
 					break;
 				}
+			case 'n': //run this many harts over the same memory
+				{
+					std::istringstream iss(optarg);
+					iss >> nharts;
+					if (nharts == 0)
+						usage();
+					break;
+				}
+			case 'b': //run the jobs in this manifest instead of an infile
+				{
+					manifest = optarg;
+					break;
+				}
+			case 'j': //run batch jobs on this many threads
+				{
+					std::istringstream iss(optarg);
+					iss >> nthreads;
+					break;
+				}
+			case 'o': //write the batch report here
+				{
+					report = optarg;
+					break;
+				}
+			case 'p': //profile and show the insns that ran most
+				{
+					std::istringstream iss(optarg);
+					iss >> profile_top;
+					if (profile_top == 0)
+						usage();
+					break;
+				}
+			case 'f': //profile and write the counts to a file
+				{
+					profile_name = optarg;
+					break;
+				}
+			case 'g': //sample the call stack into a file
+				{
+					folded_name = optarg;
+					break;
+				}
+			case 'c': //sample this often
+				{
+					std::istringstream iss(optarg);
+					iss >> sample_period;
+					if (sample_period == 0)
+						usage();
+					break;
+				}
+			case 'I': //model an insn cache
+				{
+					l1i_config.reset(new cache_model::config);
+					if (!cache_model::parse_config(optarg, *l1i_config))
+						usage();
+					break;
+				}
+			case 'B': //model a branch predictor
+				{
+					std::unique_ptr<branch_predictor> p = branch_predictor::create(optarg);
+					if (!p)
+						usage();
+					branches.add(std::move(p));
+					break;
+				}
+			case 'D': //model a data cache
+				{
+					l1d_config.reset(new cache_model::config);
+					if (!cache_model::parse_config(optarg, *l1d_config))
+						usage();
+					break;
+				}
+			case 'P': //time the run on a pipeline
+				{
+					pipeline_config.reset(new pipeline_model::config);
+					if (!pipeline_model::parse_config(optarg, *pipeline_config))
+						usage();
+					break;
+				}
+			case 'S': //run in phases, measuring only windows
+				{
+					phase_config.reset(new phase_sampler::config);
+					if (!phase_sampler::parse_config(optarg, *phase_config))
+						usage();
+					break;
+				}
+			case 'V': //write the basic block vectors of the phases
+				{
+					vectors_name = optarg;
+					break;
+				}
+			case 'L': //check the engine against the reference every this many insns
+				{
+					std::istringstream iss(optarg);
+					iss >> lockstep_interval;
+					if (lockstep_interval == 0)
+						usage();
+					break;
+				}
+			case 's': //buffer this much trace between the harts and the writer thread
+				{
+					std::istringstream iss(optarg);
+					iss >> std::hex >> trace_buffer;
+					break;
+				}
+			case 't': //write the trace to a file
+				{
+					trace_name = optarg;
+					break;
+				}
+			case 'w': //write a binary trace to a file
+				{
+					binary_name = optarg;
+					break;
+				}
+			case 'x': //lose trace rather than slow the simulation down
+				{
+					trace_policy = trace_writer::drop_when_full;
+					break;
+				}
 			case 'd': //show a disassembly of the memory
 				{
 					dFlag = true;
 					break;
 				}
+			case 'e': //pick the engine used when nothing is traced
+				{
+					if (!cpu_single_hart::parse_engine(optarg, engine))
+						usage();
+					break;
+				}
 			case 'i': //show insn printing during execution
 				{
 					iFlag = true;
@@ -109,33 +415,166 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (!manifest.empty())
+		return run_batch(manifest, report, nthreads, engine, memory_limit, exec_limit);
+
 	if (optind >= argc)
 		usage();	
+	bool profiling = profile_top || !profile_name.empty();
+	if ((profiling || !folded_name.empty() || l1i_config || l1d_config || !branches.empty() || pipeline_config || phase_config) && nharts > 1)
+		usage();
+	if (!vectors_name.empty() && !phase_config)
+		usage();
+	if (lockstep_interval && (nharts > 1 || profiling || !folded_name.empty() || l1i_config || l1d_config
+		|| !branches.empty() || pipeline_config || phase_config || iFlag || rFlag || !binary_name.empty()))
+		usage();
 
 	memory mem(memory_limit);
+	elf32 elf;
+	uint32_t start_pc = load_addr;
 
-	if (!mem.load_file(argv[optind]))
+	if (elf32::is_elf(argv[optind]))
+	{
+		if (!elf.load(argv[optind], mem))
+			usage();
+		start_pc = elf.get_entry();
+	}
+	else if (!mem.load_file(argv[optind], load_addr))
 		usage();
 
 	if (dFlag)
-		disassemble(mem);
+		disassemble(mem, elf);
+	if (lockstep_interval)
+		return run_lockstep(mem, argv[optind], load_addr, start_pc, engine, memory_limit, exec_limit, lockstep_interval, zFlag);
 	
-	cpu_single_hart cpu(mem);
-	cpu.reset();
+	// the trace is written out by a background thread
+	FILE* trace_file = stdout;
+	std::unique_ptr<trace_writer> writer;
+	std::unique_ptr<std::ostream> trace_stream;
+	std::ostream* trace = &std::cout;
+	if (iFlag || rFlag)
+	{
+		if (!trace_name.empty() && !(trace_file = fopen(trace_name.c_str(), "w")))
+		{
+			cerr << "Can’t open file '" << trace_name << "' for writing." << endl;
+			usage();
+		}
+		writer.reset(new trace_writer(trace_file, trace_buffer, trace_policy));
+		trace_stream.reset(new std::ostream(writer.get()));
+		trace = trace_stream.get();
+	}
 
-	if (iFlag)
-		cpu.set_show_instructions(true);
+	// the binary trace gets a writer thread of its own, and never drops
+	// 	anything since every record depends on the ones before it
+	FILE* binary_file = nullptr;
+	std::unique_ptr<trace_writer> binary_writer;
+	std::unique_ptr<std::ostream> binary_stream;
+	std::unique_ptr<binary_trace_writer> btrace;
+	if (!binary_name.empty())
+	{
+		if (!(binary_file = fopen(binary_name.c_str(), "wb")))
+		{
+			cerr << "Can’t open file '" << binary_name << "' for writing." << endl;
+			usage();
+		}
+		binary_writer.reset(new trace_writer(binary_file, trace_buffer));
+		binary_stream.reset(new std::ostream(binary_writer.get()));
+		btrace.reset(new binary_trace_writer(*binary_stream, mem.get_size(), nharts));
+	}
 
-	if (rFlag)
-		cpu.set_show_registers(true);
+	if (nharts > 1)
+	{
+		cpu_multi_hart cpu(mem, nharts);
+		simulate(cpu, mem, start_pc, engine, iFlag, rFlag, zFlag, exec_limit, trace, btrace.get());
+	}
+	else
+	{
+		cpu_single_hart cpu(mem);
+		std::unique_ptr<profile> prof;
+		if (profiling)
+		{
+			prof.reset(new profile(mem.get_size(), rv32i_hart::get_handler_names()));
+			cpu.set_profile(prof.get());
+			cpu.set_profile_top(profile_top ? profile_top : 10);
+		}
+		std::unique_ptr<stack_sampler> sampler;
+		if (!folded_name.empty())
+		{
+			sampler.reset(new stack_sampler(sample_period));
+			cpu.set_sampler(sampler.get());
+		}
+		std::unique_ptr<cache_model> l1i;
+		std::unique_ptr<cache_model> l1d;
+		if (l1i_config)
+			l1i.reset(new cache_model(*l1i_config));
+		if (l1d_config)
+			l1d.reset(new cache_model(*l1d_config));
+		cpu.set_caches(l1i.get(), l1d.get());
+		if (!branches.empty())
+			cpu.set_branch_model(&branches);
+		std::unique_ptr<pipeline_model> pipeline;
+		if (pipeline_config)
+		{
+			pipeline.reset(new pipeline_model(*pipeline_config));
+			pipeline->set_caches(l1i.get(), l1d.get());
+			cpu.set_pipeline(pipeline.get());
+		}
+		std::unique_ptr<phase_sampler> phases;
+		std::unique_ptr<basic_block_vectors> vectors;
+		if (phase_config)
+		{
+			phases.reset(new phase_sampler(*phase_config));
+			cpu.set_phases(phases.get());
+		}
+		if (!vectors_name.empty())
+		{
+			vectors.reset(new basic_block_vectors);
+			cpu.set_block_vectors(vectors.get());
+		}
+		simulate(cpu, mem, start_pc, engine, iFlag, rFlag, zFlag, exec_limit, trace, btrace.get());
 
+		if (!profile_name.empty())
+		{
+			std::ofstream out(profile_name);
+			prof->dump(out);
+			if (!out)
+				cerr << "Can’t write file '" << profile_name << "'." << endl;
+		}
+		if (sampler)
+		{
+			std::ofstream out(folded_name);
+			sampler->write_folded(out, &elf);
+			if (!out)
+				cerr << "Can’t write file '" << folded_name << "'." << endl;
+		}
+		if (vectors)
+		{
+			std::ofstream out(vectors_name);
+			vectors->write(out);
+			if (!out)
+				cerr << "Can’t write file '" << vectors_name << "'." << endl;
+		}
+	}
 
-	if (zFlag){
-		cpu.dump();
-		mem.dump();
+	if (writer)
+	{
+		trace_stream.reset();
+		uint64_t dropped = writer->get_dropped();
+		writer.reset();
+		if (dropped)
+			cerr << dropped << " bytes of trace were dropped" << endl;
+		if (trace_file != stdout && (ferror(trace_file) | fclose(trace_file)))
+			cerr << "Can’t write file '" << trace_name << "'." << endl;
 	}
 
-	cpu.run(exec_limit);
+	if (btrace)
+	{
+		btrace.reset();
+		binary_stream.reset();
+		binary_writer.reset();
+		if (ferror(binary_file) | fclose(binary_file))
+			cerr << "Can’t write file '" << binary_name << "'." << endl;
+	}
 
 	return 0;
 }
@@ -1,63 +1,207 @@
 #include "memory.h"
 #include "hex.h"
+#include <algorithm>
 
 using std::cout;
 using std::endl;
 
-memory::memory(uint32_t siz)
+namespace
 {
-	siz = (siz + 15) & 0xfffffff0; // round the length up, mod-16
+	std::atomic<uint64_t> next_memory_id(1);	// 0 marks an empty last-page cache
+}
+
+memory::memory(uint64_t siz) : id(next_memory_id++)
+{
+	size = (siz + 15) & ~uint64_t(15); // round the length up, mod-16
+	if (size > (uint64_t(1) << 32))
+		size = uint64_t(1) << 32;
 
-	std::vector< uint8_t > temp (siz);
-	fill(temp.begin(), temp.end(), 0xa5);
-	mem = temp;
+	// one entry per page table needed to cover the memory, all empty for now
+	ntables = (size + (uint64_t(page_size) << table_bits) - 1) >> (page_bits + table_bits);
+	dir.reset(new std::atomic<page_table*>[ntables]);
+	for (uint64_t i = 0; i < ntables; i++)
+		dir[i].store(nullptr, std::memory_order_relaxed);
 }
 
 memory::~memory() 
 {
-	//a destructor goes here
+	for (uint64_t i = 0; i < ntables; i++)
+	{
+		page_table* t = dir[i].load(std::memory_order_relaxed);
+		if (!t)
+			continue;
+		for (std::atomic<page*>& pg : t->pages)
+			delete pg.load(std::memory_order_relaxed);
+		delete t;
+	}
 }
 
-bool memory::check_illegal(uint32_t addr) const
+memory::page* memory::alloc_page(uint32_t addr)
 {
-	hex obj;
-	if (addr > mem.size())
+	std::lock_guard<std::mutex> lock(alloc_mutex);
+
+	uint32_t num = addr >> page_bits;
+	page_table* t = dir[num >> table_bits].load(std::memory_order_relaxed);
+	if (!t)
 	{
-		cout << "WARNING: Address out of range : " << obj.to_hex0x32(addr) << endl;
+		t = new page_table;
+		for (std::atomic<page*>& pg : t->pages)
+			pg.store(nullptr, std::memory_order_relaxed);
+		dir[num >> table_bits].store(t, std::memory_order_release);
+	}
 
-		return true;
-	}	
-	return false;
+	std::atomic<page*>& slot = t->pages[num & ((1u << table_bits) - 1)];
+	page* pg = slot.load(std::memory_order_relaxed);
+	if (pg)
+		return pg;	// another thread got here first
+
+	pg = new page;
+	memset(pg->data, fill, sizeof(pg->data));
+	for (std::atomic<uint32_t>& w : pg->code_watch)
+		w.store(0, std::memory_order_relaxed);
+	pg->dirty.store(false, std::memory_order_relaxed);
+	pg->num = num;
+	all_pages.push_back(pg);
+	slot.store(pg, std::memory_order_release);
+	return pg;
 }
 
-uint32_t memory::get_size() const
+void memory::mark_dirty(page* pg)
 {
-	return mem.size();
+	if (pg->dirty.exchange(true, std::memory_order_relaxed))
+		return;	// another thread got here first
+	std::lock_guard<std::mutex> lock(dirty_mutex);
+	dirty_pages.push_back(pg);
 }
 
-uint8_t memory::get8(uint32_t addr) const
+void memory::take_snapshot(snapshot& s)
 {
-	if (check_illegal(addr))
+	s.owner = id;
+	s.serial = ++last_serial;
+	s.pages.clear();
+	for (page* pg : all_pages)
 	{
-		return 0;
+		std::unique_ptr<uint8_t[]>& copy = s.pages[pg->num];
+		copy.reset(new uint8_t[page_size]);
+		memcpy(copy.get(), pg->data, page_size);
 	}
-	else return mem.at(addr);
+
+	for (page* pg : dirty_pages)
+		pg->dirty.store(false, std::memory_order_relaxed);
+	dirty_pages.clear();
+	dirty_serial = s.serial;
 }
 
-uint16_t memory::get16(uint32_t addr) const
+void memory::restore_page(page* pg, const snapshot& s)
 {
-	uint8_t firstByte = get8(addr);
-	uint8_t secondByte = get8(addr + 1);
-	uint16_t littleEndianReturn = secondByte << 8 | firstByte;
-	return littleEndianReturn;
+	auto it = s.pages.find(pg->num);
+	uint8_t blank[page_size];
+	const uint8_t* from = blank;
+	if (it != s.pages.end())
+		from = it->second.get();
+	else
+		memset(blank, fill, page_size);
+
+	// decoded insns stay good unless a watched word actually changes
+	bool changed = false;
+	for (uint32_t i = 0; i < page_size / 4 / 32 && !changed; i++)
+	{
+		uint32_t bits = pg->code_watch[i].load(std::memory_order_relaxed);
+		for (uint32_t word = i * 32; bits; bits >>= 1, word++)
+			if (bits & 1 && memcmp(&pg->data[word * 4], &from[word * 4], 4) != 0)
+				changed = true;
+	}
+	if (changed)
+	{
+		for (std::atomic<uint32_t>& w : pg->code_watch)
+			w.store(0, std::memory_order_relaxed);
+		code_generation.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	memcpy(pg->data, from, page_size);
+}
+
+bool memory::restore_snapshot(const snapshot& s)
+{
+	if (s.owner != id)
+		return false;
+
+	// the dirty flags only say what changed since dirty_serial
+	const std::vector<page*>& changed = s.serial == dirty_serial ? dirty_pages : all_pages;
+	for (page* pg : changed)
+		restore_page(pg, s);
+
+	for (page* pg : dirty_pages)
+		pg->dirty.store(false, std::memory_order_relaxed);
+	dirty_pages.clear();
+	dirty_serial = s.serial;
+	return true;
+}
+
+bool memory::find_difference(const memory& other, uint32_t& addr) const
+{
+	std::vector<uint32_t> pages;
+	for (const page* pg : all_pages)
+		pages.push_back(pg->num);
+	for (const page* pg : other.all_pages)
+		pages.push_back(pg->num);
+	return find_difference(other, pages, addr);
+}
+
+bool memory::find_difference(const memory& other, const std::vector<uint32_t>& pages, uint32_t& addr) const
+{
+	uint8_t blank[page_size];
+	memset(blank, fill, page_size);
+
+	bool found = false;
+	auto compare = [&](uint32_t num)
+	{
+		const page* a = find_page(num << page_bits);
+		const page* b = other.find_page(num << page_bits);
+		const uint8_t* da = a ? a->data : blank;
+		const uint8_t* db = b ? b->data : blank;
+		if (memcmp(da, db, page_size) == 0)
+			return;
+		uint32_t i = 0;
+		while (da[i] == db[i])
+			i++;
+		uint32_t at = (num << page_bits) + i;
+		if (!found || at < addr)
+			addr = at;
+		found = true;
+	};
+	for (uint32_t num : pages)
+		compare(num);
+	return found;
+}
+
+void memory::take_stored_pages(std::vector<uint32_t>& pages)
+{
+	for (page* pg : dirty_pages)
+	{
+		pages.push_back(pg->num);
+		pg->dirty.store(false, std::memory_order_relaxed);
+	}
+	dirty_pages.clear();
+	// no snapshot has serial 0, so the next restore copies every page
+	dirty_serial = 0;
+}
+
+bool memory::check_illegal(uint32_t addr) const
+{
+	hex obj;
+	if (addr >= size)
+	{
+		cout << "WARNING: Address out of range : " << obj.to_hex0x32(addr) << endl;
+
+		return true;
+	}	
+	return false;
 }
 
-uint32_t memory::get32(uint32_t addr) const
+uint64_t memory::get_size() const
 {
-	uint16_t firstChunk = get16(addr);
-	uint16_t secondChunk = get16(addr + 2);
-	uint32_t littleEndianReturn = secondChunk << 16 | firstChunk;
-	return littleEndianReturn;
+	return size;
 }
 
 int32_t memory::get8_sx(uint32_t addr) const
@@ -78,86 +222,220 @@ int32_t memory::get32_sx(uint32_t addr) const
 	return get32(addr);
 }
 
-void memory::set8(uint32_t addr, uint8_t val)
+void memory::watch_code(uint32_t addr)
 {
-	if (check_illegal(addr))
+	// an insn at a pc that is not word-aligned straddles two words
+	for (uint64_t a = addr & ~3u; a <= uint64_t(addr) + 3 && a < size; a += 4)
 	{
-		return;
+		page* pg = touch_page(a);
+		uint32_t word = (a & (page_size - 1)) / 4;
+		pg->code_watch[word / 32].fetch_or(1u << (word % 32), std::memory_order_relaxed);
 	}
-	mem.at(addr) = val;
-	return;
 }
 
-void memory::set16(uint32_t addr, uint16_t val)
+namespace
 {
-	uint8_t byteA = val >> 8;
-	uint8_t byteB = val & 0x00FF;
-	set8(addr, byteB);
-	set8(addr + 1, byteA);
-	return;
+	/// @return The little-endian word w in host order, or the reverse.
+	inline uint32_t le_word(uint32_t w)
+	{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		return __builtin_bswap32(w);
+#else
+		return w;
+#endif
+	}
+
+	/// @return What an AMO with op leaves in a word that held old.
+	uint32_t amo_result(memory::amo_op op, uint32_t old, uint32_t val)
+	{
+		switch (op)
+		{
+		case memory::amo_swap:	return val;
+		case memory::amo_add:	return old + val;
+		case memory::amo_xor:	return old ^ val;
+		case memory::amo_and:	return old & val;
+		case memory::amo_or:	return old | val;
+		case memory::amo_min:	return int32_t(old) < int32_t(val) ? old : val;
+		case memory::amo_max:	return int32_t(old) > int32_t(val) ? old : val;
+		case memory::amo_minu:	return old < val ? old : val;
+		case memory::amo_maxu:	return old > val ? old : val;
+		}
+		return old;
+	}
 }
 
-void memory::set32(uint32_t addr, uint32_t val)
+uint32_t memory::atomic_load32(uint32_t addr) const
 {
-	uint16_t byteA = val >> 16;
-	uint16_t byteB = val & 0xFFFF;
-	set16(addr, byteB);
-	set16(addr + 2, byteA);
-	return;
+	if (!in_one_page(addr, 4))
+	{
+		check_illegal(addr);
+		return 0;
+	}
+	const page* pg = find_page(addr);
+	if (!pg)
+		return fill * 0x01010101u;
+	const uint32_t* p = reinterpret_cast<const uint32_t*>(&pg->data[addr & (page_size - 1)]);
+	return le_word(__atomic_load_n(p, __ATOMIC_SEQ_CST));
 }
 
-void memory::dump() const
+uint32_t memory::atomic_rmw32(uint32_t addr, amo_op op, uint32_t val)
+{
+	if (!in_one_page(addr, 4))
+	{
+		check_illegal(addr);
+		return 0;
+	}
+	page* pg = touch_page(addr);
+	uint32_t* p = reinterpret_cast<uint32_t*>(&pg->data[addr & (page_size - 1)]);
+	uint32_t old;
+
+	switch (op)
+	{
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+	// the host has a single instruction for these
+	case amo_swap:	old = __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST); break;
+	case amo_add:	old = __atomic_fetch_add(p, val, __ATOMIC_SEQ_CST); break;
+	case amo_xor:	old = __atomic_fetch_xor(p, val, __ATOMIC_SEQ_CST); break;
+	case amo_and:	old = __atomic_fetch_and(p, val, __ATOMIC_SEQ_CST); break;
+	case amo_or:	old = __atomic_fetch_or(p, val, __ATOMIC_SEQ_CST); break;
+#endif
+	default:
+		old = __atomic_load_n(p, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(p, &old, le_word(amo_result(op, le_word(old), val)),
+			true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			;
+		old = le_word(old);
+		break;
+	}
+	note_store(pg, addr, 4);
+	return old;
+}
+
+bool memory::atomic_cas32(uint32_t addr, uint32_t expected, uint32_t desired)
+{
+	if (!in_one_page(addr, 4))
+	{
+		check_illegal(addr);
+		return false;
+	}
+	page* pg = touch_page(addr);
+	uint32_t* p = reinterpret_cast<uint32_t*>(&pg->data[addr & (page_size - 1)]);
+	expected = le_word(expected);
+	if (!__atomic_compare_exchange_n(p, &expected, le_word(desired), false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return false;
+	note_store(pg, addr, 4);
+	return true;
+}
+
+bool memory::write_bytes(uint32_t addr, const void* src, uint32_t len)
 {
-	hex obj; //for printing
+	if (uint64_t(addr) + len > size)
+		return false;
+
+	const uint8_t* from = static_cast<const uint8_t*>(src);
+	uint64_t end = uint64_t(addr) + len;
+	for (uint64_t a = addr; a < end; )
+	{
+		uint32_t off = a & (page_size - 1);
+		uint32_t n = std::min<uint64_t>(page_size - off, end - a);
+		page* pg = touch_page(a);
+		memcpy(&pg->data[off], from, n);
+		note_store(pg, a, n);
+		from += n;
+		a += n;
+	}
+	return true;
+}
+
+bool memory::zero_bytes(uint32_t addr, uint32_t len)
+{
+	if (uint64_t(addr) + len > size)
+		return false;
+
+	uint64_t end = uint64_t(addr) + len;
+	for (uint64_t a = addr; a < end; )
+	{
+		uint32_t off = a & (page_size - 1);
+		uint32_t n = std::min<uint64_t>(page_size - off, end - a);
+		page* pg = touch_page(a);
+		memset(&pg->data[off], 0, n);
+		note_store(pg, a, n);
+		a += n;
+	}
+	return true;
+}
 
-	int counterA = 0;
-	int counterB = 0;
+void memory::dump() const
+{
+	// "aaaaaaaa: " then 16 bytes with an extra space after the 8th, then the chars
+	char line[10 + 16 * 3 + 1 + 18 + 1];
 
-	for (long unsigned int i = 0; i < mem.size() / 16; i++) //do this for number of lines
+	for (uint64_t i = 0; i < size / 16; i++) //do this for number of lines
 	{
-		cout << obj.to_hex32(i * 16) << ": ";
+		uint32_t addr = i * 16;
+		uint8_t bytes[16];
+		const page* pg = find_page(addr);	// a line never straddles two pages
+		if (pg)
+			memcpy(bytes, &pg->data[addr & (page_size - 1)], 16);
+		else
+			memset(bytes, fill, 16);
+
+		char* p = hex::put_hex32(line, addr);
+		*p++ = ':';
+		*p++ = ' ';
 		for (int j = 0; j < 16; j++) //do this for number of row elements
 		{
-			cout << obj.to_hex8(get8(counterA)) << " ";
+			p = hex::put_hex8(p, bytes[j]);
+			*p++ = ' ';
 			if (j == 7)
-			{
-				cout << " ";
-			}
-			counterA++;
+				*p++ = ' ';
 		}
-		cout << "*";
+		*p++ = '*';
 		for (int k = 0; k < 16; k++)
-		{
-			uint8_t ch = get8(counterB);
-			ch = isprint(ch) ? ch : '.';
-			cout << ch;
-			counterB++;
-		}
-		cout << "*" << endl;
+			*p++ = isprint(bytes[k]) ? bytes[k] : '.';
+		*p++ = '*';
+		*p++ = '\n';
+		cout.write(line, p - line);
 	}
 }
 
-bool memory::load_file(const std::string& fname)
+bool memory::load_file(const std::string& fname, uint32_t base)
 {
 	ifstream inFile;
-	inFile.open(fname);
+	inFile.open(fname, std::ios::binary | std::ios::ate);
 
 	if (inFile.fail()) 
 	{
 		std::cerr << "Can’t open file '" << fname << "' for reading." << endl;
 		return false;
 	}	
-	uint8_t i;
-	inFile >> std::noskipws;
-	for (uint32_t addr = 0; inFile >> i; ++addr)
+
+	std::streamoff len = inFile.tellg();
+	if (len < 0 || base > size || uint64_t(len) > size - base)
+	{
+		std::cerr<< "Program too big." << endl;
+		inFile.close();
+		return false;
+	}
+
+	// read straight into each page in turn
+	inFile.seekg(0);
+	uint64_t addr = base;
+	uint64_t end = base + uint64_t(len);
+	while (addr < end)
 	{
-		if (check_illegal(addr)) 
+		uint32_t off = addr & (page_size - 1);
+		uint32_t n = std::min<uint64_t>(page_size - off, end - addr);
+		page* pg = touch_page(addr);
+		if (!inFile.read(reinterpret_cast<char*>(&pg->data[off]), n))
 		{
-			std::cerr<< "Program too big." << endl;
+			std::cerr << "Can’t read file '" << fname << "'." << endl;
 			inFile.close();
 			return false;
 		}
-		set8(addr, i);
+		note_store(pg, addr, n);
+		addr += n;
 	}
 	inFile.close();
 	return true;
@@ -1,16 +1,37 @@
+#ifndef MEMORY_H
+#define MEMORY_H
 #include <cstdint>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
 using std::ifstream;
 
+/**
+ * The simulated memory.  It may be shared by harts running on different host
+ * 	threads: pages are published atomically once allocated, the last-page
+ * 	cache is per thread, and the code-watch bits and code generation are
+ * 	atomic.  Guest loads and stores themselves are not synchronized, as with
+ * 	plain loads and stores on real hardware.
+ **/
 class memory
 {
 public:
-	memory(uint32_t s);
+	/**
+	 * @param s The size of the simulated memory in bytes, up to the full 4 GiB.
+	 * @note Nothing is allocated until a page is first stored to, so the cost of a
+	 * 	large memory is only the pages that the program actually writes.
+	 **/
+	memory(uint64_t s);
 	~memory();
+	memory(const memory&) = delete;
+	memory& operator=(const memory&) = delete;
 	/**
 	* @param addr An address to check the existence of.
  	* @return true The address is illegal.
@@ -19,9 +40,9 @@ public:
 	bool check_illegal(uint32_t addr) const;
 
 	/**
- 	* @return The number of elements in the simulated memory vector.
+ 	* @return The number of bytes in the simulated memory.
  	**/ 
-	uint32_t get_size() const;
+	uint64_t get_size() const;
 
 	/**
 	* @defgroup getX Get little-endian
@@ -32,6 +53,10 @@ public:
  	* @return The little-endian value from the simulated memory starting at address addr.
 	* @note If one or more of the requested bytes are not in the simulated memory address range then
 	* 	a warning message will be printed to std::cout
+	* @note An access that lies wholly inside the simulated memory and one page is range
+	* 	checked once and done as a single host load.  Only accesses that run off the end
+	* 	or straddle two pages go byte by byte.  A page that was never stored to reads
+	* 	as the 0xa5 fill pattern and is not allocated by the read.
 	* 	@{
  	**/ 
 
@@ -71,6 +96,8 @@ public:
 	*
 	* @note If one or more of the target address is not in the range 
 	* 	then a warning message will be printed to std::cout
+	* @note As with getX, in range stores are a single host store.  The first store to a
+	* 	page allocates it.
 	*  	@{
  	**/ 
 	void set8(uint32_t addr, uint8_t val); ///< Store an 8-bit value into the simulated memory
@@ -87,13 +114,354 @@ public:
 	 * @brief Load file contents into memory.
 	 *
 	 * Open and read the binary contents of fname into the simulated memory
-	 * 	starting at address zero.
+	 * 	starting at address base.  The file size is checked before anything
+	 * 	is copied and the contents are then read in one go.
 	 * @param fname the name of a file to open and read.
+	 * @param base The simulated address to load the first byte at.
 	 * @return true If fname was opened and read into the simulated memory.
-	 * @return false If fname could not be opened, or its size is larger than the simulated
-	 * 	memory size.
+	 * @return false If fname could not be opened, or it does not fit between base
+	 * 	and the end of the simulated memory.
+	 **/
+	bool load_file(const std::string& fname, uint32_t base = 0);
+
+	/// The read-modify-write operations of the A extension's AMO insns.
+	enum amo_op
+	{
+		amo_swap, amo_add, amo_xor, amo_and, amo_or,
+		amo_min, amo_max, amo_minu, amo_maxu
+	};
+
+	/**
+	* @defgroup atomicX Atomic 32-bit accesses
+	* Accesses that are atomic with respect to those of harts on other host
+	* 	threads, done with the host's own atomic instructions.
+	*
+	* @param addr The address of the word, which must be a multiple of 4.
+	* @note If the word is not in the simulated memory a warning is printed,
+	* 	nothing is stored and 0 is read.
+	*  	@{
+	**/
+
+	/// @return The little-endian word at addr.
+	uint32_t atomic_load32(uint32_t addr) const;
+
+	/**
+	 * @brief Atomically replace the word at addr with op applied to it and val.
+	 * @return The word at addr before the operation.
+	 **/
+	uint32_t atomic_rmw32(uint32_t addr, amo_op op, uint32_t val);
+
+	/**
+	 * @brief Atomically store desired at addr if the word there is expected.
+	 * @return true If the word was expected and desired was stored.
+	 **/
+	bool atomic_cas32(uint32_t addr, uint32_t expected, uint32_t desired);
+	/**@}*/
+
+	/**
+	 * @brief Copy len bytes from src into the simulated memory starting at addr.
+	 * @return false If [addr, addr+len) is not inside the simulated memory, in
+	 * 	which case nothing is copied.
+	 **/
+	bool write_bytes(uint32_t addr, const void* src, uint32_t len);
+
+	/**
+	 * @brief Set len bytes of the simulated memory starting at addr to zero.
+	 * @return false If [addr, addr+len) is not inside the simulated memory, in
+	 * 	which case nothing is cleared.
+	 **/
+	bool zero_bytes(uint32_t addr, uint32_t len);
+
+	/**
+	 * A copy of the memory contents that restore_snapshot() can return the
+	 * 	memory to.
+	 **/
+	class snapshot
+	{
+		friend class memory;
+		uint64_t owner = { 0 };	///< the id of the memory it was taken of
+		uint64_t serial = { 0 };
+		std::unordered_map<uint32_t, std::unique_ptr<uint8_t[]>> pages;	///< by page number
+	};
+
+	/**
+	 * @brief Copy every page stored to so far into s and start tracking
+	 * 	which pages are stored to from now on.
+	 * @note No hart may be running on the memory.
+	 **/
+	void take_snapshot(snapshot& s);
+
+	/**
+	 * @brief Return the memory to its contents when s was taken.
+	 *
+	 * Only the pages stored to since s was taken or last restored are copied
+	 * 	back, and pages first stored to after it go back to the fill pattern.
+	 * 	Restoring a different snapshot than the last one taken or restored
+	 * 	copies back every page.
+	 * @note No hart may be running on the memory.
+	 * @return false If s was taken of another memory, in which case nothing changes.
+	 **/
+	bool restore_snapshot(const snapshot& s);
+
+	/**
+	 * @brief Find the lowest address at which this memory and other, of
+	 * 	the same size, hold different bytes.  Only the pages stored to in
+	 * 	either are compared, as the rest read as the fill pattern.
+	 * @note No hart may be running on either memory.
+	 * @return false If they hold the same bytes everywhere.
+	 **/
+	bool find_difference(const memory& other, uint32_t& addr) const;
+
+	/// @brief As find_difference() above, but only in the pages numbered in pages.
+	bool find_difference(const memory& other, const std::vector<uint32_t>& pages, uint32_t& addr) const;
+
+	/**
+	 * @brief Add the number of each page stored to since the last snapshot,
+	 * 	restore or call of this to pages, and start over from here.
+	 * @note Restoring any snapshot after this copies back every page, as
+	 * 	restoring a snapshot other than the last one does.
+	 * @note No hart may be running on the memory.
+	 **/
+	void take_stored_pages(std::vector<uint32_t>& pages);
+
+	/**
+	 * @brief Note that a decoded copy of the insn at addr is being cached.
+	 *
+	 * A later store over any byte of the insn advances the code generation so
+	 * 	that the cached copies can be flushed.
+	 * @param addr The address of the first byte of the insn.
+	 **/
+	void watch_code(uint32_t addr);
+
+	/**
+	 * @return A counter that changes every time a watched insn is overwritten.
+	 **/
+	uint32_t get_code_generation() const { return code_generation.load(std::memory_order_relaxed); }
+
+	static constexpr uint32_t page_bits = 12;
+	static constexpr uint32_t page_size = 1u << page_bits;
+	static constexpr uint32_t table_bits = 10;	///< page table entries are 2^table_bits pages
+	static constexpr uint8_t fill = 0xa5;	///< what a never-stored byte reads as
+
+	/**
+	 * One page of the simulated memory along with a bit per 4-byte word that
+	 * 	is set if the word holds watched code, and a flag that is set by the
+	 * 	first store since the last snapshot.
+	 **/
+	struct page
+	{
+		uint8_t data[page_size];
+		std::atomic<uint32_t> code_watch[page_size / 4 / 32];
+		std::atomic<bool> dirty;
+		uint32_t num;	///< addr >> page_bits of the first byte
+	};
+
+	/// The second level of the page table.  Null entries are never-stored pages.
+	struct page_table
+	{
+		std::atomic<page*> pages[1u << table_bits];
+	};
+
+	/**
+	 * @brief Direct access for generated code that does its own range checks.
+	 * @return The first level of the page table, indexed by addr >> (page_bits + table_bits).
+	 * 	Null entries cover pages that were never stored to.
 	 **/
-	bool load_file(const std::string& fname);
+	const std::atomic<page_table*>* get_page_directory() const { return dir.get(); }
 private:
-	std::vector < uint8_t > mem; ///< The simulated memory buffer.
+	/**
+	 * @return The page holding addr, or null if it was never stored to.
+	 * @note addr must be inside the simulated memory.
+	 **/
+	page* find_page(uint32_t addr) const;
+
+	/**
+	 * @return The page holding addr, allocating it if this is the first touch.
+	 * @note addr must be inside the simulated memory.
+	 **/
+	page* touch_page(uint32_t addr);
+
+	/**
+	 * @brief Allocate the page holding addr (and its page table if need be).
+	 * @note If another thread allocated it first, that page is returned instead.
+	 **/
+	page* alloc_page(uint32_t addr);
+
+	/// The page that the current thread last looked up in the memory with id owner.
+	struct page_cache
+	{
+		uint64_t owner;
+		uint32_t num;
+		page* pg;
+	};
+
+	/// @return The calling thread's last-page cache, shared by every memory.
+	static page_cache& last_page()
+	{
+		static thread_local page_cache cache = { 0, 0, nullptr };
+		return cache;
+	}
+
+	/// @return true if [addr, addr+len) is inside the simulated memory and one page.
+	bool in_one_page(uint32_t addr, uint32_t len) const
+	{
+		return uint64_t(addr) + len <= size && (addr & (page_size - 1)) <= page_size - len;
+	}
+
+	/**
+	 * @brief Mark pg dirty and advance the code generation if [addr, addr+len)
+	 * 	overlaps watched code.
+	 * @note [addr, addr+len) must be inside pg.
+	 **/
+	void note_store(page* pg, uint32_t addr, uint32_t len);
+
+	/// @brief Set pg's dirty flag and add it to dirty_pages if it was clear.
+	void mark_dirty(page* pg);
+
+	/// @brief Put pg back as it is in s, or the fill pattern if s does not have it.
+	void restore_page(page* pg, const snapshot& s);
+
+	uint64_t size; ///< The number of bytes in the simulated memory.
+	uint64_t id; ///< Tells this memory's entries in the last-page caches from any other's.
+	std::unique_ptr < std::atomic<page_table*>[] > dir; ///< The first level of the page table.
+	uint64_t ntables; ///< The number of entries in dir.
+	std::mutex alloc_mutex; ///< Held while allocating pages and page tables.
+	std::atomic<uint32_t> code_generation = { 0 }; ///< Advanced when a watched word is stored over.
+	std::vector<page*> all_pages; ///< Every allocated page, guarded by alloc_mutex.
+	std::mutex dirty_mutex; ///< Held while adding to dirty_pages.
+	std::vector<page*> dirty_pages; ///< The pages whose dirty flag is set.
+	uint64_t last_serial = { 0 }; ///< The serial given to the last snapshot taken.
+	uint64_t dirty_serial = { 0 }; ///< The snapshot that the dirty flags are relative to.
 };
+
+// The fast paths are inline because they run for every fetch, load and store.
+
+inline memory::page* memory::find_page(uint32_t addr) const
+{
+	uint32_t num = addr >> page_bits;
+	page_cache& c = last_page();
+	if (c.num == num && c.owner == id)
+		return c.pg;
+
+	page_table* t = dir[num >> table_bits].load(std::memory_order_acquire);
+	page* pg = t ? t->pages[num & ((1u << table_bits) - 1)].load(std::memory_order_acquire) : nullptr;
+	if (pg)
+	{
+		c.owner = id;
+		c.num = num;
+		c.pg = pg;
+	}
+	return pg;
+}
+
+inline memory::page* memory::touch_page(uint32_t addr)
+{
+	page* pg = find_page(addr);
+	return pg ? pg : alloc_page(addr);
+}
+
+inline void memory::note_store(page* pg, uint32_t addr, uint32_t len)
+{
+	if (!pg->dirty.load(std::memory_order_relaxed))
+		mark_dirty(pg);
+
+	uint32_t off = addr & (page_size - 1);
+	for (uint32_t word = off / 4; word <= (off + len - 1) / 4; word++)
+	{
+		uint32_t bit = 1u << (word % 32);
+		if (pg->code_watch[word / 32].load(std::memory_order_relaxed) & bit
+			&& pg->code_watch[word / 32].fetch_and(~bit, std::memory_order_relaxed) & bit)
+			code_generation.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+inline uint8_t memory::get8(uint32_t addr) const
+{
+	if (addr >= size)
+	{
+		check_illegal(addr);
+		return 0;
+	}
+	const page* pg = find_page(addr);
+	return pg ? pg->data[addr & (page_size - 1)] : fill;
+}
+
+inline uint16_t memory::get16(uint32_t addr) const
+{
+	if (!in_one_page(addr, 2))
+		return get8(addr) | get8(addr + 1) << 8;
+
+	const page* pg = find_page(addr);
+	if (!pg)
+		return fill * 0x0101u;
+
+	uint16_t val;
+	memcpy(&val, &pg->data[addr & (page_size - 1)], sizeof(val));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap16(val);
+#endif
+	return val;
+}
+
+inline uint32_t memory::get32(uint32_t addr) const
+{
+	if (!in_one_page(addr, 4))
+		return get16(addr) | uint32_t(get16(addr + 2)) << 16;
+
+	const page* pg = find_page(addr);
+	if (!pg)
+		return fill * 0x01010101u;
+
+	uint32_t val;
+	memcpy(&val, &pg->data[addr & (page_size - 1)], sizeof(val));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap32(val);
+#endif
+	return val;
+}
+
+inline void memory::set8(uint32_t addr, uint8_t val)
+{
+	if (addr >= size)
+	{
+		check_illegal(addr);
+		return;
+	}
+	page* pg = touch_page(addr);
+	pg->data[addr & (page_size - 1)] = val;
+	note_store(pg, addr, 1);
+}
+
+inline void memory::set16(uint32_t addr, uint16_t val)
+{
+	if (!in_one_page(addr, 2))
+	{
+		set8(addr, val & 0x00FF);
+		set8(addr + 1, val >> 8);
+		return;
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap16(val);
+#endif
+	page* pg = touch_page(addr);
+	memcpy(&pg->data[addr & (page_size - 1)], &val, sizeof(val));
+	note_store(pg, addr, 2);
+}
+
+inline void memory::set32(uint32_t addr, uint32_t val)
+{
+	if (!in_one_page(addr, 4))
+	{
+		set16(addr, val & 0xFFFF);
+		set16(addr + 2, val >> 16);
+		return;
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap32(val);
+#endif
+	page* pg = touch_page(addr);
+	memcpy(&pg->data[addr & (page_size - 1)], &val, sizeof(val));
+	note_store(pg, addr, 4);
+}
+
+#endif // MEMORY_H
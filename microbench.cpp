@@ -0,0 +1,211 @@
+//*********************************
+//
+// RISC-V Simulator
+//
+// Host microbenchmarks: times the decoder, the immediate extractors, the
+// memory and register accessors and the hex formatters one at a time on
+// reproducible random inputs, and reports ns and heap allocations per call.
+//
+//*********************************
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <new>
+#include <vector>
+#include <unistd.h>
+#include <stdlib.h>
+#include "rv32i_decode.h"
+#include "memory.h"
+#include "registerfile.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static uint64_t allocations = 0;	///< calls to operator new so far
+static volatile uint64_t sink;	///< where measure() keeps what the calls return
+
+void* operator new(size_t n)
+{
+	allocations++;
+	void* p = malloc(n ? n : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+/// Gives the benchmarks the immediate extractors, which are protected.
+struct decode_access : rv32i_decode
+{
+	using rv32i_decode::get_imm_i;
+	using rv32i_decode::get_imm_u;
+	using rv32i_decode::get_imm_b;
+	using rv32i_decode::get_imm_s;
+	using rv32i_decode::get_imm_j;
+};
+
+static constexpr size_t input_count = 4096;	///< inputs per benchmark, a power of two
+static constexpr uint32_t mem_size = 0x100000;	///< the memory the accessors run on
+
+/// The inputs every benchmark draws from, made from one seed.
+struct inputs
+{
+	std::vector<uint32_t> insns;	///< each with an RV32I major opcode
+	std::vector<uint32_t> words;	///< any value
+	std::vector<uint32_t> addrs;	///< word aligned, inside the memory
+	std::vector<uint32_t> regs;	///< 0 - 31
+};
+
+/**
+ * @brief Make the inputs from seed with xorshift64, so that a run can be
+ * 	repeated exactly.
+ **/
+static inputs make_inputs(uint64_t seed)
+{
+	static const uint32_t opcodes[] =
+	{
+		0b0110111, 0b0010111, 0b1101111, 0b1100111, 0b1100011, 0b0000011,
+		0b0100011, 0b0010011, 0b0110011, 0b1110011, 0b0101111
+	};
+	uint64_t x = seed ? seed : 1;
+	auto next = [&x]()
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		return uint32_t(x >> 32);
+	};
+
+	inputs in;
+	for (size_t i = 0; i < input_count; i++)
+	{
+		uint32_t r = next();
+		in.insns.push_back((r & ~0x7fu) | opcodes[r % (sizeof(opcodes) / sizeof(opcodes[0]))]);
+		in.words.push_back(next());
+		in.addrs.push_back(next() % mem_size & ~3u);
+		in.regs.push_back(next() % 32);
+	}
+	return in;
+}
+
+/**
+ * @brief Call f(i) with i counting up until at least min_secs has passed,
+ * 	and print the ns and allocations per call.
+ *
+ * The calls are made in batches and the clock read only between them.
+ * 	What f returns is summed and kept so that the calls are not optimized
+ * 	away.
+ **/
+template<typename F>
+static void measure(const char* name, double min_secs, F f)
+{
+	uint64_t sum = 0;
+	uint64_t calls = 0;
+	uint64_t batch = 1024;
+	uint64_t allocs_before = allocations;
+	std::chrono::duration<double> secs(0);
+	auto start = std::chrono::steady_clock::now();
+	while (secs.count() < min_secs)
+	{
+		for (uint64_t i = 0; i < batch; i++)
+			sum += f(calls + i);
+		calls += batch;
+		if (batch < (1u << 20))
+			batch *= 2;
+		secs = std::chrono::steady_clock::now() - start;
+	}
+	uint64_t allocs = allocations - allocs_before;
+	sink = sum;
+
+	cout << std::left << std::setw(20) << name << std::right
+		<< std::setw(10) << 1e9 * secs.count() / calls
+		<< std::setw(10) << double(allocs) / calls << endl;
+}
+
+/**
+ * @brief Standard errors printed when the command line is used improperly.
+ **/
+static void usage()
+{
+	cerr << "Usage : microbench [-s seed] [-t secs]\n";
+	cerr << "-s seed for the random inputs ( default = 1 )\n";
+	cerr << "-t the least time to spend on each benchmark, in seconds ( default = 0.2 )\n";
+	exit(1);
+}
+
+/**
+ * @brief usage: microbench [options]
+ **/
+int main(int argc, char **argv)
+{
+	uint64_t seed = 1;
+	double secs = 0.2;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:t:")) != -1)
+	{
+		std::istringstream iss(optarg ? optarg : "");
+		switch (opt)
+		{
+		case 's': iss >> seed; break;
+		case 't': iss >> secs; break;
+		default: usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	const inputs in = make_inputs(seed);
+	const uint32_t* insns = in.insns.data();
+	const uint32_t* words = in.words.data();
+	const uint32_t* addrs = in.addrs.data();
+	const uint32_t* regs = in.regs.data();
+	constexpr size_t mask = input_count - 1;
+
+	// touch every page first so that no benchmark pays to allocate them
+	memory mem(mem_size);
+	for (uint32_t a = 0; a < mem_size; a += 4)
+		mem.set32(a, a);
+	registerfile rf;
+
+	cout << std::fixed << std::setprecision(2);
+	cout << "benchmark                ns/op  allocs/op" << endl;
+
+	measure("decode", secs, [&](uint64_t i) { return rv32i_decode::decode(addrs[i & mask], insns[i & mask]).size(); });
+	measure("get_imm_i", secs, [&](uint64_t i) { return decode_access::get_imm_i(insns[i & mask]); });
+	measure("get_imm_u", secs, [&](uint64_t i) { return decode_access::get_imm_u(insns[i & mask]); });
+	measure("get_imm_b", secs, [&](uint64_t i) { return decode_access::get_imm_b(insns[i & mask]); });
+	measure("get_imm_s", secs, [&](uint64_t i) { return decode_access::get_imm_s(insns[i & mask]); });
+	measure("get_imm_j", secs, [&](uint64_t i) { return decode_access::get_imm_j(insns[i & mask]); });
+
+	measure("memory::get8", secs, [&](uint64_t i) { return mem.get8(addrs[i & mask] | (i & 3)); });
+	measure("memory::get32", secs, [&](uint64_t i) { return mem.get32(addrs[i & mask]); });
+	measure("memory::set32", secs, [&](uint64_t i) { mem.set32(addrs[i & mask], words[i & mask]); return 0; });
+
+	measure("registerfile::get", secs, [&](uint64_t i) { return rf.get(regs[i & mask]); });
+	measure("registerfile::set", secs, [&](uint64_t i) { rf.set(regs[i & mask], words[i & mask]); return 0; });
+
+	measure("hex::to_hex8", secs, [&](uint64_t i) { return hex::to_hex8(words[i & mask]).size(); });
+	measure("hex::to_hex32", secs, [&](uint64_t i) { return hex::to_hex32(words[i & mask]).size(); });
+	measure("hex::to_hex0x32", secs, [&](uint64_t i) { return hex::to_hex0x32(words[i & mask]).size(); });
+	measure("hex::to_hex0x20", secs, [&](uint64_t i) { return hex::to_hex0x20(words[i & mask]).size(); });
+	measure("hex::to_hex0x12", secs, [&](uint64_t i) { return hex::to_hex0x12(words[i & mask]).size(); });
+	measure("hex::put_hex32", secs, [&](uint64_t i)
+	{
+		char buf[8];
+		hex::put_hex32(buf, words[i & mask]);
+		return buf[i & 7];
+	});
+	return 0;
+}
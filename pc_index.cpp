@@ -0,0 +1,14 @@
+#include "pc_index.h"
+
+constexpr uint32_t pc_index::recent_size;
+
+uint32_t pc_index::find_slow(recent_pc& r, uint32_t pc, bool& added)
+{
+	auto it = index.find(pc);
+	added = it == index.end();
+	if (added)
+		it = index.emplace(pc, index.size()).first;
+	r.pc = pc;
+	r.index = it->second;
+	return r.index;
+}
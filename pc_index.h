@@ -0,0 +1,51 @@
+#ifndef PC_INDEX_H
+#define PC_INDEX_H
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Numbers the addresses it is asked about from 0, in the order it first
+ * 	sees them.  Most lookups are for the few addresses of a loop, so a
+ * 	small direct-mapped cache of recent ones sits in front of the map.
+ **/
+class pc_index
+{
+public:
+	/**
+	 * @param added Set to whether pc is new and was given the next number.
+	 * @return The number of pc.
+	 **/
+	uint32_t find(uint32_t pc, bool& added)
+	{
+		recent_pc& r = recent[(pc >> 2) & (recent_size - 1)];
+		if (r.pc == pc)
+		{
+			added = false;
+			return r.index;
+		}
+		return find_slow(r, pc, added);
+	}
+
+	/// @return How many addresses have been numbered.
+	size_t size() const { return index.size(); }
+
+private:
+	/// A recent lookup.
+	struct recent_pc
+	{
+		uint32_t pc = { 1 };	///< never the pc of an insn when empty
+		uint32_t index = { 0 };
+	};
+
+	/// @brief Look pc up in the map, numbering it if new, and keep it in r.
+	uint32_t find_slow(recent_pc& r, uint32_t pc, bool& added);
+
+	std::unordered_map<uint32_t, uint32_t> index;	///< by address
+
+	static constexpr uint32_t recent_size = 256;	///< recent lookups kept, direct-mapped by pc
+	std::vector<recent_pc> recent = std::vector<recent_pc>(recent_size);
+};
+
+#endif // PC_INDEX_H
@@ -0,0 +1,141 @@
+#include "phase_sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+	/// @brief Parse a whole decimal insn count.
+	bool parse_count(const std::string& s, uint64_t& n)
+	{
+		std::istringstream iss(s);
+		char extra;
+		return iss >> n && !(iss >> extra);
+	}
+
+	/// @return The two-sided 95% critical value of Student's t with df degrees of freedom.
+	double t_95(uint64_t df)
+	{
+		static const double table[] = {
+			12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+			2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+			2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+		};
+		return df <= 30 ? table[df - 1] : 1.960;
+	}
+}
+
+bool phase_sampler::parse_config(const std::string& s, config& c)
+{
+	std::vector<std::string> fields;
+	std::istringstream iss(s);
+	std::string field;
+	while (std::getline(iss, field, ':'))
+		fields.push_back(field);
+	if (fields.size() < 2 || fields.size() > 3)
+		return false;
+
+	config r;
+	r.warmup = 0;
+	if (!parse_count(fields[0], r.skip) || !parse_count(fields[1], r.window))
+		return false;
+	if (fields.size() == 3 && !parse_count(fields[2], r.warmup))
+		return false;
+	if (r.window == 0 || r.warmup > r.skip)
+		return false;
+	c = r;
+	return true;
+}
+
+void phase_sampler::add_metric(const std::string& name, double scale)
+{
+	metrics.push_back({ name, scale, 0, 0 });
+}
+
+void phase_sampler::add_window(const std::vector<uint64_t>& events)
+{
+	windows++;
+	for (size_t m = 0; m < metrics.size(); m++)
+	{
+		double v = metrics[m].scale * events[m] / cfg.window;
+		metrics[m].sum += v;
+		metrics[m].sum_squares += v * v;
+	}
+}
+
+void phase_sampler::report(std::ostream& os, uint64_t total_insns) const
+{
+	uint64_t measured = windows * cfg.window;
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2);
+	os << "Sampled phases: skip " << cfg.skip << ", warm-up " << cfg.warmup << ", window " << cfg.window << " insns" << std::endl;
+	os << "  windows     " << std::setw(14) << windows << std::endl;
+	os << "  measured    " << std::setw(14) << measured << std::setw(8)
+		<< (total_insns ? 100.0 * measured / total_insns : 0.0) << "% of the insns" << std::endl;
+	if (windows == 0 || metrics.empty())
+	{
+		os.flags(flags);
+		os.precision(precision);
+		return;
+	}
+
+	os << "  " << std::left << std::setw(22) << "metric" << std::right << std::setw(12) << "estimate" << std::setw(14) << "95% CI"
+		<< std::setw(16) << "whole run" << std::setw(16) << "95% CI" << std::endl;
+	for (const metric& m : metrics)
+	{
+		double mean = m.sum / windows;
+		os << "  " << std::left << std::setw(22) << m.name << std::right << std::setw(12) << std::setprecision(4) << mean;
+		double total = mean / m.scale * total_insns;
+		if (windows > 1)
+		{
+			double variance = std::max(0.0, (m.sum_squares - m.sum * mean) / (windows - 1));
+			double half = t_95(windows - 1) * std::sqrt(variance / windows);
+			os << std::setw(6) << "+/- " << std::setw(8) << half
+				<< std::setw(16) << std::setprecision(0) << total
+				<< std::setw(8) << "+/- " << std::setw(8) << half / m.scale * total_insns;
+		}
+		else
+			os << std::setw(14) << "-" << std::setw(16) << std::setprecision(0) << total << std::setw(16) << "-";
+		os << std::endl;
+	}
+	os.flags(flags);
+	os.precision(precision);
+}
+
+void basic_block_vectors::add(uint32_t pc, uint32_t n)
+{
+	bool added;
+	uint32_t id = ids.find(pc, added);
+	if (added)
+		counts.push_back(0);
+	if (counts[id] == 0)
+		used.push_back(id);
+	counts[id] += n;
+}
+
+void basic_block_vectors::end_interval()
+{
+	std::sort(used.begin(), used.end());
+	std::vector<std::pair<uint32_t, uint64_t>> v;
+	for (uint32_t id : used)
+	{
+		v.push_back({ id, counts[id] });
+		counts[id] = 0;
+	}
+	used.clear();
+	intervals.push_back(std::move(v));
+}
+
+void basic_block_vectors::write(std::ostream& os) const
+{
+	for (const auto& v : intervals)
+	{
+		os << 'T';
+		for (const auto& c : v)
+			os << ':' << c.first + 1 << ':' << c.second << ' ';
+		os << '\n';
+	}
+}
@@ -0,0 +1,109 @@
+#ifndef PHASE_SAMPLER_H
+#define PHASE_SAMPLER_H
+#include "pc_index.h"
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * The plan and the measurements of a run that is fast-forwarded with the
+ * 	detailed models off and only measured in evenly spaced windows, in the
+ * 	way of SMARTS and SimPoint.  Each phase skips some insns, runs a warm-up
+ * 	with the models on but not counted, and then measures a window.
+ *
+ * Each window gives one value of every metric, and the whole run is
+ * 	estimated from the mean of the windows, with a 95% confidence interval
+ * 	from their spread.
+ **/
+class phase_sampler
+{
+public:
+	/// The length of each part of a phase, in insns.
+	struct config
+	{
+		uint64_t skip = { 1000000 };	///< run fast, warm-up included
+		uint64_t window = { 100000 };	///< measured
+		uint64_t warmup = { 0 };	///< at the end of skip, with the models on
+	};
+
+	/**
+	 * @brief Parse phases given as "skip:window[:warm-up]", in insns.
+	 * @return false If s is not in that form, the window is empty or the
+	 * 	warm-up is longer than the skip.
+	 **/
+	static bool parse_config(const std::string& s, config& c);
+
+	explicit phase_sampler(const config& c) : cfg(c) {}
+
+	const config& get_config() const { return cfg; }
+
+	/// @return true Once a metric has been added.
+	bool has_metrics() const { return !metrics.empty(); }
+
+	/**
+	 * @brief Measure each window by an event count, reported as events per
+	 * 	insn times scale.  Every metric is added before the first window.
+	 **/
+	void add_metric(const std::string& name, double scale);
+
+	/// @brief Add a whole window in which events[m] of metric m happened.
+	void add_window(const std::vector<uint64_t>& events);
+
+	uint64_t get_windows() const { return windows; }
+
+	/**
+	 * @brief Print the plan, how much of the run was measured, and the
+	 * 	estimate of each metric with its confidence interval, both per
+	 * 	insn and as a count over all of total_insns.
+	 **/
+	void report(std::ostream& os, uint64_t total_insns) const;
+
+private:
+	struct metric
+	{
+		std::string name;
+		double scale;
+		double sum;	///< of the values
+		double sum_squares;
+	};
+
+	config cfg;
+	std::vector<metric> metrics;
+	uint64_t windows = { 0 };
+};
+
+/**
+ * The basic block vector of each interval of a run: how many insns ran in
+ * 	each basic block, so that representative intervals can be picked by
+ * 	clustering them offline with SimPoint.
+ *
+ * A block is known by the address it starts at and given an id the first
+ * 	time it runs.
+ **/
+class basic_block_vectors
+{
+public:
+	/// @brief Count n insns run in the block that starts at pc.
+	void add(uint32_t pc, uint32_t n);
+
+	/// @brief End the current interval and start the next.
+	void end_interval();
+
+	size_t get_intervals() const { return intervals.size(); }
+
+	/**
+	 * @brief Write one line per interval in SimPoint's frequency vector
+	 * 	format, "T:id:count :id:count ...", with the ids from 1.
+	 **/
+	void write(std::ostream& os) const;
+
+private:
+	pc_index ids;	///< by block address
+	std::vector<uint64_t> counts;	///< by id, in the current interval
+	std::vector<uint32_t> used;	///< the ids counted in the current interval
+	std::vector<std::vector<std::pair<uint32_t, uint64_t>>> intervals;	///< the counts of each, by id
+};
+
+#endif // PHASE_SAMPLER_H
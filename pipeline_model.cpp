@@ -0,0 +1,187 @@
+#include "pipeline_model.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+	/// @brief Parse a whole decimal cycle count.
+	bool parse_cycles(const std::string& s, uint32_t& n)
+	{
+		std::istringstream iss(s);
+		uint64_t v;
+		char extra;
+		if (!(iss >> v) || iss >> extra || v > UINT32_MAX)
+			return false;
+		n = v;
+		return true;
+	}
+}
+
+bool pipeline_model::parse_config(const std::string& s, config& c)
+{
+	config r;
+	if (s != "default")
+	{
+		std::istringstream iss(s);
+		std::string field;
+		int fields = 0;
+		while (std::getline(iss, field, ','))
+		{
+			fields++;
+			size_t eq = field.find('=');
+			if (eq == std::string::npos)
+				return false;
+			std::string key = field.substr(0, eq);
+			std::string value = field.substr(eq + 1);
+			if (key == "ex")
+			{
+				if (!parse_cycles(value, r.ex_cycles) || r.ex_cycles == 0)
+					return false;
+			}
+			else if (key == "mem")
+			{
+				if (!parse_cycles(value, r.mem_cycles) || r.mem_cycles == 0)
+					return false;
+			}
+			else if (key == "branch")
+			{
+				if (!parse_cycles(value, r.branch_penalty))
+					return false;
+			}
+			else if (key == "jal")
+			{
+				if (!parse_cycles(value, r.jal_penalty))
+					return false;
+			}
+			else if (key == "jalr")
+			{
+				if (!parse_cycles(value, r.jalr_penalty))
+					return false;
+			}
+			else if (key == "miss")
+			{
+				if (!parse_cycles(value, r.miss_penalty))
+					return false;
+			}
+			else if (key == "forward" && (value == "on" || value == "off"))
+				r.forwarding = value == "on";
+			else if (key == "predict" && branch_predictor::create(value))
+				r.predictor = value;
+			else
+				return false;
+		}
+		if (fields == 0)
+			return false;
+	}
+	c = r;
+	return true;
+}
+
+pipeline_model::pipeline_model(const config& c)
+	: cfg(c)
+{
+	if (!c.predictor.empty())
+		predictor = branch_predictor::create(c.predictor);
+}
+
+void pipeline_model::set_caches(const cache_model* i, const cache_model* d)
+{
+	l1i = i;
+	l1d = d;
+	l1i_misses = i ? i->get_misses() : 0;
+	l1d_misses = d ? d->get_misses() : 0;
+}
+
+void pipeline_model::resolve(uint32_t pc)
+{
+	transfers++;
+	bool taken = pc != last_pc + 4;
+	uint32_t penalty;
+	branch_predictor::kind kind;
+	switch (last_class)
+	{
+	case class_branch:
+		// fetch goes on down the fall-through path until EX says otherwise
+		penalty = taken ? cfg.branch_penalty : 0;
+		kind = branch_predictor::kind_cond;
+		break;
+	case class_jal:
+		penalty = cfg.jal_penalty;
+		kind = branch_predictor::jal_kind(last_rd);
+		break;
+	default:
+		penalty = cfg.jalr_penalty;
+		kind = branch_predictor::jalr_kind(last_rd, last_rs1);
+		break;
+	}
+
+	if (predictor)
+	{
+		branch_predictor::outcome o = predictor->predict({ last_pc, pc, kind, taken });
+		if (o == branch_predictor::outcome_right)
+			penalty = 0;
+		else if (o == branch_predictor::outcome_wrong && kind == branch_predictor::kind_cond)
+			penalty = cfg.branch_penalty;
+	}
+
+	if (penalty)
+		redirects++;
+	redirect = last_ex + 1 + penalty;
+}
+
+void pipeline_model::freeze(uint64_t n)
+{
+	cache_stalls += n;
+	last_ex += n;
+	ex_free += n;
+	mem_free += n;
+	redirect += n;
+	// a result already usable stays usable, as nothing can issue before last_ex + 1
+	for (uint64_t& r : ready)
+		r += n;
+}
+
+uint64_t pipeline_model::new_misses(const cache_model* c, uint64_t& seen)
+{
+	uint64_t m = c->get_misses() - seen;
+	seen += m;
+	return m;
+}
+
+uint64_t pipeline_model::get_cycles() const
+{
+	if (insns == 0)
+		return 0;
+	// the last insn's data misses are not charged until another insn issues
+	uint64_t pending = l1d ? (l1d->get_misses() - l1d_misses) * cfg.miss_penalty : 0;
+	return mem_free + 1 + pending;
+}
+
+void pipeline_model::report(std::ostream& os) const
+{
+	uint64_t cycles = get_cycles();
+	uint64_t cache = cache_stalls + (insns ? cycles - (mem_free + 1) : 0);
+	auto share = [cycles](uint64_t count) { return cycles ? 100.0 * count / cycles : 0.0; };
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2);
+	os << "Pipeline: 5-stage, " << (cfg.forwarding ? "forwarding" : "no forwarding")
+		<< ", ex " << cfg.ex_cycles << ", mem " << cfg.mem_cycles
+		<< ", branch " << cfg.branch_penalty << ", jal " << cfg.jal_penalty << ", jalr " << cfg.jalr_penalty
+		<< ", miss " << cfg.miss_penalty << ", predict " << (predictor ? predictor->get_name() : "not-taken") << std::endl;
+	os << "  cycles             " << std::setw(14) << cycles << std::endl;
+	os << "  insns              " << std::setw(14) << insns << std::endl;
+	os << "  CPI                " << std::setw(14) << std::setprecision(3) << (insns ? double(cycles) / insns : 0.0)
+		<< std::setprecision(2) << std::endl;
+	os << "  data stalls        " << std::setw(14) << data_stalls << std::setw(8) << share(data_stalls) << "%" << std::endl;
+	os << "    load-use         " << std::setw(14) << load_use_stalls << std::setw(8) << share(load_use_stalls) << "%" << std::endl;
+	os << "  control stalls     " << std::setw(14) << control_stalls << std::setw(8) << share(control_stalls) << "%" << std::endl;
+	os << "  structural stalls  " << std::setw(14) << structural_stalls << std::setw(8) << share(structural_stalls) << "%" << std::endl;
+	os << "  cache stalls       " << std::setw(14) << cache << std::setw(8) << share(cache) << "%" << std::endl;
+	os << "  transfers          " << std::setw(14) << transfers << std::endl;
+	os << "    redirected       " << std::setw(14) << redirects << std::endl;
+	os.flags(flags);
+	os.precision(precision);
+}
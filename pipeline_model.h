@@ -0,0 +1,188 @@
+#ifndef PIPELINE_MODEL_H
+#define PIPELINE_MODEL_H
+#include "branch_predictor.h"
+#include "cache_model.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+/**
+ * A timing model of a classic in-order IF/ID/EX/MEM/WB pipeline, shown each
+ * 	insn as the functional hart fetches it.  It holds no values, only the
+ * 	cycle each stage comes free and each register's result can be used,
+ * 	and counts the cycles the run would have taken and why it stalled.
+ *
+ * Each insn enters EX one cycle after the one before unless it waits on a
+ * 	redirected fetch, an insn still holding EX or MEM, or an operand.  With
+ * 	forwarding an ALU result can be used the cycle after EX and a loaded
+ * 	one the cycle after MEM, and store data is forwarded into MEM.  Without
+ * 	it every operand is read in ID, the cycle after the producer's WB at
+ * 	the earliest.  Control transfers are resolved when the next insn is
+ * 	fetched, so that the model sees where they went.  A cache miss in the
+ * 	L1 models freezes the pipeline for the miss penalty.
+ **/
+class pipeline_model
+{
+public:
+	/// How an insn uses the pipeline.
+	enum insn_class : uint8_t
+	{
+		class_op,	///< reads rs1 and rs2, writes rd in EX
+		class_op_imm,	///< reads rs1, writes rd in EX
+		class_other,	///< reads no register, writes rd in EX
+		class_load,	///< reads rs1, writes rd in MEM
+		class_store,	///< reads rs1, and rs2 in MEM
+		class_atomic,	///< reads rs1 and rs2, writes rd in MEM
+		class_branch,	///< reads rs1 and rs2, resolved in EX
+		class_jal,	///< writes rd, resolved in ID
+		class_jalr	///< reads rs1, writes rd, resolved in EX
+	};
+
+	/// The latencies and penalties, in cycles.
+	struct config
+	{
+		uint32_t ex_cycles = { 1 };	///< each insn spends in EX
+		uint32_t mem_cycles = { 1 };	///< each load, store and atomic spends in MEM
+		uint32_t branch_penalty = { 2 };	///< lost to a mispredicted branch
+		uint32_t jal_penalty = { 1 };	///< lost to a jal that was not predicted
+		uint32_t jalr_penalty = { 2 };	///< lost to a jalr that was not predicted
+		uint32_t miss_penalty = { 10 };	///< the pipeline freezes on an L1 miss
+		bool forwarding = { true };
+		std::string predictor;	///< a branch_predictor spec, or empty to predict branches not taken
+	};
+
+	/**
+	 * @brief Parse a pipeline given as "default" or as comma-separated
+	 * 	key=value pairs: ex, mem, branch, jal, jalr and miss in cycles,
+	 * 	forward=on|off and predict=spec for branch_predictor::create().
+	 * @return false If s is not in that form.
+	 **/
+	static bool parse_config(const std::string& s, config& c);
+
+	explicit pipeline_model(const config& c);
+
+	/// @brief Charge the misses of i and d, either of which may be null.
+	void set_caches(const cache_model* i, const cache_model* d);
+
+	/**
+	 * @brief Time the insn at pc.  Registers that k says the insn does
+	 * 	not use are ignored, so the raw fields can be given.
+	 **/
+	void issue(uint32_t pc, insn_class k, uint32_t rd, uint32_t rs1, uint32_t rs2)
+	{
+		// the last insn's data misses froze everything behind it
+		if (l1d)
+		{
+			uint64_t m = new_misses(l1d, l1d_misses);
+			if (m)
+				freeze(m * cfg.miss_penalty);
+		}
+
+		// when the insn could enter EX, held up by the front end, then by the
+		// 	insns ahead of it, then by its operands
+		uint64_t in_order = last_ex + 1;
+		uint64_t fetched = in_order;
+		if (last_class >= class_branch)	// the transfers come last
+		{
+			resolve(pc);
+			fetched = std::max(fetched, redirect);
+			control_stalls += fetched - in_order;
+		}
+		if (l1i)
+		{
+			uint64_t m = new_misses(l1i, l1i_misses) * cfg.miss_penalty;
+			cache_stalls += m;
+			fetched += m;
+		}
+		uint64_t issued = std::max(fetched, ex_free);
+		structural_stalls += issued - fetched;
+
+		bool reads_rs1 = k != class_other && k != class_jal;
+		bool reads_rs2 = k == class_op || k == class_atomic || k == class_branch || k == class_store;
+		uint64_t need1 = reads_rs1 ? ready[rs1] : 0;
+		uint64_t need2 = reads_rs2 ? ready[rs2] : 0;
+		// store data is only needed as the store leaves EX for MEM
+		if (k == class_store && cfg.forwarding)
+			need2 = need2 > cfg.ex_cycles ? need2 - cfg.ex_cycles : 0;
+		bool from_load = need2 > need1 ? loaded[rs2] : reads_rs1 && loaded[rs1];
+		uint64_t ex = std::max(issued, std::max(need1, need2));
+		data_stalls += ex - issued;
+		if (from_load)
+			load_use_stalls += ex - issued;
+
+		bool memory = k == class_load || k == class_store || k == class_atomic;
+		bool writes_in_mem = k == class_load || k == class_atomic;
+		uint64_t ex_done = ex + cfg.ex_cycles;
+		// an insn holds EX until MEM is free to take it
+		uint64_t mem = std::max(ex_done, mem_free);
+		ex_free = mem;
+		mem_free = mem + (memory ? cfg.mem_cycles : 1);
+
+		if (k != class_branch && k != class_store)
+		{
+			if (!cfg.forwarding)
+				ready[rd] = mem_free + 1;
+			else
+				ready[rd] = writes_in_mem ? mem_free : ex_done;
+			loaded[rd] = writes_in_mem;
+			ready[0] = 0;
+			loaded[0] = false;
+		}
+
+		last_ex = ex;
+		last_pc = pc;
+		last_class = k;
+		last_rd = rd;
+		last_rs1 = rs1;
+		insns++;
+	}
+
+	/// @return The cycles up to the WB of the last insn issued.
+	uint64_t get_cycles() const;
+	uint64_t get_insns() const { return insns; }
+
+	/// @brief Print the configuration, the cycles, the CPI and the stalls by cause.
+	void report(std::ostream& os) const;
+
+private:
+	/// @brief Work out what the control transfer issued last cost, now that pc follows it.
+	void resolve(uint32_t pc);
+
+	/// @brief Delay everything not yet done by n cycles.
+	void freeze(uint64_t n);
+
+	/// @return The misses of c not yet charged, and note them as charged.
+	uint64_t new_misses(const cache_model* c, uint64_t& seen);
+
+	config cfg;
+	std::unique_ptr<branch_predictor> predictor;
+	const cache_model* l1i = { nullptr };
+	const cache_model* l1d = { nullptr };
+	uint64_t l1i_misses = { 0 };	///< l1i misses charged
+	uint64_t l1d_misses = { 0 };
+
+	uint64_t ready[32] = {};	///< by register: the cycle its result can be used from
+	bool loaded[32] = {};	///< by register: written by a load or atomic
+	uint64_t last_ex = { 1 };	///< the cycle the last insn entered EX
+	uint64_t ex_free = { 0 };	///< the first cycle EX can take another insn
+	uint64_t mem_free = { 0 };	///< the first cycle MEM can, and the WB of the last insn
+	uint64_t redirect = { 0 };	///< the earliest EX after a transfer, when last was one
+
+	uint32_t last_pc = { 0 };
+	insn_class last_class = { class_other };
+	uint32_t last_rd = { 0 };
+	uint32_t last_rs1 = { 0 };
+
+	uint64_t insns = { 0 };
+	uint64_t data_stalls = { 0 };
+	uint64_t load_use_stalls = { 0 };	///< the data stalls waiting on a load
+	uint64_t control_stalls = { 0 };
+	uint64_t structural_stalls = { 0 };
+	uint64_t cache_stalls = { 0 };
+	uint64_t transfers = { 0 };	///< branches and jumps resolved
+	uint64_t redirects = { 0 };	///< the ones that cost a penalty
+};
+
+#endif // PIPELINE_MODEL_H
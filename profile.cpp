@@ -0,0 +1,113 @@
+#include "profile.h"
+#include "hex.h"
+#include <algorithm>
+
+constexpr uint64_t profile::flat_max_size;
+
+profile::profile(uint64_t mem_size, const std::vector<std::string>& handler_names)
+	: names(handler_names), ops(handler_names.size()), table(64)
+{
+	if (mem_size <= flat_max_size)
+		flat.resize((mem_size + 3) / 4);
+}
+
+void profile::count_hashed(uint32_t pc)
+{
+	uint32_t key = (pc >> 2) + 1;
+	size_t mask = table.size() - 1;
+	for (size_t i = (key * 0x9e3779b1u) & mask; ; i = (i + 1) & mask)
+	{
+		if (table[i].key == key)
+		{
+			table[i].count++;
+			return;
+		}
+		if (table[i].key == 0)
+		{
+			table[i].key = key;
+			table[i].count = 1;
+			if (++used * 2 > table.size())
+				grow();
+			return;
+		}
+	}
+}
+
+void profile::grow()
+{
+	std::vector<slot> old(table.size() * 2);
+	old.swap(table);
+	size_t mask = table.size() - 1;
+	for (const slot& s : old)
+	{
+		if (s.key == 0)
+			continue;
+		size_t i = (s.key * 0x9e3779b1u) & mask;
+		while (table[i].key != 0)
+			i = (i + 1) & mask;
+		table[i] = s;
+	}
+}
+
+uint64_t profile::get_total() const
+{
+	uint64_t total = 0;
+	for (uint64_t n : ops)
+		total += n;
+	return total;
+}
+
+std::vector<profile::pc_count> profile::get_pc_counts() const
+{
+	std::vector<pc_count> counts;
+	for (size_t i = 0; i < flat.size(); i++)
+		if (flat[i])
+			counts.push_back({ uint32_t(i << 2), flat[i] });
+	for (const slot& s : table)
+		if (s.key)
+			counts.push_back({ (s.key - 1) << 2, s.count });
+	std::sort(counts.begin(), counts.end(), [](const pc_count& a, const pc_count& b) { return a.pc < b.pc; });
+	return counts;
+}
+
+void profile::report(std::ostream& os, size_t n) const
+{
+	uint64_t total = get_total();
+	if (total == 0)
+		return;
+	auto share = [total](uint64_t count) { return 100.0 * count / total; };
+
+	std::vector<size_t> by_op;
+	for (size_t i = 0; i < ops.size(); i++)
+		if (ops[i])
+			by_op.push_back(i);
+	std::stable_sort(by_op.begin(), by_op.end(), [this](size_t a, size_t b) { return ops[a] > ops[b]; });
+	by_op.resize(std::min(n, by_op.size()));
+
+	std::vector<pc_count> by_pc = get_pc_counts();
+	std::stable_sort(by_pc.begin(), by_pc.end(), [](const pc_count& a, const pc_count& b) { return a.count > b.count; });
+	by_pc.resize(std::min(n, by_pc.size()));
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2);
+	os << "Top " << by_op.size() << " handlers:" << std::endl;
+	for (size_t i : by_op)
+		os << "  " << std::left << std::setw(16) << names[i] << std::right << std::setw(14) << ops[i]
+			<< std::setw(8) << share(ops[i]) << "%" << std::endl;
+	os << "Top " << by_pc.size() << " pcs:" << std::endl;
+	for (const pc_count& c : by_pc)
+		os << "  " << std::left << std::setw(16) << hex::to_hex0x32(c.pc) << std::right << std::setw(14) << c.count
+			<< std::setw(8) << share(c.count) << "%" << std::endl;
+	os.flags(flags);
+	os.precision(precision);
+}
+
+void profile::dump(std::ostream& os) const
+{
+	for (size_t i = 0; i < ops.size(); i++)
+		if (ops[i])
+			os << "op " << names[i] << " " << ops[i] << "\n";
+	for (const pc_count& c : get_pc_counts())
+		os << "pc " << hex::to_hex32(c.pc) << " " << c.count << "\n";
+}
@@ -0,0 +1,84 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Execution counts gathered while a hart runs: one per exec_* handler and
+ * 	one per insn address.
+ *
+ * The addresses of a memory up to flat_max_size bytes are counted in a flat
+ * 	array indexed by pc / 4, so counting is an increment.  Larger memories,
+ * 	and any pc outside the memory, are counted in an open-addressed hash
+ * 	table that only holds the addresses actually run.
+ **/
+class profile
+{
+public:
+	/**
+	 * @param mem_size The size of the memory the hart runs on.
+	 * @param handler_names The name of each handler, by the index given to count().
+	 **/
+	profile(uint64_t mem_size, const std::vector<std::string>& handler_names);
+
+	/// @brief Count one run of the insn at pc, executed by handler op.
+	void count(uint32_t pc, unsigned op)
+	{
+		ops[op]++;
+		if ((pc >> 2) < flat.size())
+			flat[pc >> 2]++;
+		else
+			count_hashed(pc);
+	}
+
+	/// @return The insns counted.
+	uint64_t get_total() const;
+
+	/// The count for one insn address.
+	struct pc_count
+	{
+		uint32_t pc;
+		uint64_t count;
+	};
+
+	/// @return The addresses that ran at least once, in address order.
+	std::vector<pc_count> get_pc_counts() const;
+
+	/**
+	 * @brief Print the handlers and addresses that ran most, n of each,
+	 * 	with their share of the insns counted.
+	 **/
+	void report(std::ostream& os, size_t n) const;
+
+	/**
+	 * @brief Write every nonzero count for a script to read, one per line:
+	 * 	"op <handler> <count>" and then "pc <hex-address> <count>" in
+	 * 	address order.
+	 **/
+	void dump(std::ostream& os) const;
+
+	static constexpr uint64_t flat_max_size = 1 << 20;	///< largest memory counted flat
+
+private:
+	/// @brief Count pc in the hash table.
+	void count_hashed(uint32_t pc);
+
+	/// @brief Double the hash table.
+	void grow();
+
+	struct slot
+	{
+		uint32_t key;	///< pc / 4 + 1, or 0 when the slot is empty
+		uint64_t count;
+	};
+
+	std::vector<std::string> names;
+	std::vector<uint64_t> ops;
+	std::vector<uint64_t> flat;
+	std::vector<slot> table;	///< a power of two in size, at most half full
+	size_t used = { 0 };
+};
+
+#endif // PROFILE_H
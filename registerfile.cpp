@@ -19,41 +19,32 @@ void registerfile::reset()
 	}
 }
 
-void registerfile::set(uint32_t r, int32_t val) 
-{
-	if (r == 0)
-		return;
-	else
-		regs[r] = val;
-}
-
-int32_t registerfile::get(uint32_t r) const 
-{
-	return regs.at(r);
-}
-
-void registerfile::dump(const std::string &hdr) const 
+void registerfile::dump(const std::string &hdr, std::ostream& os) const 
 {
 	int counter = 0; //current register position
 
-	//IMPLEMENT THE HEADER VAR SOMEHOW
-
 	for (uint i = 0; i < 4; i++) //do this for each line
 	{	
 		if (hdr[0])
-			cout << hdr << " ";
-		std::string regstring = "x" + std::to_string(i * 8);
-		cout << std:: right << std::setw(3) << regstring << " ";
+			os << hdr << " ";
+
+		// " x0 " or "x16 ", then 8 registers with an extra space after the 4th
+		char line[4 + 8 * 9 + 2];
+		char* p = line;
+		uint r = i * 8;
+		*p++ = r < 10 ? ' ' : 'x';
+		*p++ = r < 10 ? 'x' : '0' + r / 10;
+		*p++ = '0' + r % 10;
+		*p++ = ' ';
 		for (uint j = 0; j < 8; j++) 
 		{
-			cout << hex::to_hex32(regs.at(counter)) << " ";
+			p = hex::put_hex32(p, regs[counter]);
+			*p++ = ' ';
 			if (j == 3) 
-			{
-				cout << " "; //extra whitespace
-			}
+				*p++ = ' '; //extra whitespace
 			counter++;
 		}
-		cout << endl;
+		*p++ = '\n';
+		os.write(line, p - line);
 	}
 }
-
@@ -1,3 +1,5 @@
+#ifndef REGISTERFILE_H
+#define REGISTERFILE_H
 #include "hex.h"
 #include "rv32i_decode.h"
 #include <vector>
@@ -7,10 +9,15 @@ class registerfile : public hex
 public:
 	registerfile();
 	void reset();
-	void set(uint32_t r, int32_t val);
-	int32_t get(uint32_t r) const;
-	void dump(const std::string &hdr) const;
+	/// @note set and get are inline because they run several times per insn
+	void set(uint32_t r, int32_t val) { if (r != 0) regs[r] = val; }
+	int32_t get(uint32_t r) const { return regs[r]; }
+
+	/// @return The registers as an array that generated code can index directly.
+	int32_t* data() { return regs.data(); }
+	void dump(const std::string &hdr, std::ostream& os = std::cout) const;
 private:
 	std::vector<int32_t> regs;
 };
 
+#endif // REGISTERFILE_H
@@ -104,6 +104,27 @@ std::string rv32i_decode::decode(uint32_t addr, uint32_t insn)
 				case 1: 		return render_ebreak(insn);
 				}		
 		}
+	case opcode_amo:
+		if (get_funct3(insn) != funct3_amo_w)
+			return render_illegal_insn(insn);
+		switch (get_funct5(insn))
+		{
+		default:			return render_illegal_insn(insn);
+		case funct5_lr:
+			if (get_rs2(insn) != 0)
+				return render_illegal_insn(insn);
+			return render_lr(insn);
+		case funct5_sc:			return render_amo(insn, "sc.w");
+		case funct5_amoswap:	return render_amo(insn, "amoswap.w");
+		case funct5_amoadd:		return render_amo(insn, "amoadd.w");
+		case funct5_amoxor:		return render_amo(insn, "amoxor.w");
+		case funct5_amoand:		return render_amo(insn, "amoand.w");
+		case funct5_amoor:		return render_amo(insn, "amoor.w");
+		case funct5_amomin:		return render_amo(insn, "amomin.w");
+		case funct5_amomax:		return render_amo(insn, "amomax.w");
+		case funct5_amominu:	return render_amo(insn, "amominu.w");
+		case funct5_amomaxu:	return render_amo(insn, "amomaxu.w");
+		}
 	}//end of opcode switch
 	assert(0 && "unrecognized opcode"); // It should be impossible to ever get here
 }
@@ -138,6 +159,11 @@ uint32_t rv32i_decode::get_funct7(uint32_t insn)
 	return (insn & 0xfe000000) >> 25;
 }
 
+uint32_t rv32i_decode::get_funct5(uint32_t insn)
+{
+	return (insn & 0xf8000000) >> 27;
+}
+
 int32_t rv32i_decode::get_imm_i(uint32_t insn)
 {
 
@@ -180,11 +206,12 @@ int32_t rv32i_decode::get_imm_j(uint32_t insn)
 {
 	int32_t mt_range = insn & 0x000ff000;
 
-	int32_t bk_range = insn >> 20;
+	int32_t bk_range = (insn & 0x7fe00000) >> 20;
 
-	int32_t l_bit = (insn & 0x001000000) >> 9;
+	int32_t l_bit = (insn & 0x00100000) >> 9;
 
-	int32_t a_bits = (insn & 0x80000000) >> 11;
+	int32_t a_bits = (insn & 0x80000000);
+	a_bits >>= 31 - 20;
 
 	return a_bits | mt_range | l_bit | bk_range;
 }
@@ -199,30 +226,24 @@ std::string rv32i_decode::render_lui(uint32_t insn)
 {
 	uint32_t rd = get_rd(insn);
 	int32_t imm_u = get_imm_u(insn);
-	std::ostringstream os;
-	os << render_mnemonic("lui") << render_reg(rd) << ","
-		<< hex::to_hex0x20((imm_u >> 12) & 0x0fffff);
-	return os.str();
+	return render_mnemonic("lui") + render_reg(rd) + ","
+		+ hex::to_hex0x20((imm_u >> 12) & 0x0fffff);
 }
 
 std::string rv32i_decode::render_auipc(uint32_t insn)
 {
 	uint32_t rd = get_rd(insn);
 	int32_t imm_u = get_imm_u(insn);
-	std::ostringstream os;
-	os << render_mnemonic("auipc") << render_reg(rd) << ","
-		<< hex::to_hex0x20((imm_u >> 12) & 0x0fffff);
-	return os.str();
+	return render_mnemonic("auipc") + render_reg(rd) + ","
+		+ hex::to_hex0x20((imm_u >> 12) & 0x0fffff);
 }
 
 std::string rv32i_decode::render_jal(uint32_t addr, uint32_t insn)
 {
 	uint32_t rd = get_rd(insn);
 	int32_t imm_j = get_imm_j(insn);
-	std::ostringstream os;
-	os << render_mnemonic("jal") << render_reg(rd) << ","
-		<< hex::to_hex0x32(imm_j + addr);
-	return os.str();
+	return render_mnemonic("jal") + render_reg(rd) + ","
+		+ hex::to_hex0x32(imm_j + addr);
 }
 
 std::string rv32i_decode::render_jalr(uint32_t insn)
@@ -230,10 +251,8 @@ std::string rv32i_decode::render_jalr(uint32_t insn)
 	uint32_t rd = get_rd(insn);
 	int32_t rs1 = get_rs1(insn);
 	int32_t imm_i = get_imm_i(insn);
-	std::ostringstream os;
-	os << render_mnemonic("jalr") << render_reg(rd) << ","
-		<< imm_i << "(" << render_reg(rs1) << ")";
-	return os.str();
+	return render_mnemonic("jalr") + render_reg(rd) + ","
+		+ std::to_string(imm_i) + "(" + render_reg(rs1) + ")";
 }
 
 std::string rv32i_decode::render_btype(uint32_t addr, uint32_t insn, const char* mnemonic)
@@ -241,10 +260,8 @@ std::string rv32i_decode::render_btype(uint32_t addr, uint32_t insn, const char*
 	uint32_t rs1 = get_rs1(insn);
 	uint32_t rs2 = get_rs2(insn);
 	int32_t imm_b = get_imm_b(insn); 
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rs1) << ","
-		<< render_reg(rs2) << "," << hex::to_hex0x32(imm_b + addr);
-	return os.str();
+	return render_mnemonic(mnemonic) + render_reg(rs1) + ","
+		+ render_reg(rs2) + "," + hex::to_hex0x32(imm_b + addr);
 }
 
 std::string rv32i_decode::render_itype_load(uint32_t insn, const char* mnemonic)
@@ -252,10 +269,8 @@ std::string rv32i_decode::render_itype_load(uint32_t insn, const char* mnemonic)
 	uint32_t rd = get_rd(insn);
 	int32_t rs1 = get_rs1(insn);
 	int32_t imm_i = get_imm_i(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << ","
-		<< imm_i << "(" << render_reg(rs1) << ")";
-	return os.str();
+	return render_mnemonic(mnemonic) + render_reg(rd) + ","
+		+ std::to_string(imm_i) + "(" + render_reg(rs1) + ")";
 }
 
 std::string rv32i_decode::render_stype(uint32_t insn, const char* mnemonic)
@@ -263,10 +278,8 @@ std::string rv32i_decode::render_stype(uint32_t insn, const char* mnemonic)
 	uint32_t rs2 = get_rs2(insn);
 	uint32_t rs1 = get_rs1(insn);
 	int32_t imm_s = get_imm_s(insn);
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rs2) << ","
-		<< imm_s << "(" << render_reg(rs1) << ")";
-	return os.str();
+	return render_mnemonic(mnemonic) + render_reg(rs2) + ","
+		+ std::to_string(imm_s) + "(" + render_reg(rs1) + ")";
 }
 
 std::string rv32i_decode::render_itype_alu(uint32_t insn, const char* mnemonic, int32_t imm_i)
@@ -280,11 +293,8 @@ std::string rv32i_decode::render_itype_alu(uint32_t insn, const char* mnemonic,
 
 		imm_i = (imm_i & 0x0000001f);
 	}
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << ","
-		<< render_reg(rs1) << "," << imm_i;
-
-	return os.str();
+	return render_mnemonic(mnemonic) + render_reg(rd) + ","
+		+ render_reg(rs1) + "," + std::to_string(imm_i);
 }
 
 std::string rv32i_decode::render_rtype(uint32_t insn, const char* mnemonic)
@@ -294,11 +304,8 @@ std::string rv32i_decode::render_rtype(uint32_t insn, const char* mnemonic)
 	uint32_t rs2 = get_rs2(insn);
 
 
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << ","
-		<< render_reg(rs1) << "," << render_reg(rs2);
-
-	return os.str();
+	return render_mnemonic(mnemonic) + render_reg(rd) + ","
+		+ render_reg(rs1) + "," + render_reg(rs2);
 }
 
 std::string rv32i_decode::render_ecall(uint32_t insn)
@@ -319,11 +326,8 @@ std::string rv32i_decode::render_csrrx(uint32_t insn, const char* mnemonic)
 	uint32_t rs1 = get_rs1(insn);
 	int32_t csr = get_imm_i(insn);
 
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << ","
-		<< hex::to_hex0x12(csr) << "," << render_reg(rs1);
-
-	return os.str();
+	return render_mnemonic(mnemonic) + render_reg(rd) + ","
+		+ hex::to_hex0x12(csr) + "," + render_reg(rs1);
 }
 
 std::string rv32i_decode::render_csrrxi(uint32_t insn, const char* mnemonic)
@@ -332,23 +336,64 @@ std::string rv32i_decode::render_csrrxi(uint32_t insn, const char* mnemonic)
 	uint32_t zimm = get_rs1(insn);
 	int32_t csr = get_imm_i(insn);
 
-	std::ostringstream os;
-	os << render_mnemonic(mnemonic) << render_reg(rd) << ","
-		<< std::setw(5) << hex::to_hex0x12(csr) << "," << zimm;
+	return render_mnemonic(mnemonic) + render_reg(rd) + ","
+		+ hex::to_hex0x12(csr) + "," + std::to_string(zimm);
+
+}
+
+namespace
+{
+	/**
+	 * @return mnemonic with the .aq and .rl suffixes that insn asks for and a
+	 * 	space, since most of these are too long for the mnemonic column
+	 **/
+	std::string amo_mnemonic(uint32_t insn, const char* mnemonic)
+	{
+		std::string m = mnemonic;
+		if (insn & 0x04000000)
+			m += ".aq";
+		if (insn & 0x02000000)
+			m += ".rl";
+		return m + " ";
+	}
+}
+
+std::string rv32i_decode::render_amo(uint32_t insn, const char* mnemonic)
+{
+	uint32_t rd = get_rd(insn);
+	uint32_t rs1 = get_rs1(insn);
+	uint32_t rs2 = get_rs2(insn);
+
+	return render_mnemonic(amo_mnemonic(insn, mnemonic)) + render_reg(rd) + ","
+		+ render_reg(rs2) + ",(" + render_reg(rs1) + ")";
+}
 
-	return os.str();
+std::string rv32i_decode::render_lr(uint32_t insn)
+{
+	uint32_t rd = get_rd(insn);
+	uint32_t rs1 = get_rs1(insn);
 
+	return render_mnemonic(amo_mnemonic(insn, "lr.w")) + render_reg(rd) + ",("
+		+ render_reg(rs1) + ")";
 }
 
 //last 3 helpers
 std::string rv32i_decode::render_reg(int r)
 {
-	return "x" + std::to_string(r);
+	static const char* const names[32] =
+	{
+		"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7",
+		"x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+		"x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+		"x24", "x25", "x26", "x27", "x28", "x29", "x30", "x31"
+	};
+	return names[r & 31];
 }
 
 std::string rv32i_decode::render_mnemonic(const std::string& m)
 {
-	std::ostringstream os;
-	os << std::left << std::setw(mnemonic_width) << m;
-	return os.str();
+	std::string s = m;
+	if (s.size() < size_t(mnemonic_width))
+		s.resize(mnemonic_width, ' ');
+	return s;
 }
@@ -1,3 +1,5 @@
+#ifndef RV32I_DECODE_H
+#define RV32I_DECODE_H
 #include <cstdint>
 #include <cstring>
 #include <string>
@@ -37,6 +39,7 @@ protected:
 	static constexpr uint32_t opcode_alu_imm = 0b0010011; 	///< i type 
 	static constexpr uint32_t opcode_rtype = 0b0110011; 	///< r type
 	static constexpr uint32_t opcode_system = 0b1110011; 	///< system instructions
+	static constexpr uint32_t opcode_amo = 0b0101111; 	///< A extension atomics
 	/**@}*/
 
 	/**
@@ -83,6 +86,26 @@ protected:
 	/**@}*/
 
 
+	/**
+	* @defgroup funct5 Funct5
+	* Identifiers for the A extension instructions' funct5 values, all of which
+	* 	use funct3_amo_w for the 32-bit forms
+	* @{ **/
+	static constexpr uint32_t funct3_amo_w = 0b010;
+
+	static constexpr uint32_t funct5_lr = 0b00010;
+	static constexpr uint32_t funct5_sc = 0b00011;
+	static constexpr uint32_t funct5_amoswap = 0b00001;
+	static constexpr uint32_t funct5_amoadd = 0b00000;
+	static constexpr uint32_t funct5_amoxor = 0b00100;
+	static constexpr uint32_t funct5_amoand = 0b01100;
+	static constexpr uint32_t funct5_amoor = 0b01000;
+	static constexpr uint32_t funct5_amomin = 0b10000;
+	static constexpr uint32_t funct5_amomax = 0b10100;
+	static constexpr uint32_t funct5_amominu = 0b11000;
+	static constexpr uint32_t funct5_amomaxu = 0b11100;
+	/**@}*/
+
 	/**
 	* @defgroup system System
 	* Identifiers for the different system instructions
@@ -110,6 +133,7 @@ protected:
 	static uint32_t get_rs1(uint32_t insn);
 	static uint32_t get_rs2(uint32_t insn);
 	static uint32_t get_funct7(uint32_t insn);
+	static uint32_t get_funct5(uint32_t insn);
 	static int32_t get_imm_i(uint32_t insn);
 	static int32_t get_imm_u(uint32_t insn);
 	static int32_t get_imm_b(uint32_t insn);
@@ -158,6 +182,12 @@ protected:
 	///@param mnemonic The name of the instruction
 	static std::string render_csrrxi(uint32_t insn, const char* mnemonic);
 
+	///@param mnemonic The name of the instruction, without its .aq/.rl suffix
+	static std::string render_amo(uint32_t insn, const char* mnemonic);
+
+	/// lr.w has no rs2 so it is rendered apart from the other atomics
+	static std::string render_lr(uint32_t insn);
+
 	///@param r A register to be formatted with a leading 'x'
 	static std::string render_reg(int r);
 
@@ -165,3 +195,5 @@ protected:
 	static std::string render_mnemonic(const std::string& m);
 	/**@}*/
 };
+
+#endif // RV32I_DECODE_H
@@ -1,114 +1,511 @@
 #include "rv32i_hart.h"
+#include "stack_sampler.h"
 #include <bitset>
 
 
-void rv32i_hart::exec (uint32_t insn, std::ostream* pos) 
+void rv32i_hart::predecode (uint32_t insn, decoded_insn& d)
 {
+	d.insn = insn;
+	d.rd = get_rd(insn);
+	d.rs1 = get_rs1(insn);
+	d.rs2 = get_rs2(insn);
+	d.imm = 0;
+	d.op = op_exec_illegal_insn;
+
 	uint32_t opcode = get_opcode(insn);
 	switch ( opcode )
 	{
-	default : 		exec_illegal_insn ( insn , pos ) ; return ;
-	case opcode_lui : 	exec_lui ( insn , pos ) ; return ;
-	case opcode_auipc : 	exec_auipc ( insn , pos ); return ;
-	case opcode_jal:	exec_jal ( insn , pos ); return ;
-	case opcode_jalr:	exec_jalr ( insn , pos ); return ;
+	default : 		return ;
+	case opcode_lui : 	d.imm = get_imm_u(insn); d.op = op_exec_lui; return ;
+	case opcode_auipc : 	d.imm = get_imm_u(insn); d.op = op_exec_auipc; return ;
+	case opcode_jal:	d.imm = get_imm_j(insn); d.op = op_exec_jal; return ;
+	case opcode_jalr:	d.imm = get_imm_i(insn); d.op = op_exec_jalr; return ;
 	case opcode_btype: 	
+		d.imm = get_imm_b(insn);
 		switch (get_funct3(insn))
 		{
-			default:		exec_illegal_insn ( insn , pos ) ; return ;
-			case funct3_beq:	exec_beq ( insn , pos ); return ;
-			case funct3_bne:	exec_bne ( insn , pos ); return ;
-			case funct3_blt:	exec_blt(insn,pos);return;
-			case funct3_bge:	exec_bge(insn,pos);return;
-			case funct3_bltu:	exec_bltu(insn,pos);return;
-			case funct3_bgeu:	exec_bgeu(insn,pos);return;
+			default:		return ;
+			case funct3_beq:	d.op = op_exec_beq; return ;
+			case funct3_bne:	d.op = op_exec_bne; return ;
+			case funct3_blt:	d.op = op_exec_blt; return ;
+			case funct3_bge:	d.op = op_exec_bge; return ;
+			case funct3_bltu:	d.op = op_exec_bltu; return ;
+			case funct3_bgeu:	d.op = op_exec_bgeu; return ;
 		}
 	case opcode_load_imm:
+		d.imm = get_imm_i(insn);
 		switch (get_funct3(insn))
 		{
-			default:		exec_illegal_insn ( insn , pos ) ; return ;
-			case funct3_lb:		exec_lb(insn,pos);return;
-			case funct3_lh:		exec_lh(insn,pos);return;
-			case funct3_lw:		exec_lw(insn,pos);return;
-			case funct3_lbu:	exec_lbu(insn,pos);return;
-			case funct3_lhu:	exec_lhu(insn,pos);return;
+			default:		return ;
+			case funct3_lb:		d.op = op_exec_lb; return ;
+			case funct3_lh:		d.op = op_exec_lh; return ;
+			case funct3_lw:		d.op = op_exec_lw; return ;
+			case funct3_lbu:	d.op = op_exec_lbu; return ;
+			case funct3_lhu:	d.op = op_exec_lhu; return ;
 		}	
 	case opcode_stype:
+		d.imm = get_imm_s(insn);
 		switch (get_funct3(insn))
 		{
-		default:		exec_illegal_insn ( insn , pos ) ; return ;
-		case funct3_sb:		exec_sb(insn,pos);return;
-		case funct3_sh:		exec_sh(insn,pos);return;
-		case funct3_sw:		exec_sw(insn,pos);return;
+		default:		return ;
+		case funct3_sb:		d.op = op_exec_sb; return ;
+		case funct3_sh:		d.op = op_exec_sh; return ;
+		case funct3_sw:		d.op = op_exec_sw; return ;
 		}
 
 	case opcode_alu_imm:
+		d.imm = get_imm_i(insn);
 		switch (get_funct3(insn))
 		{//the labels for these may not be right ?? where is srai
 
-		default:		exec_illegal_insn ( insn , pos ) ; return ;
-		case funct3_add:	exec_addi(insn,pos);return;
-		case funct3_sll:	exec_slli(insn,pos);return;
-		case funct3_slt:	exec_slti(insn,pos);return;
-		case funct3_sltu:	exec_sltiu(insn,pos);return;
-		case funct3_xor:	exec_xor(insn,pos);return;
+		default:		return ;
+		case funct3_add:	d.op = op_exec_addi; return ;
+		case funct3_sll:	d.op = op_exec_slli; return ;
+		case funct3_slt:	d.op = op_exec_slti; return ;
+		case funct3_sltu:	d.op = op_exec_sltiu; return ;
+		case funct3_xor:	d.op = op_exec_xor; return ;
 		case funct3_srx:	
 			switch (get_funct7(insn))
 			{
-			default:		exec_illegal_insn ( insn , pos ) ; return ;
-			case funct7_srl:	exec_srli(insn,pos);return;
-			case funct7_sra:	exec_srai(insn,pos);return;
+			default:		return ;
+			case funct7_srl:	d.op = op_exec_srli; return ;
+			case funct7_sra:	d.op = op_exec_srai; return ;
 			}
-		case funct3_or:		exec_or(insn,pos);return;
-		case funct3_and:	exec_andi(insn,pos);return;
+		case funct3_or:		d.op = op_exec_or; return ;
+		case funct3_and:	d.op = op_exec_andi; return ;
 		}
 	case opcode_rtype:
 		switch (get_funct3(insn))
 		{
-		default:			exec_illegal_insn ( insn , pos ) ; return ;
+		default:			return ;
 		case funct3_add: 
 			switch (get_funct7(insn))
 			{
-			default:			exec_illegal_insn ( insn , pos ) ; return ;
-			case funct7_add:		exec_add(insn,pos);return;
-			case funct7_sub:		exec_sub(insn,pos);return;
+			default:			return ;
+			case funct7_add:		d.op = op_exec_add; return ;
+			case funct7_sub:		d.op = op_exec_sub; return ;
 			}//end of funct7 add/sub switch
-		case funct3_sll:		exec_sll(insn,pos);return;
-		case funct3_slt:		exec_slt(insn,pos);return;
-		case funct3_sltu:		exec_sltu(insn,pos);return;
-		case funct3_xor:		exec_xorr(insn,pos);return;
+		case funct3_sll:		d.op = op_exec_sll; return ;
+		case funct3_slt:		d.op = op_exec_slt; return ;
+		case funct3_sltu:		d.op = op_exec_sltu; return ;
+		case funct3_xor:		d.op = op_exec_xorr; return ;
 		case funct3_srx:
 			switch (get_funct7(insn))
 			{
-			default:		exec_illegal_insn ( insn , pos ) ; return; 
-			case funct7_srl:	exec_srl(insn,pos);return;
-			case funct7_sra:	exec_sra(insn,pos);return;
+			default:		return; 
+			case funct7_srl:	d.op = op_exec_srl; return ;
+			case funct7_sra:	d.op = op_exec_sra; return ;
 			}
-		case funct3_or:			exec_orr(insn,pos);return;
-		case funct3_and:		exec_and(insn,pos);return;
+		case funct3_or:			d.op = op_exec_orr; return ;
+		case funct3_and:		d.op = op_exec_and; return ;
 		}//end of rtype switch
 	case opcode_system:
 		//switch for cssx
+		d.imm = get_imm_i(insn);
 		switch (get_funct3(insn))
 		{
-		default:			exec_illegal_insn ( insn , pos ) ; return;
-		case funct3_csrrs:		exec_csrrs(insn,pos);return;
+		default:			return;
+		case funct3_csrrs:		d.op = op_exec_csrrs; return ;
 		case 0: 			
 				switch(get_imm_i(insn)) {
-				default:		exec_illegal_insn ( insn , pos ) ; return;				
-				case 1: 		exec_ebreak(insn,pos);return;
+				default:		return;				
+				case 1: 		d.op = op_exec_ebreak; return ;
 				}		
 		}
+	case opcode_amo:
+		if (get_funct3(insn) != funct3_amo_w)
+			return ;
+		switch (get_funct5(insn))
+		{
+		default:			return ;
+		case funct5_lr:
+			if (d.rs2 == 0)
+				d.op = op_exec_lr_w;
+			return ;
+		case funct5_sc:			d.op = op_exec_sc_w; return ;
+		case funct5_amoswap:	d.op = op_exec_amoswap_w; return ;
+		case funct5_amoadd:		d.op = op_exec_amoadd_w; return ;
+		case funct5_amoxor:		d.op = op_exec_amoxor_w; return ;
+		case funct5_amoand:		d.op = op_exec_amoand_w; return ;
+		case funct5_amoor:		d.op = op_exec_amoor_w; return ;
+		case funct5_amomin:		d.op = op_exec_amomin_w; return ;
+		case funct5_amomax:		d.op = op_exec_amomax_w; return ;
+		case funct5_amominu:	d.op = op_exec_amominu_w; return ;
+		case funct5_amomaxu:	d.op = op_exec_amomaxu_w; return ;
+		}
 	}//opcode switch
 }
 
-void rv32i_hart::dump (const std::string& hdr) const
+namespace
+{
+	/// @return Bits hi down to lo of insn, moved down to bit 0.
+	uint32_t bits(uint32_t insn, int hi, int lo)
+	{
+		return (insn >> lo) & ((2u << (hi - lo)) - 1);
+	}
+
+	/// @return v, an n-bit two's complement number, sign-extended to 32 bits.
+	int32_t sign_extend(uint32_t v, int n)
+	{
+		uint32_t sign = 1u << (n - 1);
+		return int32_t((v ^ sign) - sign);
+	}
+}
+
+void rv32i_hart::reference_decode (uint32_t insn, decoded_insn& d)
+{
+	d.insn = insn;
+	d.rd = bits(insn, 11, 7);
+	d.rs1 = bits(insn, 19, 15);
+	d.rs2 = bits(insn, 24, 20);
+	d.op = op_exec_illegal_insn;
+
+	int32_t imm_i = sign_extend(bits(insn, 31, 20), 12);
+	int32_t imm_s = sign_extend(bits(insn, 31, 25) << 5 | bits(insn, 11, 7), 12);
+	int32_t imm_b = sign_extend(bits(insn, 31, 31) << 12 | bits(insn, 7, 7) << 11
+		| bits(insn, 30, 25) << 5 | bits(insn, 11, 8) << 1, 13);
+	int32_t imm_u = bits(insn, 31, 12) << 12;
+	int32_t imm_j = sign_extend(bits(insn, 31, 31) << 20 | bits(insn, 19, 12) << 12
+		| bits(insn, 20, 20) << 11 | bits(insn, 30, 21) << 1, 21);
+	uint32_t funct3 = bits(insn, 14, 12);
+	uint32_t funct7 = bits(insn, 31, 25);
+	d.imm = 0;
+
+	switch (bits(insn, 6, 0))
+	{
+	default:		return ;
+	case opcode_lui:	d.imm = imm_u; d.op = op_exec_lui; return ;
+	case opcode_auipc:	d.imm = imm_u; d.op = op_exec_auipc; return ;
+	case opcode_jal:	d.imm = imm_j; d.op = op_exec_jal; return ;
+	case opcode_jalr:	d.imm = imm_i; d.op = op_exec_jalr; return ;
+	case opcode_btype:
+		d.imm = imm_b;
+		switch (funct3)
+		{
+		default:		return ;
+		case funct3_beq:	d.op = op_exec_beq; return ;
+		case funct3_bne:	d.op = op_exec_bne; return ;
+		case funct3_blt:	d.op = op_exec_blt; return ;
+		case funct3_bge:	d.op = op_exec_bge; return ;
+		case funct3_bltu:	d.op = op_exec_bltu; return ;
+		case funct3_bgeu:	d.op = op_exec_bgeu; return ;
+		}
+	case opcode_load_imm:
+		d.imm = imm_i;
+		switch (funct3)
+		{
+		default:		return ;
+		case funct3_lb:		d.op = op_exec_lb; return ;
+		case funct3_lh:		d.op = op_exec_lh; return ;
+		case funct3_lw:		d.op = op_exec_lw; return ;
+		case funct3_lbu:	d.op = op_exec_lbu; return ;
+		case funct3_lhu:	d.op = op_exec_lhu; return ;
+		}
+	case opcode_stype:
+		d.imm = imm_s;
+		switch (funct3)
+		{
+		default:		return ;
+		case funct3_sb:		d.op = op_exec_sb; return ;
+		case funct3_sh:		d.op = op_exec_sh; return ;
+		case funct3_sw:		d.op = op_exec_sw; return ;
+		}
+	case opcode_alu_imm:
+		d.imm = imm_i;
+		switch (funct3)
+		{
+		default:		return ;
+		case funct3_add:	d.op = op_exec_addi; return ;
+		case funct3_sll:	d.op = op_exec_slli; return ;
+		case funct3_slt:	d.op = op_exec_slti; return ;
+		case funct3_sltu:	d.op = op_exec_sltiu; return ;
+		case funct3_xor:	d.op = op_exec_xor; return ;
+		case funct3_srx:
+			switch (funct7)
+			{
+			default:		return ;
+			case funct7_srl:	d.op = op_exec_srli; return ;
+			case funct7_sra:	d.op = op_exec_srai; return ;
+			}
+		case funct3_or:		d.op = op_exec_or; return ;
+		case funct3_and:	d.op = op_exec_andi; return ;
+		}
+	case opcode_rtype:
+		switch (funct3)
+		{
+		default:		return ;
+		case funct3_add:
+			switch (funct7)
+			{
+			default:		return ;
+			case funct7_add:	d.op = op_exec_add; return ;
+			case funct7_sub:	d.op = op_exec_sub; return ;
+			}
+		case funct3_sll:	d.op = op_exec_sll; return ;
+		case funct3_slt:	d.op = op_exec_slt; return ;
+		case funct3_sltu:	d.op = op_exec_sltu; return ;
+		case funct3_xor:	d.op = op_exec_xorr; return ;
+		case funct3_srx:
+			switch (funct7)
+			{
+			default:		return ;
+			case funct7_srl:	d.op = op_exec_srl; return ;
+			case funct7_sra:	d.op = op_exec_sra; return ;
+			}
+		case funct3_or:		d.op = op_exec_orr; return ;
+		case funct3_and:	d.op = op_exec_and; return ;
+		}
+	case opcode_system:
+		d.imm = imm_i;
+		if (funct3 == funct3_csrrs)
+			d.op = op_exec_csrrs;
+		else if (funct3 == 0 && imm_i == 1)
+			d.op = op_exec_ebreak;
+		return ;
+	case opcode_amo:
+		if (funct3 != funct3_amo_w)
+			return ;
+		switch (bits(insn, 31, 27))
+		{
+		default:		return ;
+		case funct5_lr:
+			if (d.rs2 == 0)
+				d.op = op_exec_lr_w;
+			return ;
+		case funct5_sc:		d.op = op_exec_sc_w; return ;
+		case funct5_amoswap:	d.op = op_exec_amoswap_w; return ;
+		case funct5_amoadd:	d.op = op_exec_amoadd_w; return ;
+		case funct5_amoxor:	d.op = op_exec_amoxor_w; return ;
+		case funct5_amoand:	d.op = op_exec_amoand_w; return ;
+		case funct5_amoor:	d.op = op_exec_amoor_w; return ;
+		case funct5_amomin:	d.op = op_exec_amomin_w; return ;
+		case funct5_amomax:	d.op = op_exec_amomax_w; return ;
+		case funct5_amominu:	d.op = op_exec_amominu_w; return ;
+		case funct5_amomaxu:	d.op = op_exec_amomaxu_w; return ;
+		}
+	}
+}
+
+void rv32i_hart::run_reference (uint64_t exec_limit)
+{
+	while (!halt && (exec_limit == 0 || insn_counter < exec_limit))
+	{
+		insn_counter++;
+		decoded_insn d;
+		reference_decode(mem.get32(pc), d);
+		d.tag = pc;
+		(this->*untraced_handlers[d.op])(d, nullptr);
+	}
+}
+
+const rv32i_hart::decoded_insn& rv32i_hart::fetch (uint32_t addr)
+{
+	if (icache_generation != mem.get_code_generation())
+		flush_icache();
+
+	decoded_insn& d = icache[(addr >> 2) & (icache.size() - 1)];
+	if (d.tag != addr)
+	{
+		predecode(mem.get32(addr), d);
+		d.tag = addr;
+		mem.watch_code(addr);
+	}
+	return d;
+}
+
+void rv32i_hart::flush_icache ()
+{
+	if (icache.empty())
+	{
+		// one slot per word of simulated memory, capped at icache_max_size
+		size_t siz = 1;
+		while (siz < icache_max_size && siz < mem.get_size() / 4)
+			siz <<= 1;
+		icache.resize(siz);
+	}
+	for (decoded_insn& d : icache)
+		d.tag = icache_no_tag;
+	blocks.clear();
+	icache_generation = mem.get_code_generation();
+}
+
+bool rv32i_hart::ends_block (uint8_t op)
+{
+	switch (op)
+	{
+	case op_exec_jal:
+	case op_exec_jalr:
+	case op_exec_beq:
+	case op_exec_bne:
+	case op_exec_blt:
+	case op_exec_bge:
+	case op_exec_bltu:
+	case op_exec_bgeu:
+	case op_exec_illegal_insn:
+	case op_exec_csrrs:
+	case op_exec_ebreak:
+	// the atomics can halt on a misaligned address
+	case op_exec_lr_w:
+	case op_exec_sc_w:
+	case op_exec_amoswap_w:
+	case op_exec_amoadd_w:
+	case op_exec_amoxor_w:
+	case op_exec_amoand_w:
+	case op_exec_amoor_w:
+	case op_exec_amomin_w:
+	case op_exec_amomax_w:
+	case op_exec_amominu_w:
+	case op_exec_amomaxu_w:
+		return true;
+	default:
+		return false;
+	}
+}
+
+pipeline_model::insn_class rv32i_hart::timing_class (uint8_t op)
+{
+	switch (op)
+	{
+	case op_exec_add:
+	case op_exec_sub:
+	case op_exec_sll:
+	case op_exec_slt:
+	case op_exec_sltu:
+	case op_exec_xorr:
+	case op_exec_srl:
+	case op_exec_sra:
+	case op_exec_and:
+	case op_exec_orr:
+		return pipeline_model::class_op;
+	case op_exec_addi:
+	case op_exec_slti:
+	case op_exec_sltiu:
+	case op_exec_xor:
+	case op_exec_or:
+	case op_exec_andi:
+	case op_exec_slli:
+	case op_exec_srli:
+	case op_exec_srai:
+	case op_exec_csrrs:
+		return pipeline_model::class_op_imm;
+	case op_exec_lb:
+	case op_exec_lh:
+	case op_exec_lw:
+	case op_exec_lbu:
+	case op_exec_lhu:
+	case op_exec_lr_w:
+		return pipeline_model::class_load;
+	case op_exec_sb:
+	case op_exec_sh:
+	case op_exec_sw:
+		return pipeline_model::class_store;
+	case op_exec_sc_w:
+	case op_exec_amoswap_w:
+	case op_exec_amoadd_w:
+	case op_exec_amoxor_w:
+	case op_exec_amoand_w:
+	case op_exec_amoor_w:
+	case op_exec_amomin_w:
+	case op_exec_amomax_w:
+	case op_exec_amominu_w:
+	case op_exec_amomaxu_w:
+		return pipeline_model::class_atomic;
+	case op_exec_beq:
+	case op_exec_bne:
+	case op_exec_blt:
+	case op_exec_bge:
+	case op_exec_bltu:
+	case op_exec_bgeu:
+		return pipeline_model::class_branch;
+	case op_exec_jal:
+		return pipeline_model::class_jal;
+	case op_exec_jalr:
+		return pipeline_model::class_jalr;
+	default:
+		// lui, auipc, ebreak and illegal insns
+		return pipeline_model::class_other;
+	}
+}
+
+rv32i_hart::block* rv32i_hart::get_block (uint32_t addr)
+{
+	std::unique_ptr<block>& b = blocks[addr];
+	if (b)
+		return b.get();
+
+	b.reset(new block);
+	uint32_t a = addr;
+	do
+	{
+		// stop short of the end of memory so the out of range fetch is
+		// 	only reported if the hart really gets there
+		if (!b->insns.empty() && uint64_t(a) + 4 > mem.get_size())
+			break;
+
+		decoded_insn d;
+		predecode(mem.get32(a), d);
+		d.tag = a;
+		mem.watch_code(a);
+		b->insns.push_back(d);
+		a += 4;
+	} while (!ends_block(b->insns.back().op) && b->insns.size() < block_max_size);
+
+	const decoded_insn& last = b->insns.back();
+	b->link_pc[0] = a;
+	b->link_pc[1] = icache_no_tag;
+	switch (last.op)
+	{
+	case op_exec_jal:
+		b->link_pc[0] = last.tag + last.imm;
+		break;
+	case op_exec_jalr:
+		b->link_pc[0] = icache_no_tag;
+		break;
+	case op_exec_beq:
+	case op_exec_bne:
+	case op_exec_blt:
+	case op_exec_bge:
+	case op_exec_bltu:
+	case op_exec_bgeu:
+		b->link_pc[1] = last.tag + last.imm;
+		break;
+	}
+	b->link[0] = nullptr;
+	b->link[1] = nullptr;
+
+	decoded_insn end = {};
+	end.op = op_count;
+	b->insns.push_back(end);
+	return b.get();
+}
+
+rv32i_hart::block* rv32i_hart::link_block (block* b, uint32_t addr)
+{
+	block* next = get_block(addr);
+	if (b->link_pc[0] == addr || b->link_pc[0] == icache_no_tag)
+	{
+		b->link_pc[0] = addr;
+		b->link[0] = next;
+	}
+	else
+	{
+		// a jalr to somewhere new replaces whatever it went to last
+		b->link_pc[1] = addr;
+		b->link[1] = next;
+	}
+	return next;
+}
+
+void rv32i_hart::dump (const std::string& hdr, std::ostream& os) const
 {
-	regs.dump(hdr);
+	regs.dump(hdr, os);
 
 	if (hdr[0])
-		cout << hdr << " ";
-	cout << " pc " << hex::to_hex32(pc) << "\n";
+		os << hdr << " ";
+	char buf[16] = " pc ";
+	char* p = hex::put_hex32(buf + 4, pc);
+	*p++ = '\n';
+	os.write(buf, p - buf);
 }
 
 void rv32i_hart::reset () 
@@ -116,10 +513,35 @@ void rv32i_hart::reset ()
 	pc = 0;
 	regs.reset();
 	insn_counter = 0;
+	reserved = false;
 	halt = false;
 	halt_reason = "none";
 }
 
+void rv32i_hart::save_state (state& s) const
+{
+	s.regs = regs;
+	s.pc = pc;
+	s.halt = halt;
+	s.halt_reason = halt_reason;
+	s.insn_counter = insn_counter;
+	s.reserved = reserved;
+	s.reservation_addr = reservation_addr;
+	s.reservation_value = reservation_value;
+}
+
+void rv32i_hart::restore_state (const state& s)
+{
+	regs = s.regs;
+	pc = s.pc;
+	halt = s.halt;
+	halt_reason = s.halt_reason;
+	insn_counter = s.insn_counter;
+	reserved = s.reserved;
+	reservation_addr = s.reservation_addr;
+	reservation_value = s.reservation_value;
+}
+
 void rv32i_hart::tick(const std::string& hdr) 
 {
 	if (is_halted())
@@ -127,28 +549,341 @@ void rv32i_hart::tick(const std::string& hdr)
 
 	insn_counter++;
 
+	std::ostream& os = *trace_out;
 	if (show_registers) 
-		rv32i_hart::dump(hdr);
+		rv32i_hart::dump(hdr, os);
 
-	uint32_t insn = mem.get32(pc);
+	const decoded_insn& d = fetch(pc);
+	observe(d);
+	trace_record rec;
+	if (btrace)
+		trace_before(d, rec);
 
 	if (show_instructions) {
 		//print the header, pc, fetched insn
-		cout << hex::to_hex32(pc) << ": " << hex::to_hex32(insn) << "  ";
-
-		exec(insn, &std::cout);
-		cout << endl;
+		if (hdr[0])
+			os << hdr << " ";
+		char buf[20];
+		char* p = hex::put_hex32(buf, pc);
+		*p++ = ':';
+		*p++ = ' ';
+		p = hex::put_hex32(p, d.insn);
+		*p++ = ' ';
+		*p++ = ' ';
+		os.write(buf, p - buf);
+
+		(this->*traced_handlers[d.op])(d, &os);
+		os << '\n';
 	}
 	else {
-		exec(insn, nullptr);
+		(this->*untraced_handlers[d.op])(d, nullptr);
 	}	
+
+	if (btrace)
+		trace_after(rec);
+}
+
+namespace
+{
+	/// @brief Read len bytes at addr, with any outside mem reading as 0 and no warning.
+	uint32_t peek(const memory& mem, uint32_t addr, int len)
+	{
+		if (uint64_t(addr) + len <= mem.get_size())
+			return len == 1 ? mem.get8(addr) : len == 2 ? mem.get16(addr) : mem.get32(addr);
+		uint32_t val = 0;
+		for (int i = 0; i < len; i++)
+			if (uint64_t(addr) + i < mem.get_size())
+				val |= uint32_t(mem.get8(addr + i)) << (8 * i);
+		return val;
+	}
+}
+
+void rv32i_hart::trace_before (const decoded_insn& d, trace_record& r)
+{
+	if (!btrace->is_started(mhartid))
+		btrace->start(mhartid, regs);
+
+	r.hart = mhartid;
+	r.pc = pc;
+	r.insn = d.insn;
+	r.rd_value = regs.get(d.rd);
+	r.mem = true;
+	r.mem_addr = regs.get(d.rs1) + d.imm;
+
+	switch (d.op)
+	{
+	case op_exec_lb:
+	case op_exec_lbu:
+		r.mem_value = peek(mem, r.mem_addr, 1);
+		break;
+	case op_exec_lh:
+	case op_exec_lhu:
+		r.mem_value = peek(mem, r.mem_addr, 2);
+		break;
+	case op_exec_lw:
+		r.mem_value = peek(mem, r.mem_addr, 4);
+		break;
+	case op_exec_sb:
+		r.mem_value = regs.get(d.rs2) & 0xff;
+		break;
+	case op_exec_sh:
+		r.mem_value = regs.get(d.rs2) & 0xffff;
+		break;
+	case op_exec_sw:
+		r.mem_value = regs.get(d.rs2);
+		break;
+	case op_exec_lr_w:
+	case op_exec_amoswap_w:
+	case op_exec_amoadd_w:
+	case op_exec_amoxor_w:
+	case op_exec_amoand_w:
+	case op_exec_amoor_w:
+	case op_exec_amomin_w:
+	case op_exec_amomax_w:
+	case op_exec_amominu_w:
+	case op_exec_amomaxu_w:
+		r.mem_addr = regs.get(d.rs1);
+		r.mem_value = peek(mem, r.mem_addr, 4);
+		break;
+	case op_exec_sc_w:
+		// only a store that happens is recorded
+		r.mem_addr = regs.get(d.rs1);
+		r.mem_value = regs.get(d.rs2);
+		r.mem = reserved && reservation_addr == r.mem_addr && peek(mem, r.mem_addr, 4) == reservation_value;
+		break;
+	default:
+		r.mem = false;
+		break;
+	}
+}
+
+void rv32i_hart::trace_after (trace_record& r)
+{
+	// a misaligned atomic halts without touching memory
+	if (halt)
+		r.mem = false;
+	int32_t rd = regs.get(get_rd(r.insn));
+	r.rd_written = rd != r.rd_value;
+	r.rd_value = rd;
+	btrace->write(r);
+}
+
+#define RV32I_HART_TRACED(h, can_halt) &rv32i_hart::h<true>,
+#define RV32I_HART_UNTRACED(h, can_halt) &rv32i_hart::h<false>,
+const rv32i_hart::handler rv32i_hart::traced_handlers[op_count] = { RV32I_HART_OPS(RV32I_HART_TRACED) };
+const rv32i_hart::handler rv32i_hart::untraced_handlers[op_count] = { RV32I_HART_OPS(RV32I_HART_UNTRACED) };
+#undef RV32I_HART_TRACED
+#undef RV32I_HART_UNTRACED
+
+std::vector<std::string> rv32i_hart::get_handler_names()
+{
+#define RV32I_HART_NAME(h, can_halt) #h,
+	return { RV32I_HART_OPS(RV32I_HART_NAME) };
+#undef RV32I_HART_NAME
 }
 
-void rv32i_hart :: exec_ebreak ( uint32_t insn , std :: ostream * pos )
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"	// computed goto is a GNU extension
+#endif
+
+void rv32i_hart::run_fast(uint64_t exec_limit)
+{
+	if (prof || l1i || timing || vectors)
+		run_threaded<true>(exec_limit);
+	else
+		run_threaded<false>(exec_limit);
+}
+
+template <bool observing>
+void rv32i_hart::run_threaded(uint64_t exec_limit)
+{
+	if (is_halted() || (exec_limit && insn_counter >= exec_limit))
+		return;
+
+	// the count is kept local so it can live in a register across stores to mem
+	uint64_t budget = exec_limit ? exec_limit - insn_counter : UINT64_MAX;
+	uint64_t n = 0;
+	const decoded_insn* d;
+
+#if defined(__GNUC__)
+	// every handler ends in its own copy of the dispatch so that the host
+	// branch predictor sees one indirect jump per guest insn type
+#define RV32I_HART_LABEL(h, can_halt) &&do_##h,
+	static void* const labels[op_count] = { RV32I_HART_OPS(RV32I_HART_LABEL) };
+#undef RV32I_HART_LABEL
+
+#define RV32I_HART_DISPATCH() \
+	do { \
+		if (n == budget) \
+			goto done; \
+		++n; \
+		d = &fetch(pc); \
+		if (observing) \
+			observe(*d); \
+		goto *labels[d->op]; \
+	} while (0)
+
+	RV32I_HART_DISPATCH();
+
+#define RV32I_HART_BODY(h, can_halt) \
+	do_##h: \
+		h<false>(*d, nullptr); \
+		if (can_halt && halt) \
+			goto done; \
+		RV32I_HART_DISPATCH();
+	RV32I_HART_OPS(RV32I_HART_BODY)
+#undef RV32I_HART_BODY
+#undef RV32I_HART_DISPATCH
+
+#else
+	while (n != budget)
+	{
+		++n;
+		d = &fetch(pc);
+		if (observing)
+			observe(*d);
+		switch (d->op)
+		{
+#define RV32I_HART_CASE(h, can_halt) \
+		case op_##h: \
+			h<false>(*d, nullptr); \
+			if (can_halt && halt) \
+				goto done; \
+			break;
+		RV32I_HART_OPS(RV32I_HART_CASE)
+#undef RV32I_HART_CASE
+		default:
+			break;
+		}
+	}
+#endif
+
+done:
+	insn_counter += n;
+}
+
+void rv32i_hart::run_blocks(uint64_t exec_limit)
 {
-	if (pos)
+	if (is_halted() || (exec_limit && insn_counter >= exec_limit))
+		return;
+
+	uint64_t budget = exec_limit ? exec_limit - insn_counter : UINT64_MAX;
+	uint64_t n = 0;
+
+	if (icache_generation != mem.get_code_generation())
+		flush_icache();
+	block* b = get_block(pc);
+	const decoded_insn* ip;
+
+	// a block partly counted by another engine is counted as far as it got
+	if (vectors && bb_insns)
+	{
+		vectors->add(bb_start, bb_insns);
+		bb_insns = 0;
+	}
+
+#if defined(__GNUC__)
+#define RV32I_HART_LABEL(h, can_halt) &&do_##h,
+	void* labels[op_count + 1] = { RV32I_HART_OPS(RV32I_HART_LABEL) &&block_end };
+#undef RV32I_HART_LABEL
+	// a store may overwrite an insn later in the same block
+	labels[op_exec_sb] = &&do_store_sb;
+	labels[op_exec_sh] = &&do_store_sh;
+	labels[op_exec_sw] = &&do_store_sw;
+#endif
+
+next_block:
+	if (budget - n < b->insns.size() - 1)
+		goto tail;
+	// count the whole block now and give back what a store cuts short
+	n += b->insns.size() - 1;
+	ip = b->insns.data();
+	if (vectors)
+		vectors->add(ip->tag, b->insns.size() - 1);
+
+#if defined(__GNUC__)
+	goto *labels[ip->op];
+
+#define RV32I_HART_BODY(h, can_halt) \
+	do_##h: \
+		h<false>(*ip, nullptr); \
+		if (can_halt && halt) \
+			goto done; \
+		++ip; \
+		goto *labels[ip->op];
+	RV32I_HART_OPS(RV32I_HART_BODY)
+#undef RV32I_HART_BODY
+
+do_store_sb:
+	exec_sb<false>(*ip, nullptr);
+	goto store_done;
+do_store_sh:
+	exec_sh<false>(*ip, nullptr);
+	goto store_done;
+do_store_sw:
+	exec_sw<false>(*ip, nullptr);
+store_done:
+	if (icache_generation != mem.get_code_generation())
+	{
+		n -= b->insns.size() - 2 - (ip - b->insns.data());
+		goto block_end;
+	}
+	++ip;
+	goto *labels[ip->op];
+#else
+	for (; ip->op != op_count; ++ip)
 	{
-		std::string s = render_ebreak ( insn );
+		(this->*untraced_handlers[ip->op])(*ip, nullptr);
+		if (halt)
+			goto done;
+		if (icache_generation != mem.get_code_generation())
+		{
+			n -= b->insns.size() - 2 - (ip - b->insns.data());
+			goto block_end;
+		}
+	}
+#endif
+
+block_end:
+	if (icache_generation != mem.get_code_generation())
+	{
+		flush_icache();
+		b = get_block(pc);
+	}
+	else if (pc == b->link_pc[0] && b->link[0])
+		b = b->link[0];
+	else if (pc == b->link_pc[1] && b->link[1])
+		b = b->link[1];
+	else
+		b = link_block(b, pc);
+	goto next_block;
+
+tail:
+	// not enough budget left for the whole block
+	while (n != budget && !halt)
+	{
+		++n;
+		const decoded_insn& d = fetch(pc);
+		if (vectors)
+			note_block_insn(d);
+		(this->*untraced_handlers[d.op])(d, nullptr);
+	}
+
+done:
+	insn_counter += n;
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+template <bool trace>
+void rv32i_hart :: exec_ebreak (const decoded_insn& d, std::ostream* pos)
+{
+	if (trace)
+	{
+		std::string s = render_ebreak ( d.insn );
 		*pos << std :: setw ( instruction_width ) << std :: setfill (' ') << std :: left << s;
 		*pos << "// HALT ";
 	}
@@ -157,25 +892,26 @@ void rv32i_hart :: exec_ebreak ( uint32_t insn , std :: ostream * pos )
 }
 
 
-void rv32i_hart::exec_illegal_insn(uint32_t insn , std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_illegal_insn(const decoded_insn& d, std::ostream* pos)
 {
-	(void) insn;
-	if (pos)
-		*pos << render_illegal_insn(insn);
+	if (trace)
+		*pos << render_illegal_insn(d.insn);
 	halt = true;
 	halt_reason = "Illegal instruction";
 }
 
-void rv32i_hart::exec_lui(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_lui(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd (insn);
-	uint32_t imm_u = get_imm_u (insn);
+	uint32_t rd = d.rd;
+	uint32_t imm_u = d.imm;
 
 	int32_t val = imm_u;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_lui(insn);
+		std::string s = render_lui(d.insn);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(imm_u);
 	}
@@ -185,16 +921,17 @@ void rv32i_hart::exec_lui(uint32_t insn, std::ostream* pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_auipc(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_auipc(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd (insn);
-	uint32_t imm_u = get_imm_u (insn);
+	uint32_t rd = d.rd;
+	uint32_t imm_u = d.imm;
 
 	int32_t val = imm_u + pc;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_auipc(insn);
+		std::string s = render_auipc(d.insn);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(pc) << " + " << hex::to_hex0x32(imm_u);
 		*pos << " = " << hex::to_hex0x32(val);
@@ -205,32 +942,40 @@ void rv32i_hart::exec_auipc(uint32_t insn, std::ostream* pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_jal(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_jal(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd (insn);
-	uint32_t imm_j = get_imm_j (insn);
+	uint32_t rd = d.rd;
+	uint32_t imm_j = d.imm;
 
 	int32_t valA = pc + 4;
 	int32_t valB = pc + imm_j;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_jal(pc, insn);
+		std::string s = render_jal(pc, d.insn);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(valA) << ", pc = " << hex::to_hex0x32(pc);
 		*pos << " + " << hex::to_hex0x32(imm_j) << " = " << hex::to_hex0x32(valB);
 	}
 
 	regs.set(rd, valA);
+	if (coverage)
+		note_edge(pc, valB);
+	if (branches)
+		note_transfer(valB, branch_predictor::jal_kind(rd), true);
+	if (sampler && rd == 1)
+		sampler->call(valB, valA);
 	pc = valB;
 }
 
-void rv32i_hart::exec_jalr(uint32_t insn, std::ostream* pos) //THIS ONE DOESN'T WORK RIGHT
+template <bool trace>
+void rv32i_hart::exec_jalr(const decoded_insn& d, std::ostream* pos) //THIS ONE DOESN'T WORK RIGHT
 {
 
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -238,9 +983,9 @@ void rv32i_hart::exec_jalr(uint32_t insn, std::ostream* pos) //THIS ONE DOESN'T
 	int32_t pcVal;
 	pcVal = (rs1Val + imm_i) & 0xfffffffe;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_jalr(insn);
+		std::string s = render_jalr(d.insn);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(pc + 4) << ", pc = (";
 		*pos << hex::to_hex0x32(imm_i) << " + " << hex::to_hex0x32(rs1Val) << ") & 0xfffffffe = ";
@@ -248,14 +993,26 @@ void rv32i_hart::exec_jalr(uint32_t insn, std::ostream* pos) //THIS ONE DOESN'T
 	}
 
 	regs.set(rd, pc + 4);
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::jalr_kind(rd, rs1), true);
+	if (sampler)
+	{
+		if (rd == 1)
+			sampler->call(pcVal, pc + 4);
+		else if (rd == 0 && rs1 == 1)
+			sampler->ret(pcVal);
+	}
 	pc = pcVal;
 }
 
-void rv32i_hart::exec_beq(uint32_t insn, std::ostream* pos) 
+template <bool trace>
+void rv32i_hart::exec_beq(const decoded_insn& d, std::ostream* pos) 
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_b = get_imm_b(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_b = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -266,27 +1023,33 @@ void rv32i_hart::exec_beq(uint32_t insn, std::ostream* pos)
 	int32_t pcVal = pc;
 
 
-	if (rs1Val == rs2Val)
+	bool taken = rs1Val == rs2Val;
+	if (taken)
 		pcVal += imm_b;
 	else
 		pcVal +=4;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_btype(pc, insn, "beq");
+		std::string s = render_btype(pc, d.insn, "beq");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// pc += (" << hex::to_hex0x32(rs1Val) << " == " << hex::to_hex0x32(rs2Val) << " ? ";
 		*pos << hex::to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(pcVal);	
 	}
 
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::kind_cond, taken);
 	pc = pcVal;
 }
 
-void rv32i_hart::exec_bne(uint32_t insn, std::ostream* pos) 
+template <bool trace>
+void rv32i_hart::exec_bne(const decoded_insn& d, std::ostream* pos) 
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_b = get_imm_b(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_b = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -297,27 +1060,33 @@ void rv32i_hart::exec_bne(uint32_t insn, std::ostream* pos)
 	int32_t pcVal = pc;
 
 
-	if (rs1Val != rs2Val)
+	bool taken = rs1Val != rs2Val;
+	if (taken)
 		pcVal += imm_b;
 	else
 		pcVal +=4;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_btype(pc, insn, "bne");
+		std::string s = render_btype(pc, d.insn, "bne");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// pc += (" << hex::to_hex0x32(rs1Val) << " != " << hex::to_hex0x32(rs2Val) << " ? ";
 		*pos << hex::to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(pcVal);	
 	}
 
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::kind_cond, taken);
 	pc = pcVal;
 }
 
-void rv32i_hart::exec_blt(uint32_t insn, std::ostream* pos) 
+template <bool trace>
+void rv32i_hart::exec_blt(const decoded_insn& d, std::ostream* pos) 
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_b = get_imm_b(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_b = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -328,27 +1097,33 @@ void rv32i_hart::exec_blt(uint32_t insn, std::ostream* pos)
 	int32_t pcVal = pc;
 
 
-	if (rs1Val < rs2Val)
+	bool taken = rs1Val < rs2Val;
+	if (taken)
 		pcVal += imm_b;
 	else
 		pcVal +=4;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_btype(pc, insn, "blt");
+		std::string s = render_btype(pc, d.insn, "blt");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// pc += (" << hex::to_hex0x32(rs1Val) << " < " << hex::to_hex0x32(rs2Val) << " ? ";
 		*pos << hex::to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(pcVal);	
 	}
 
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::kind_cond, taken);
 	pc = pcVal;
 }
 
-void rv32i_hart::exec_bge(uint32_t insn, std::ostream* pos) 
+template <bool trace>
+void rv32i_hart::exec_bge(const decoded_insn& d, std::ostream* pos) 
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_b = get_imm_b(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_b = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -359,28 +1134,34 @@ void rv32i_hart::exec_bge(uint32_t insn, std::ostream* pos)
 	int32_t pcVal = pc;
 
 
-	if (rs1Val >= rs2Val)
+	bool taken = rs1Val >= rs2Val;
+	if (taken)
 		pcVal += imm_b;
 	else
 		pcVal +=4;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_btype(pc, insn, "bge");
+		std::string s = render_btype(pc, d.insn, "bge");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// pc += (" << hex::to_hex0x32(rs1Val) << " >= " << hex::to_hex0x32(rs2Val) << " ? ";
 		*pos << hex::to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(pcVal);	
 	}
 
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::kind_cond, taken);
 	pc = pcVal;
 }
 
 
-void rv32i_hart::exec_bltu(uint32_t insn, std::ostream* pos) 
+template <bool trace>
+void rv32i_hart::exec_bltu(const decoded_insn& d, std::ostream* pos) 
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_b = get_imm_b(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_b = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -391,27 +1172,33 @@ void rv32i_hart::exec_bltu(uint32_t insn, std::ostream* pos)
 	int32_t pcVal = pc;
 
 
-	if (rs1Val < rs2Val)
+	bool taken = rs1Val < rs2Val;
+	if (taken)
 		pcVal += imm_b;
 	else
 		pcVal +=4;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_btype(pc, insn, "bltu");
+		std::string s = render_btype(pc, d.insn, "bltu");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// pc += (" << hex::to_hex0x32(rs1Val) << " <U " << hex::to_hex0x32(rs2Val) << " ? ";
 		*pos << hex::to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(pcVal);	
 	}
 
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::kind_cond, taken);
 	pc = pcVal;
 }
 
-void rv32i_hart::exec_bgeu(uint32_t insn, std::ostream* pos) 
+template <bool trace>
+void rv32i_hart::exec_bgeu(const decoded_insn& d, std::ostream* pos) 
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_b = get_imm_b(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_b = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -422,28 +1209,34 @@ void rv32i_hart::exec_bgeu(uint32_t insn, std::ostream* pos)
 	int32_t pcVal = pc;
 
 
-	if (rs1Val >= rs2Val)
+	bool taken = rs1Val >= rs2Val;
+	if (taken)
 		pcVal += imm_b;
 	else
 		pcVal +=4;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_btype(pc, insn, "bgeu");
+		std::string s = render_btype(pc, d.insn, "bgeu");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// pc += (" << hex::to_hex0x32(rs1Val) << " >=U " << hex::to_hex0x32(rs2Val) << " ? ";
 		*pos << hex::to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(pcVal);	
 	}
 
+	if (coverage)
+		note_edge(pc, pcVal);
+	if (branches)
+		note_transfer(pcVal, branch_predictor::kind_cond, taken);
 	pc = pcVal;
 }
 ////////////////////////////////////////////////////////
 
-void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_lb(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -452,13 +1245,15 @@ void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos)
 	fetch = rs1Val + imm_i;
 
 	int8_t rdVal;
+	if (l1d)
+		l1d->access(fetch, 1, false);
 	rdVal = mem.get8(fetch);	
 
 	int32_t newVal = rdVal;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_load(insn, "lb");
+		std::string s = render_itype_load(d.insn, "lb");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = sx(m8(" << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(newVal);
@@ -468,11 +1263,12 @@ void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_lw(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_lw(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -481,11 +1277,13 @@ void rv32i_hart::exec_lw(uint32_t insn, std::ostream* pos)
 	fetch = rs1Val + imm_i;
 
 	int32_t rdVal;
+	if (l1d)
+		l1d->access(fetch, 4, false);
 	rdVal = mem.get32(fetch);	
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_load(insn, "lw");
+		std::string s = render_itype_load(d.insn, "lw");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = sx(m32(" << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(rdVal);
@@ -495,11 +1293,12 @@ void rv32i_hart::exec_lw(uint32_t insn, std::ostream* pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_lh(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -508,13 +1307,15 @@ void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos)
 	fetch = rs1Val + imm_i;
 
 	int16_t rdVal;
+	if (l1d)
+		l1d->access(fetch, 2, false);
 	rdVal = mem.get16(fetch);	
 
 	int32_t newVal = rdVal;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_load(insn, "lh");
+		std::string s = render_itype_load(d.insn, "lh");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = sx(m16(" << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(newVal);
@@ -525,11 +1326,12 @@ void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos)
 }
 
 
-void rv32i_hart::exec_lbu(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_lbu(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -538,11 +1340,13 @@ void rv32i_hart::exec_lbu(uint32_t insn, std::ostream* pos)
 	fetch = rs1Val + imm_i;
 
 	int32_t rdVal;
+	if (l1d)
+		l1d->access(fetch, 1, false);
 	rdVal = mem.get8(fetch);
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_load(insn, "lbu");
+		std::string s = render_itype_load(d.insn, "lbu");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = zx(m8(" << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(rdVal);
@@ -552,11 +1356,12 @@ void rv32i_hart::exec_lbu(uint32_t insn, std::ostream* pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_lhu(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_lhu(const decoded_insn& d, std::ostream* pos)
 {	
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -565,11 +1370,13 @@ void rv32i_hart::exec_lhu(uint32_t insn, std::ostream* pos)
 	fetch = rs1Val + imm_i;
 
 	int32_t rdVal;
+	if (l1d)
+		l1d->access(fetch, 2, false);
 	rdVal = mem.get16(fetch);
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_load(insn, "lhu");
+		std::string s = render_itype_load(d.insn, "lhu");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = zx(m16(" << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(rdVal);
@@ -579,11 +1386,12 @@ void rv32i_hart::exec_lhu(uint32_t insn, std::ostream* pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_sb(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sb(const decoded_insn& d, std::ostream* pos)
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_s = get_imm_s(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_s = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -595,23 +1403,26 @@ void rv32i_hart::exec_sb(uint32_t insn , std :: ostream *pos)
 
 	int32_t newVal = rs2Val & 0x000000ff;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_stype(insn, "sb");
+		std::string s = render_stype(d.insn, "sb");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// m8(" << hex::to_hex0x32(rs1Val) << " + " << hex::to_hex0x32(imm_s) << ") = ";
 		*pos << hex::to_hex0x32(newVal);
 	}
 
+	if (l1d)
+		l1d->access(addr, 1, true);
 	mem.set8(addr, newVal);
 	pc += 4;
 }
 
-void rv32i_hart::exec_sh(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sh(const decoded_insn& d, std::ostream* pos)
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_s = get_imm_s(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_s = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -623,24 +1434,27 @@ void rv32i_hart::exec_sh(uint32_t insn , std :: ostream *pos)
 
 	int32_t newVal = rs2Val & 0x0000ffff;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_stype(insn, "sh");
+		std::string s = render_stype(d.insn, "sh");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// m16(" << hex::to_hex0x32(rs1Val) << " + " << hex::to_hex0x32(imm_s) << ") = ";
 		*pos << hex::to_hex0x32(newVal);
 	}
 
+	if (l1d)
+		l1d->access(addr, 2, true);
 	mem.set16(addr, newVal);
 	pc += 4;
 
 }
 
-void rv32i_hart::exec_sw(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sw(const decoded_insn& d, std::ostream* pos)
 {
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
-	int32_t imm_s = get_imm_s(insn);
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
+	int32_t imm_s = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -650,23 +1464,26 @@ void rv32i_hart::exec_sw(uint32_t insn , std :: ostream *pos)
 
 	uint32_t addr = rs1Val + imm_s;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_stype(insn, "sw");
+		std::string s = render_stype(d.insn, "sw");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// m32(" << hex::to_hex0x32(rs1Val) << " + " << hex::to_hex0x32(imm_s) << ") = ";
 		*pos << hex::to_hex0x32(rs2Val);
 	}
 
+	if (l1d)
+		l1d->access(addr, 4, true);
 	mem.set32(addr, rs2Val);
 	pc += 4;
 }
 
-void rv32i_hart::exec_addi(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_addi(const decoded_insn& d, std::ostream* pos)
 {	
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -674,9 +1491,9 @@ void rv32i_hart::exec_addi(uint32_t insn , std :: ostream *pos)
 	int32_t rdVal;
 	rdVal = rs1Val + imm_i;
 	
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "addi", imm_i);
+		std::string s = render_itype_alu(d.insn, "addi", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(imm_i) << " = " << hex::to_hex0x32(rdVal);
@@ -686,11 +1503,12 @@ void rv32i_hart::exec_addi(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_slti(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_slti(const decoded_insn& d, std::ostream* pos)
 {	
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -700,9 +1518,9 @@ void rv32i_hart::exec_slti(uint32_t insn , std :: ostream *pos)
 	if (rs1Val < imm_i)
 		rdVal = 1;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "slti", imm_i);
+		std::string s = render_itype_alu(d.insn, "slti", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(rs1Val) << " < ";
 		*pos << imm_i << " ? 1 : 0 = " << hex::to_hex0x32(rdVal);
@@ -712,11 +1530,12 @@ void rv32i_hart::exec_slti(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_sltiu(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sltiu(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -726,9 +1545,9 @@ void rv32i_hart::exec_sltiu(uint32_t insn , std :: ostream *pos)
 	if (rs1Val < imm_i)
 		rdVal = 1;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "sltiu", imm_i);
+		std::string s = render_itype_alu(d.insn, "sltiu", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(rs1Val) << " <U ";
 		*pos << imm_i << " ? 1 : 0 = " << hex::to_hex0x32(rdVal);
@@ -739,12 +1558,13 @@ void rv32i_hart::exec_sltiu(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }	
 
-void rv32i_hart::exec_xor(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_xor(const decoded_insn& d, std::ostream* pos)
 {
 
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -752,9 +1572,9 @@ void rv32i_hart::exec_xor(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val ^ imm_i;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "xori", imm_i);
+		std::string s = render_itype_alu(d.insn, "xori", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " ^ ";
 		*pos << hex::to_hex0x32(imm_i) << " = " << hex::to_hex0x32(rdVal);
@@ -764,11 +1584,12 @@ void rv32i_hart::exec_xor(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_or(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_or(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -776,9 +1597,9 @@ void rv32i_hart::exec_or(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val | imm_i;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "ori", imm_i);
+		std::string s = render_itype_alu(d.insn, "ori", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " | ";
 		*pos << hex::to_hex0x32(imm_i) << " = " << hex::to_hex0x32(rdVal);
@@ -788,11 +1609,12 @@ void rv32i_hart::exec_or(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_slli(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_slli(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -800,9 +1622,9 @@ void rv32i_hart::exec_slli(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val << imm_i;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "slli", imm_i);
+		std::string s = render_itype_alu(d.insn, "slli", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " << ";
 		*pos << imm_i << " = " << hex::to_hex0x32(rdVal);
@@ -812,11 +1634,12 @@ void rv32i_hart::exec_slli(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_andi(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_andi(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -824,9 +1647,9 @@ void rv32i_hart::exec_andi(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val & imm_i;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "andi", imm_i);
+		std::string s = render_itype_alu(d.insn, "andi", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " & ";
 		*pos << hex::to_hex0x32(imm_i) << " = " << hex::to_hex0x32(rdVal);
@@ -836,11 +1659,12 @@ void rv32i_hart::exec_andi(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_srli(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_srli(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -848,9 +1672,9 @@ void rv32i_hart::exec_srli(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val >> imm_i;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "srli", imm_i);
+		std::string s = render_itype_alu(d.insn, "srli", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " >> ";
 		*pos << hex::to_hex0x32(imm_i) << " = " << hex::to_hex0x32(rdVal);
@@ -860,11 +1684,12 @@ void rv32i_hart::exec_srli(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_srai(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_srai(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t imm_i = get_imm_i(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t imm_i = d.imm;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -872,9 +1697,9 @@ void rv32i_hart::exec_srai(uint32_t insn , std :: ostream *pos)
 	int32_t rdVal;
 	rdVal = rs1Val >> imm_i;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_itype_alu(insn, "srai", imm_i);
+		std::string s = render_itype_alu(d.insn, "srai", imm_i);
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " >> ";
 		*pos << hex::to_hex0x32(imm_i) << " = " << hex::to_hex0x32(rdVal);
@@ -884,11 +1709,12 @@ void rv32i_hart::exec_srai(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_add(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_add(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -898,9 +1724,9 @@ void rv32i_hart::exec_add(uint32_t insn , std :: ostream *pos)
 
 	int32_t rdVal = rs1Val + rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "add");
+		std::string s = render_rtype(d.insn, "add");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " + ";
 		*pos << hex::to_hex0x32(rs2Val) << " = " << hex::to_hex0x32(rdVal);
@@ -910,11 +1736,12 @@ void rv32i_hart::exec_add(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_sub(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sub(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2(insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -924,9 +1751,9 @@ void rv32i_hart::exec_sub(uint32_t insn , std :: ostream *pos)
 
 	int32_t rdVal = rs1Val - rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "sub");
+		std::string s = render_rtype(d.insn, "sub");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " - ";
 		*pos << hex::to_hex0x32(rs2Val) << " = " << hex::to_hex0x32(rdVal);
@@ -937,11 +1764,12 @@ void rv32i_hart::exec_sub(uint32_t insn , std :: ostream *pos)
 
 }
 
-void rv32i_hart::exec_sll(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sll(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd (insn);
-	uint32_t rs1 = get_rs1 (insn);
-	uint32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	uint32_t rs1 = d.rs1;
+	uint32_t rs2 = d.rs2;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -953,9 +1781,9 @@ void rv32i_hart::exec_sll(uint32_t insn , std :: ostream *pos)
 
 	int32_t rdVal = rs1Val << LSB;
 
-	if (pos)
+	if (trace)
 	{
-		std::string s = render_rtype(insn , "sll");
+		std::string s = render_rtype(d.insn , "sll");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " << " << LSB << " = ";
 		*pos << hex::to_hex0x32(rdVal);
@@ -965,17 +1793,18 @@ void rv32i_hart::exec_sll(uint32_t insn , std :: ostream *pos)
 }
 
 
-void rv32i_hart::exec_slt (uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_slt (const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd (insn);
-	uint32_t rs1 = get_rs1 (insn);
-	uint32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	uint32_t rs1 = d.rs1;
+	uint32_t rs2 = d.rs2;
 
 	int32_t val = (regs.get (rs1) < regs.get (rs2)) ? 1 : 0;
 
-	if (pos)
+	if (trace)
 	{
-		std::string s = render_rtype(insn , "slt");
+		std::string s = render_rtype(d.insn , "slt");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(regs.get(rs1)) << " < " << hex ::to_hex0x32(regs.get(rs2)) << ") ? 1 : 0 = " << hex::to_hex0x32(val);
 	}
@@ -983,11 +1812,12 @@ void rv32i_hart::exec_slt (uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_sltu(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sltu(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd (insn);
-	uint32_t rs1 = get_rs1 (insn);
-	uint32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	uint32_t rs1 = d.rs1;
+	uint32_t rs2 = d.rs2;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -1000,9 +1830,9 @@ void rv32i_hart::exec_sltu(uint32_t insn , std :: ostream *pos)
 	if (rs1Val < rs2Val)
 		rdVal = 1;
 
-	if (pos)
+	if (trace)
 	{
-		std::string s = render_rtype(insn , "sltu");
+		std::string s = render_rtype(d.insn , "sltu");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(rs1Val) << " <U " << hex::to_hex0x32(rs2Val) << ") ? 1 : 0 = ";
 		*pos << hex::to_hex0x32(rdVal);
@@ -1012,11 +1842,12 @@ void rv32i_hart::exec_sltu(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_xorr(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_xorr(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	uint32_t rs2 = d.rs2;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -1027,9 +1858,9 @@ void rv32i_hart::exec_xorr(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val ^ rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "xor");
+		std::string s = render_rtype(d.insn, "xor");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " ^ ";
 		*pos << hex::to_hex0x32(rs2Val) << " = " << hex::to_hex0x32(rdVal);
@@ -1040,11 +1871,12 @@ void rv32i_hart::exec_xorr(uint32_t insn , std :: ostream *pos)
 }
 
 
-void rv32i_hart::exec_srl(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_srl(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	uint32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	uint32_t rs1 = d.rs1;
+	uint32_t rs2 = d.rs2;
 
 	uint32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -1055,9 +1887,9 @@ void rv32i_hart::exec_srl(uint32_t insn , std :: ostream *pos)
 	uint32_t rdVal;
 	rdVal = rs1Val >> rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "srl");
+		std::string s = render_rtype(d.insn, "srl");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " >> ";
 		*pos << rs2Val << " = " << hex::to_hex0x32(rdVal);
@@ -1067,11 +1899,12 @@ void rv32i_hart::exec_srl(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_sra(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_sra(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -1082,9 +1915,9 @@ void rv32i_hart::exec_sra(uint32_t insn , std :: ostream *pos)
 	int32_t rdVal;
 	rdVal = rs1Val >> rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "sra");
+		std::string s = render_rtype(d.insn, "sra");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " >> ";
 		*pos << rs2Val << " = " << hex::to_hex0x32(rdVal);
@@ -1094,11 +1927,12 @@ void rv32i_hart::exec_sra(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_and(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_and(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -1109,9 +1943,9 @@ void rv32i_hart::exec_and(uint32_t insn , std :: ostream *pos)
 	int32_t rdVal;
 	rdVal = rs1Val & rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "and");
+		std::string s = render_rtype(d.insn, "and");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " & ";
 		*pos << hex::to_hex0x32(rs2Val) << " = " << hex::to_hex0x32(rdVal);
@@ -1121,11 +1955,12 @@ void rv32i_hart::exec_and(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_orr(uint32_t insn , std :: ostream *pos)
+template <bool trace>
+void rv32i_hart::exec_orr(const decoded_insn& d, std::ostream* pos)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t rs1 = get_rs1(insn);
-	int32_t rs2 = get_rs2 (insn);
+	uint32_t rd = d.rd;
+	int32_t rs1 = d.rs1;
+	int32_t rs2 = d.rs2;
 
 	int32_t rs1Val;
 	rs1Val = regs.get(rs1);
@@ -1136,9 +1971,9 @@ void rv32i_hart::exec_orr(uint32_t insn , std :: ostream *pos)
 	int32_t rdVal;
 	rdVal = rs1Val | rs2Val;
 
-	if (pos) 
+	if (trace) 
 	{
-		std::string s = render_rtype(insn, "or");
+		std::string s = render_rtype(d.insn, "or");
 		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
 		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(rs1Val) << " | ";
 		*pos << hex::to_hex0x32(rs2Val) << " = " << hex::to_hex0x32(rdVal);
@@ -1148,11 +1983,12 @@ void rv32i_hart::exec_orr(uint32_t insn , std :: ostream *pos)
 	pc += 4;
 }
 
-void rv32i_hart::exec_csrrs(uint32_t insn, std::ostream* pos)
+template <bool trace>
+void rv32i_hart::exec_csrrs(const decoded_insn& d, std::ostream* pos)
 {
-    uint32_t rd = get_rd(insn);
-    uint32_t rs1 = get_rs1(insn);
-    int32_t csr = get_imm_i(insn) & 0x00000fff;;
+    uint32_t rd = d.rd;
+    uint32_t rs1 = d.rs1;
+    int32_t csr = d.imm & 0x00000fff;;
 
     if (csr != 0xf14 || rs1 != 0)
     {
@@ -1160,9 +1996,9 @@ void rv32i_hart::exec_csrrs(uint32_t insn, std::ostream* pos)
         halt_reason = "Illegal CSR in CRRSS instruction";
     }
 
-    if (pos)
+    if (trace)
     {
-        std::string s = render_csrrx(insn, "csrrs");
+        std::string s = render_csrrx(d.insn, "csrrs");
         s.resize(instruction_width, ' ');
         *pos << s << "// " << render_reg(rd) << " = " << std::dec << mhartid;
     }
@@ -1172,3 +2008,153 @@ void rv32i_hart::exec_csrrs(uint32_t insn, std::ostream* pos)
         pc += 4;
     }
 } 
+
+bool rv32i_hart::check_amo_align(uint32_t addr)
+{
+	if (addr % 4 == 0)
+		return true;
+	halt = true;
+	halt_reason = "Misaligned atomic memory access";
+	return false;
+}
+
+template <bool trace>
+void rv32i_hart::exec_lr_w(const decoded_insn& d, std::ostream* pos)
+{
+	uint32_t addr = regs.get(d.rs1);
+
+	if (trace)
+	{
+		std::string s = render_lr(d.insn);
+		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
+	}
+	if (!check_amo_align(addr))
+		return;
+
+	if (l1d)
+		l1d->access(addr, 4, false);
+	int32_t rdVal = mem.atomic_load32(addr);
+	if (trace)
+		*pos << "// " << render_reg(d.rd) << " = sx(m32(" << hex::to_hex0x32(addr) << ")) = " << hex::to_hex0x32(rdVal);
+
+	reserved = true;
+	reservation_addr = addr;
+	reservation_value = rdVal;
+	regs.set(d.rd, rdVal);
+	pc += 4;
+}
+
+template <bool trace>
+void rv32i_hart::exec_sc_w(const decoded_insn& d, std::ostream* pos)
+{
+	uint32_t addr = regs.get(d.rs1);
+	uint32_t rs2Val = regs.get(d.rs2);
+
+	if (trace)
+	{
+		std::string s = render_amo(d.insn, "sc.w");
+		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
+	}
+	if (!check_amo_align(addr))
+		return;
+
+	// fails unless the word still holds what the lr.w read.  This is not
+	// 	what the A extension asks for: it fails an sc.w after any store to
+	// 	the reservation set, but here a store that leaves the word as the
+	// 	lr.w read it (an ABA) goes unnoticed and the sc.w succeeds
+	bool ok = reserved && reservation_addr == addr
+		&& mem.atomic_cas32(addr, reservation_value, rs2Val);
+	reserved = false;
+	if (l1d)
+		l1d->access(addr, 4, ok);
+
+	if (trace)
+	{
+		*pos << "// ";
+		if (ok)
+			*pos << "m32(" << hex::to_hex0x32(addr) << ") = " << hex::to_hex0x32(rs2Val) << ", ";
+		*pos << render_reg(d.rd) << " = " << (ok ? 0 : 1);
+	}
+	regs.set(d.rd, ok ? 0 : 1);
+	pc += 4;
+}
+
+template <bool trace>
+void rv32i_hart::exec_amo(const decoded_insn& d, std::ostream* pos, memory::amo_op op, const char* mnemonic)
+{
+	uint32_t addr = regs.get(d.rs1);
+	uint32_t rs2Val = regs.get(d.rs2);
+
+	if (trace)
+	{
+		std::string s = render_amo(d.insn, mnemonic);
+		*pos << std::setw(instruction_width) << std :: setfill(' ') << std :: left << s;
+	}
+	if (!check_amo_align(addr))
+		return;
+
+	if (l1d)
+		l1d->access(addr, 4, true);
+	int32_t rdVal = mem.atomic_rmw32(addr, op, rs2Val);
+	if (trace)
+	{
+		*pos << "// " << render_reg(d.rd) << " = sx(m32(" << hex::to_hex0x32(addr) << ")) = " << hex::to_hex0x32(rdVal);
+		*pos << ", m32(" << hex::to_hex0x32(addr) << ") = " << hex::to_hex0x32(mem.get32(addr));
+	}
+	regs.set(d.rd, rdVal);
+	pc += 4;
+}
+
+template <bool trace>
+void rv32i_hart::exec_amoswap_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_swap, "amoswap.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amoadd_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_add, "amoadd.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amoxor_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_xor, "amoxor.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amoand_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_and, "amoand.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amoor_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_or, "amoor.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amomin_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_min, "amomin.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amomax_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_max, "amomax.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amominu_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_minu, "amominu.w");
+}
+
+template <bool trace>
+void rv32i_hart::exec_amomaxu_w(const decoded_insn& d, std::ostream* pos)
+{
+	exec_amo<trace>(d, pos, memory::amo_maxu, "amomaxu.w");
+}
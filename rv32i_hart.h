@@ -1,87 +1,466 @@
+#ifndef RV32I_HART_H
+#define RV32I_HART_H
 #include "registerfile.h"
 #include "memory.h"
+#include "binary_trace.h"
+#include "profile.h"
+#include "cache_model.h"
+#include "branch_predictor.h"
+#include "pipeline_model.h"
+#include "phase_sampler.h"
+#include <memory>
+#include <unordered_map>
+
+class rv32i_jit;
+class stack_sampler;
+
+/**
+ * The table of exec_* handlers that the op ids, the handler tables and the
+ * 	threaded interpreter are all generated from.  The second column marks the
+ * 	handlers that are able to halt the hart.
+ **/
+#define RV32I_HART_OPS(X) \
+	X(exec_illegal_insn, true) \
+	X(exec_lui, false) \
+	X(exec_auipc, false) \
+	X(exec_jal, false) \
+	X(exec_jalr, false) \
+	X(exec_beq, false) \
+	X(exec_bne, false) \
+	X(exec_blt, false) \
+	X(exec_bge, false) \
+	X(exec_bltu, false) \
+	X(exec_bgeu, false) \
+	X(exec_lb, false) \
+	X(exec_lh, false) \
+	X(exec_lw, false) \
+	X(exec_lbu, false) \
+	X(exec_lhu, false) \
+	X(exec_sb, false) \
+	X(exec_sh, false) \
+	X(exec_sw, false) \
+	X(exec_addi, false) \
+	X(exec_slti, false) \
+	X(exec_sltiu, false) \
+	X(exec_xor, false) \
+	X(exec_or, false) \
+	X(exec_andi, false) \
+	X(exec_slli, false) \
+	X(exec_srli, false) \
+	X(exec_srai, false) \
+	X(exec_add, false) \
+	X(exec_sub, false) \
+	X(exec_sll, false) \
+	X(exec_slt, false) \
+	X(exec_sltu, false) \
+	X(exec_xorr, false) \
+	X(exec_srl, false) \
+	X(exec_sra, false) \
+	X(exec_and, false) \
+	X(exec_orr, false) \
+	X(exec_csrrs, true) \
+	X(exec_ebreak, true) \
+	X(exec_lr_w, true) \
+	X(exec_sc_w, true) \
+	X(exec_amoswap_w, true) \
+	X(exec_amoadd_w, true) \
+	X(exec_amoxor_w, true) \
+	X(exec_amoand_w, true) \
+	X(exec_amoor_w, true) \
+	X(exec_amomin_w, true) \
+	X(exec_amomax_w, true) \
+	X(exec_amominu_w, true) \
+	X(exec_amomaxu_w, true)
 
 class rv32i_hart : public rv32i_decode
 {
 	public :
-		rv32i_hart (memory &m) : mem (m) { }
+		rv32i_hart (memory &m) : mem (m) { flush_icache(); }
 		void set_show_instructions (bool b) { show_instructions = b ; }
 		void set_show_registers (bool b) { show_registers = b;}
 		bool is_halted () const { return halt; }
+		bool is_tracing () const { return show_instructions || show_registers || btrace; }
+		/// @brief Send the -i and -r trace to os rather than std::cout.
+		void set_trace_stream (std::ostream* os) { trace_out = os; }
+		std::ostream& get_trace_stream () const { return *trace_out; }
+		/**
+		 * @brief Also record each insn that tick() runs in t, or stop if t is null.
+		 * @note The registers are written to t before the first insn, so
+		 * 	they must not be changed other than by running insns after that.
+		 **/
+		void set_binary_trace (binary_trace_writer* t) { btrace = t; }
 		const std :: string & get_halt_reason () const { return halt_reason; }
 		uint64_t get_insn_counter () const { return insn_counter; }
 		void set_mhartid ( int i ) { mhartid = i; }
+		uint32_t get_pc () const { return pc; }
+		void set_pc (uint32_t addr) { pc = addr; }
+		int32_t get_reg (uint32_t r) const { return regs.get(r); }
+		void set_reg (uint32_t r, int32_t val) { regs.set(r, val); }
+
+		/**
+		 * @brief Count each taken or fall-through edge of every branch and
+		 * 	jump in map, indexed by a hash of the edge's source and target.
+		 *
+		 * The counters wrap.  Only the interpreters record edges.
+		 * @param map The counters, or null to stop recording.
+		 * @param size The number of counters, a power of two.
+		 **/
+		void set_coverage (uint8_t* map, uint32_t size) { coverage = map; coverage_mask = size - 1; }
+		bool is_recording_coverage () const { return coverage != nullptr; }
+
+		/**
+		 * @brief Count each insn run in p, by handler and by pc, or stop if p is null.
+		 * @note tick() and run_fast() count.  run_blocks() does not, so
+		 * 	cpu_single_hart runs the threaded engine in its place.
+		 **/
+		void set_profile (profile* p) { prof = p; }
+		bool is_profiling () const { return prof != nullptr; }
+		profile* get_profile () const { return prof; }
+		/// @return The name of each exec_* handler, in the order profile counts them.
+		static std::vector<std::string> get_handler_names ();
+
+		/**
+		 * @brief Tell s about each call and return made by jal and jalr, or
+		 * 	stop if s is null.
+		 * @note Only the interpreters make the calls.  The samples are
+		 * 	taken by cpu_single_hart.
+		 **/
+		void set_sampler (stack_sampler* s) { sampler = s; }
+		stack_sampler* get_sampler () const { return sampler; }
+
+		/**
+		 * @brief Show each insn fetch to i and each load, store and atomic
+		 * 	to d.  Either may be null to leave that side unmodelled.
+		 * @note tick() and run_fast() show fetches.  run_blocks() does
+		 * 	not, so cpu_single_hart runs the threaded engine in its place.
+		 **/
+		void set_caches (cache_model* i, cache_model* d) { l1i = i; l1d = d; }
+		cache_model* get_l1i () const { return l1i; }
+		cache_model* get_l1d () const { return l1d; }
+
+		/**
+		 * @brief Show each branch, jal and jalr to the predictors in b, or
+		 * 	stop if b is null.
+		 * @note Only the interpreters show transfers, so cpu_single_hart
+		 * 	runs the jit engine as block.
+		 **/
+		void set_branch_model (branch_model* b) { branches = b; }
+		branch_model* get_branch_model () const { return branches; }
+
+		/**
+		 * @brief Time each insn run in the pipeline model p, or stop if p is null.
+		 * @note tick() and run_fast() show insns.  run_blocks() does
+		 * 	not, so cpu_single_hart runs the threaded engine in its place.
+		 **/
+		void set_pipeline (pipeline_model* p) { timing = p; }
+		pipeline_model* get_pipeline () const { return timing; }
+
+		/**
+		 * @brief Count the insns run in each basic block in v, or stop if v
+		 * 	is null.  A block ends at a branch, jump or halting insn, or
+		 * 	after as many insns as run_blocks() puts in one.
+		 * @note tick(), run_fast() and run_blocks() count.  The jit does
+		 * 	not, so cpu_single_hart runs it as block.
+		 **/
+		void set_block_vectors (basic_block_vectors* v) { vectors = v; }
+		basic_block_vectors* get_block_vectors () const { return vectors; }
 
 		void tick ( const std :: string & hdr ="");
-		void dump ( const std :: string & hdr ="") const;
+
+		/**
+		 * @brief Execute insns without any tracing until the hart halts or
+		 * 	the insn counter reaches exec_limit.
+		 *
+		 * This is a threaded interpreter over the same decoded insns as tick()
+		 * 	that never looks at the show_* flags.
+		 * @param exec_limit The insn count at which to stop, or 0 for no limit.
+		 **/
+		void run_fast (uint64_t exec_limit);
+
+		/**
+		 * @brief Execute insns one at a time, without any tracing or hooks,
+		 * 	until the hart halts or the insn counter reaches exec_limit.
+		 *
+		 * Each insn is read from memory and decoded afresh by
+		 * 	reference_decode(), so none of fetch(), predecode() or the
+		 * 	decoded-insn cache is used.  The engines are checked against it.
+		 * @param exec_limit The insn count at which to stop, or 0 for no limit.
+		 **/
+		void run_reference (uint64_t exec_limit);
+
+		/**
+		 * @brief Execute insns a basic block at a time without any tracing
+		 * 	until the hart halts or the insn counter reaches exec_limit.
+		 *
+		 * Blocks are decoded once, end at a branch, jump or halting insn and
+		 * 	link to the blocks that ran after them.  A block that would run
+		 * 	past exec_limit is stepped one insn at a time instead.
+		 * @param exec_limit The insn count at which to stop, or 0 for no limit.
+		 **/
+		void run_blocks (uint64_t exec_limit);
+		void dump ( const std :: string & hdr ="", std::ostream& os = std::cout) const;
 		void reset ();
 
+		/// Everything that reset() resets, as saved by save_state().
+		struct state
+		{
+			registerfile regs;
+			uint32_t pc;
+			bool halt;
+			std::string halt_reason;
+			uint64_t insn_counter;
+			bool reserved;
+			uint32_t reservation_addr;
+			uint32_t reservation_value;
+		};
+
+		/// @brief Copy the registers, pc, halt state, insn counter and reservation into s.
+		void save_state (state& s) const;
+		/// @brief Put the hart back as it was when s was saved.
+		void restore_state (const state& s);
+
 	private :
+		friend class rv32i_jit;	///< translates the same decoded insns
+
 		static constexpr int instruction_width = 35;
-		void exec ( uint32_t insn , std :: ostream *) ;
-		void exec_illegal_insn ( uint32_t insn , std :: ostream *);
-		void exec_lui(uint32_t insn , std :: ostream *);
-		void exec_auipc(uint32_t insn , std :: ostream *);
-		void exec_jal(uint32_t insn , std :: ostream *);
-		void exec_jalr(uint32_t insn , std :: ostream *);
-
-		void exec_beq(uint32_t insn , std :: ostream *);
-		void exec_bne(uint32_t insn , std :: ostream *);
-		void exec_blt(uint32_t insn , std :: ostream *);
-		void exec_bge(uint32_t insn , std :: ostream *);
-		void exec_bltu(uint32_t insn , std :: ostream *);
-		void exec_bgeu(uint32_t insn , std :: ostream *);
-
-		void exec_lb(uint32_t insn , std :: ostream *);
-		void exec_lw(uint32_t insn , std :: ostream *);
-		void exec_lh(uint32_t insn , std :: ostream *);
-
-		void exec_lbu(uint32_t insn , std :: ostream *);
-		void exec_lhu(uint32_t insn , std :: ostream *);
+
+		/**
+		 * An instruction decoded once into the handler that executes it and
+		 * the operand fields the handler needs.
+		 **/
+		struct decoded_insn
+		{
+			uint32_t tag;	///< The address the insn was fetched from
+			uint32_t insn;	///< The raw insn, kept for rendering
+			int32_t imm;	///< The sign-extended immediate for the insn's format
+			uint8_t rd;
+			uint8_t rs1;
+			uint8_t rs2;
+			uint8_t op;	///< The op_id of the handler that executes the insn
+		};
+
+#define RV32I_HART_OP_ID(h, can_halt) op_##h,
+		/// One id per exec_* handler, in RV32I_HART_OPS order.
+		enum op_id : uint8_t { RV32I_HART_OPS(RV32I_HART_OP_ID) op_count };
+#undef RV32I_HART_OP_ID
+
+		typedef void (rv32i_hart::*handler)(const decoded_insn&, std::ostream*);
+		static const handler traced_handlers[op_count];	///< exec_*<true> by op_id
+		static const handler untraced_handlers[op_count];	///< exec_*<false> by op_id
+
+		static constexpr size_t icache_max_size = 1 << 16; ///< max decoded insns kept
+		static constexpr uint32_t icache_no_tag = 0xffffffff; ///< never a legal pc
+
+		/// @brief The body of run_fast(), with or without calling observe() on each insn.
+		template <bool observing> void run_threaded (uint64_t exec_limit);
+
+		/**
+		 * @brief Count d in prof, show its fetch to l1i, then time it in
+		 * 	the pipeline model, which charges any l1i miss, and count it
+		 * 	in its basic block.
+		 **/
+		void observe (const decoded_insn& d)
+		{
+			if (prof)
+				prof->count(d.tag, d.op);
+			if (l1i)
+				l1i->access(d.tag, 4, false);
+			if (timing)
+				timing->issue(d.tag, timing_class(d.op), d.rd, d.rs1, d.rs2);
+			if (vectors)
+				note_block_insn(d);
+		}
+
+		/// @brief Count d in the block vectors once the basic block it ends is known.
+		void note_block_insn (const decoded_insn& d)
+		{
+			if (bb_insns++ == 0)
+				bb_start = d.tag;
+			if (ends_block(d.op) || bb_insns == block_max_size)
+			{
+				vectors->add(bb_start, bb_insns);
+				bb_insns = 0;
+			}
+		}
+
+		/// @return How op uses the pipeline.
+		static pipeline_model::insn_class timing_class (uint8_t op);
+
+		/// @brief Fill in d with the handler and operands for insn.
+		static void predecode (uint32_t insn, decoded_insn& d);
+
+		/**
+		 * @brief Fill in d as predecode() does, but pulling every field and
+		 * 	immediate out of insn bit by bit as the ISA manual lays them
+		 * 	out rather than with the rv32i_decode getters.
+		 **/
+		static void reference_decode (uint32_t insn, decoded_insn& d);
+
+		/**
+		 * @brief Return the decoded insn at addr, decoding it on a cache miss.
+		 * @note The cache is flushed whenever the memory reports a store over
+		 * 	an address that has been decoded.
+		 **/
+		const decoded_insn& fetch (uint32_t addr);
+		void flush_icache ();
+
+		static constexpr size_t block_max_size = 64; ///< max insns in a block
+
+		/**
+		 * A run of decoded insns, terminated by an op_count sentinel, together
+		 * 	with the two blocks most recently seen to follow it.
+		 **/
+		struct block
+		{
+			std::vector<decoded_insn> insns;
+			uint32_t link_pc[2];	///< the pc each link was made for
+			block* link[2];
+		};
+
+		/// @return true If op always ends a block.
+		static bool ends_block (uint8_t op);
+
+		/// @brief Return the block starting at addr, decoding it if needed.
+		block* get_block (uint32_t addr);
+
+		/// @brief Return the block at addr and remember it as a successor of b.
+		block* link_block (block* b, uint32_t addr);
+
+		template <bool trace> void exec_illegal_insn (const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_lui(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_auipc(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_jal(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_jalr(const decoded_insn& d, std::ostream* );
+
+		template <bool trace> void exec_beq(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_bne(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_blt(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_bge(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_bltu(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_bgeu(const decoded_insn& d, std::ostream* );
+
+		template <bool trace> void exec_lb(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_lw(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_lh(const decoded_insn& d, std::ostream* );
+
+		template <bool trace> void exec_lbu(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_lhu(const decoded_insn& d, std::ostream* );
 	
-		void exec_sb(uint32_t insn , std :: ostream *);
-		void exec_sw(uint32_t insn , std :: ostream *);
-		void exec_sh(uint32_t insn , std :: ostream *);
+		template <bool trace> void exec_sb(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sw(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sh(const decoded_insn& d, std::ostream* );
+
+		template <bool trace> void exec_addi(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_slti(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sltiu(const decoded_insn& d, std::ostream* );
+
+		template <bool trace> void exec_xor(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_or(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_andi(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_slli(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_srli(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_srai(const decoded_insn& d, std::ostream* );
+
+
+		template <bool trace> void exec_add(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sub(const decoded_insn& d, std::ostream* );
 
-		void exec_addi(uint32_t insn , std :: ostream *);
-		void exec_slti(uint32_t insn , std :: ostream *);
-		void exec_sltiu(uint32_t insn , std :: ostream *);
+		template <bool trace> void exec_sll(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_slt(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sltu(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_xorr(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_srl(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sra(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_and(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_orr(const decoded_insn& d, std::ostream* );
 
-		void exec_xor(uint32_t insn , std :: ostream *);
-		void exec_or(uint32_t insn , std :: ostream *);
-		void exec_andi(uint32_t insn , std :: ostream *);
-		void exec_slli(uint32_t insn , std :: ostream *);
-		void exec_srli(uint32_t insn , std :: ostream *);
-		void exec_srai(uint32_t insn , std :: ostream *);
+		template <bool trace> void exec_csrrs(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_ebreak(const decoded_insn& d, std::ostream* );
 
+		/**
+		 * @defgroup amo RV32A
+		 * The A extension.  The AMOs are host atomic read-modify-writes on
+		 * 	the shared memory.  lr.w remembers the address and the value it
+		 * 	read, and sc.w succeeds if the word still holds that value,
+		 * 	checked and stored with one host compare-and-swap, so no lock is
+		 * 	shared between harts.  Unlike the spec, an sc.w after another
+		 * 	hart stored the value back (an ABA) succeeds.  A misaligned
+		 * 	address halts the hart.
+		 * 	@{
+		 **/
+		template <bool trace> void exec_lr_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_sc_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amoswap_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amoadd_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amoxor_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amoand_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amoor_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amomin_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amomax_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amominu_w(const decoded_insn& d, std::ostream* );
+		template <bool trace> void exec_amomaxu_w(const decoded_insn& d, std::ostream* );
 
-		void exec_add(uint32_t insn , std :: ostream *);
-		void exec_sub(uint32_t insn , std :: ostream *);
+		/// @brief The body of the exec_amo*_w handlers.
+		template <bool trace> void exec_amo(const decoded_insn& d, std::ostream* pos,
+			memory::amo_op op, const char* mnemonic);
 
-		void exec_sll(uint32_t insn , std :: ostream *);
-		void exec_slt(uint32_t insn , std :: ostream *);
-		void exec_sltu(uint32_t insn , std :: ostream *);
-		void exec_xorr(uint32_t insn , std :: ostream *);
-		void exec_srl(uint32_t insn , std :: ostream *);
-		void exec_sra(uint32_t insn , std :: ostream *);
-		void exec_and(uint32_t insn , std :: ostream *);
-		void exec_orr(uint32_t insn , std :: ostream *);
+		/// @return false after halting the hart if addr is not word-aligned.
+		bool check_amo_align(uint32_t addr);
+		/**@}*/
 
-		void exec_csrrs(uint32_t insn, std::ostream* );
-		void exec_ebreak(uint32_t insn, std::ostream* );
+		/// @brief Fill in the parts of r that have to be seen before d runs.
+		void trace_before (const decoded_insn& d, trace_record& r);
+		/// @brief Finish r now that its insn has run and write it to the binary trace.
+		void trace_after (trace_record& r);
+
+		/// @brief Show the control transfer from pc to target to the branch predictors.
+		void note_transfer (uint32_t target, branch_predictor::kind k, bool taken)
+		{
+			branches->note({ pc, target, k, taken });
+		}
+
+		/// @brief Count the control transfer from from to to in the coverage map.
+		void note_edge (uint32_t from, uint32_t to)
+		{
+			uint32_t h = (from >> 1) * 0x9e3779b1u ^ (to >> 1);
+			coverage[(h ^ h >> 16) & coverage_mask]++;
+		}
 
 
 		bool halt = { false };
 		std :: string halt_reason = { " none " };
 		bool show_instructions = { false };
 		bool show_registers = { false };
+		std::ostream* trace_out = { &std::cout };
+		binary_trace_writer* btrace = { nullptr };
+		profile* prof = { nullptr };
+		stack_sampler* sampler = { nullptr };	///< follows calls, see set_sampler()
+		cache_model* l1i = { nullptr };	///< sees each fetch, see set_caches()
+		cache_model* l1d = { nullptr };	///< sees each data access
+		branch_model* branches = { nullptr };	///< sees each control transfer
+		pipeline_model* timing = { nullptr };	///< times each insn, see set_pipeline()
+		basic_block_vectors* vectors = { nullptr };	///< counts each basic block, see set_block_vectors()
+		uint32_t bb_start = { 0 };	///< where the block being counted one insn at a time starts
+		uint32_t bb_insns = { 0 };	///< its insns counted so far
 
 		uint64_t insn_counter = { 0 };
 		uint32_t pc = { 0 };
 		uint32_t mhartid = { 0 };
 
+		bool reserved = { false };	///< an lr.w is waiting for its sc.w
+		uint32_t reservation_addr = { 0 };
+		uint32_t reservation_value = { 0 };	///< the word lr.w read
+
+		uint8_t* coverage = { nullptr };	///< edge counters, see set_coverage()
+		uint32_t coverage_mask = { 0 };
+
+		std::vector<decoded_insn> icache;	///< direct-mapped by pc
+		uint32_t icache_generation = { 0 };	///< mem code generation icache matches
+		std::unordered_map<uint32_t, std::unique_ptr<block>> blocks;	///< by start pc
+
 	protected :
 		registerfile regs ;
 		memory & mem ;
 };
 
+#endif // RV32I_HART_H
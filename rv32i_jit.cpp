@@ -0,0 +1,498 @@
+#include "rv32i_jit.h"
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define RV32I_JIT_X86_64 1
+#include <sys/mman.h>
+#endif
+
+#ifdef RV32I_JIT_X86_64
+
+// generated code reads the page table, code-watch bits and dirty flags as plain words
+static_assert(sizeof(std::atomic<memory::page*>) == 8, "page table entries must be bare pointers");
+static_assert(sizeof(std::atomic<uint32_t>) == 4, "code-watch words must be bare words");
+static_assert(sizeof(std::atomic<bool>) == 1, "page dirty flags must be bare bytes");
+
+namespace
+{
+	/**
+	 * Appends x86-64 machine code to a buffer.  Only the handful of
+	 * 	instruction forms that the translator needs are provided.
+	 **/
+	class x86_emitter
+	{
+	public:
+		static constexpr uint8_t eax = 0;
+		static constexpr uint8_t ecx = 1;
+		static constexpr uint8_t edx = 2;
+
+		/// condition codes for jcc/setcc
+		static constexpr uint8_t cc_b = 0x2;
+		static constexpr uint8_t cc_ae = 0x3;
+		static constexpr uint8_t cc_e = 0x4;
+		static constexpr uint8_t cc_ne = 0x5;
+		static constexpr uint8_t cc_a = 0x7;
+		static constexpr uint8_t cc_l = 0xc;
+		static constexpr uint8_t cc_ge = 0xd;
+
+		std::vector<uint8_t> buf;
+
+		void byte(uint8_t b) { buf.push_back(b); }
+		void dword(uint32_t d)
+		{
+			for (int i = 0; i < 4; i++)
+				byte(d >> (8 * i));
+		}
+
+		/// mov x,[rdi+4*r] or xor x,x for x0
+		void load_reg(uint8_t x, uint32_t r)
+		{
+			if (r == 0)
+			{
+				byte(0x31); byte(0xc0 | x << 3 | x);
+			}
+			else
+			{
+				byte(0x8b); byte(0x40 | x << 3 | 7); byte(4 * r);
+			}
+		}
+
+		/// mov [rdi+4*r],x unless r is x0
+		void store_reg(uint8_t x, uint32_t r)
+		{
+			if (r != 0)
+			{
+				byte(0x89); byte(0x40 | x << 3 | 7); byte(4 * r);
+			}
+		}
+
+		/// mov dword [rdi+4*r],imm unless r is x0
+		void store_imm(uint32_t r, uint32_t imm)
+		{
+			if (r != 0)
+			{
+				byte(0xc7); byte(0x47); byte(4 * r); dword(imm);
+			}
+		}
+
+		/// op eax,ecx for one of the 0x01-style ALU opcodes
+		void alu_eax_ecx(uint8_t op) { byte(op); byte(0xc8); }
+
+		/// op eax,imm32 for one of the 0x05-style short ALU opcodes
+		void alu_eax_imm(uint8_t op, uint32_t imm) { byte(op); dword(imm); }
+
+		/// shl/shr/sar eax,imm8 where ext is the /digit of the shift
+		void shift_imm(uint8_t ext, uint8_t n) { byte(0xc1); byte(0xc0 | ext << 3); byte(n); }
+
+		/// shl/shr/sar eax,cl
+		void shift_cl(uint8_t ext) { byte(0xd3); byte(0xc0 | ext << 3); }
+
+		/// setcc al; movzx eax,al
+		void setcc_eax(uint8_t cc)
+		{
+			byte(0x0f); byte(0x90 | cc); byte(0xc0);
+			byte(0x0f); byte(0xb6); byte(0xc0);
+		}
+
+		/// jcc rel32 with the target to be patched later
+		size_t jcc(uint8_t cc)
+		{
+			byte(0x0f); byte(0x80 | cc); dword(0);
+			return buf.size() - 4;
+		}
+
+		/// point the rel32 at offset at the current end of the buffer
+		void patch(size_t at)
+		{
+			uint32_t rel = buf.size() - (at + 4);
+			memcpy(&buf[at], &rel, 4);
+		}
+
+		/// mov dword [rsi+off],imm
+		void store_ctx_imm(uint8_t off, uint32_t imm) { byte(0xc7); byte(0x46); byte(off); dword(imm); }
+
+		/// mov r,[rsi+off] for a 64-bit r, rcx = 1 or r8 = 8
+		void load_ctx64(uint8_t r, uint8_t off)
+		{
+			byte(r & 8 ? 0x4c : 0x48); byte(0x8b); byte(0x40 | (r & 7) << 3 | 6); byte(off);
+		}
+
+		/// leave the block having retired count insns, with pc in eax
+		void exit_with_eax(uint8_t count_off, uint32_t count)
+		{
+			store_ctx_imm(count_off, count);
+			byte(0xc3);
+		}
+
+		/// leave the block having retired count insns, next at pc
+		void exit(uint8_t count_off, uint32_t count, uint32_t pc)
+		{
+			store_ctx_imm(count_off, count);
+			byte(0xb8); dword(pc);
+			byte(0xc3);
+		}
+	};
+}
+
+#endif // RV32I_JIT_X86_64
+
+rv32i_jit::rv32i_jit()
+{
+#ifdef RV32I_JIT_X86_64
+	// writable while blocks are copied in and executable while they run, never both
+	void* p = mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+		code = static_cast<uint8_t*>(p);
+	else
+		std::cerr << "WARNING: no executable memory for the JIT, interpreting instead" << endl;
+#endif
+}
+
+rv32i_jit::~rv32i_jit()
+{
+#ifdef RV32I_JIT_X86_64
+	if (code)
+		munmap(code, code_size);
+#endif
+}
+
+bool rv32i_jit::set_writable(bool w)
+{
+#ifdef RV32I_JIT_X86_64
+	if (w != writable && mprotect(code, code_size, PROT_READ | (w ? PROT_WRITE : PROT_EXEC)) != 0)
+	{
+		std::cerr << "WARNING: can't change the JIT's code protection, interpreting instead" << endl;
+		munmap(code, code_size);
+		code = nullptr;
+		blocks.clear();
+		return false;
+	}
+#endif
+	writable = w;
+	return true;
+}
+
+void rv32i_jit::flush()
+{
+	blocks.clear();
+	code_used = 0;
+}
+
+void rv32i_jit::interpret_block(rv32i_hart& hart, uint64_t exec_limit)
+{
+	do
+	{
+		uint32_t from = hart.pc;
+		hart.run_fast(hart.insn_counter + 1);
+		if (hart.pc != from + 4)
+			break;
+	} while (!hart.halt && (exec_limit == 0 || hart.insn_counter < exec_limit));
+}
+
+void rv32i_jit::run(rv32i_hart& hart, uint64_t exec_limit)
+{
+	memory& mem = hart.mem;
+	if (!code)
+	{
+		hart.run_fast(exec_limit);
+		return;
+	}
+
+	context ctx;
+	ctx.page_dir = mem.get_page_directory();
+	ctx.mem_size = mem.get_size();
+	int32_t* regs = hart.regs.data();
+
+	while (!hart.halt && (exec_limit == 0 || hart.insn_counter < exec_limit))
+	{
+		if (generation != mem.get_code_generation())
+		{
+			flush();
+			generation = mem.get_code_generation();
+		}
+
+		block& b = blocks[hart.pc];
+		if (!b.code)
+		{
+			if (b.heat < 0 || ++b.heat < hot_threshold)
+			{
+				interpret_block(hart, exec_limit);
+				continue;
+			}
+			translate(hart, hart.pc, b);
+			if (!code)
+			{
+				hart.run_fast(exec_limit);
+				return;
+			}
+			continue;
+		}
+
+		if (exec_limit && exec_limit - hart.insn_counter < b.ninsns)
+		{
+			interpret_block(hart, exec_limit);
+			continue;
+		}
+		if (writable && !set_writable(false))
+		{
+			hart.run_fast(exec_limit);
+			return;
+		}
+
+		ctx.count = 0;
+		hart.pc = b.code(regs, &ctx);
+		hart.insn_counter += ctx.count;
+
+		// the block gave up on its first insn, so let memory handle it
+		if (ctx.count == 0)
+			hart.run_fast(hart.insn_counter + 1);
+	}
+}
+
+void rv32i_jit::translate(rv32i_hart& hart, uint32_t addr, block& b)
+{
+#ifdef RV32I_JIT_X86_64
+	typedef rv32i_hart h;
+	const uint8_t count_off = offsetof(context, count);
+	x86_emitter e;
+	std::vector<std::pair<size_t, uint32_t>> bail;	///< jcc to patch, insn index
+	memory& mem = hart.mem;
+
+	uint32_t n = 0;
+	bool ended = false;
+	while (!ended && n < block_max_size && uint64_t(addr) + 4 * (n + 1) <= mem.get_size())
+	{
+		uint32_t pc = addr + 4 * n;
+		rv32i_hart::decoded_insn d;
+		h::predecode(mem.get32(pc), d);
+
+		switch (d.op)
+		{
+		case h::op_exec_lui:
+			e.store_imm(d.rd, d.imm);
+			break;
+		case h::op_exec_auipc:
+			e.store_imm(d.rd, pc + d.imm);
+			break;
+		case h::op_exec_jal:
+			e.store_imm(d.rd, pc + 4);
+			e.exit(count_off, n + 1, pc + d.imm);
+			ended = true;
+			break;
+		case h::op_exec_jalr:
+			e.load_reg(e.eax, d.rs1);
+			e.alu_eax_imm(0x05, d.imm);
+			e.alu_eax_imm(0x25, 0xfffffffe);
+			e.store_imm(d.rd, pc + 4);
+			e.exit_with_eax(count_off, n + 1);
+			ended = true;
+			break;
+
+		case h::op_exec_beq:
+		case h::op_exec_bne:
+		case h::op_exec_blt:
+		case h::op_exec_bge:
+		case h::op_exec_bltu:
+		case h::op_exec_bgeu:
+			{
+				uint8_t cc = d.op == h::op_exec_beq ? e.cc_e :
+					d.op == h::op_exec_bne ? e.cc_ne :
+					d.op == h::op_exec_blt ? e.cc_l :
+					d.op == h::op_exec_bge ? e.cc_ge :
+					d.op == h::op_exec_bltu ? e.cc_b : e.cc_ae;
+				e.load_reg(e.eax, d.rs1);
+				e.load_reg(e.ecx, d.rs2);
+				e.byte(0x39); e.byte(0xc8);	// cmp eax,ecx
+				size_t taken = e.jcc(cc);
+				e.exit(count_off, n + 1, pc + 4);
+				e.patch(taken);
+				e.exit(count_off, n + 1, pc + d.imm);
+				ended = true;
+				break;
+			}
+
+		case h::op_exec_lb:
+		case h::op_exec_lh:
+		case h::op_exec_lw:
+		case h::op_exec_lbu:
+		case h::op_exec_lhu:
+		case h::op_exec_sb:
+		case h::op_exec_sh:
+		case h::op_exec_sw:
+			{
+				bool store = d.op == h::op_exec_sb || d.op == h::op_exec_sh || d.op == h::op_exec_sw;
+				uint8_t width = (d.op == h::op_exec_lw || d.op == h::op_exec_sw) ? 4 :
+					(d.op == h::op_exec_lh || d.op == h::op_exec_lhu || d.op == h::op_exec_sh) ? 2 : 1;
+
+				e.load_reg(e.eax, d.rs1);
+				if (d.imm)
+					e.alu_eax_imm(0x05, d.imm);
+
+				// lea rdx,[rax+width]; cmp rdx,[rsi+mem_size]; ja bail
+				e.byte(0x48); e.byte(0x8d); e.byte(0x50); e.byte(width);
+				e.byte(0x48); e.byte(0x3b); e.byte(0x56); e.byte(offsetof(context, mem_size));
+				bail.push_back(std::make_pair(e.jcc(e.cc_a), n));
+
+				// bail if the access straddles two pages
+				e.byte(0x89); e.byte(0xc2);	// mov edx,eax
+				e.byte(0x81); e.byte(0xe2); e.dword(memory::page_size - 1);	// and edx,page_size-1
+				e.byte(0x81); e.byte(0xfa); e.dword(memory::page_size - width);	// cmp edx,page_size-width
+				bail.push_back(std::make_pair(e.jcc(e.cc_a), n));
+
+				// r8 = page_dir[addr >> 22], rcx = r8->pages[addr >> 12 & 0x3ff], bail if null
+				e.load_ctx64(8, offsetof(context, page_dir));
+				e.byte(0x89); e.byte(0xc1);	// mov ecx,eax
+				e.byte(0xc1); e.byte(0xe9); e.byte(memory::page_bits + memory::table_bits);	// shr ecx,22
+				e.byte(0x4d); e.byte(0x8b); e.byte(0x04); e.byte(0xc8);	// mov r8,[r8+rcx*8]
+				e.byte(0x4d); e.byte(0x85); e.byte(0xc0);	// test r8,r8
+				bail.push_back(std::make_pair(e.jcc(e.cc_e), n));
+				e.byte(0x89); e.byte(0xc1);	// mov ecx,eax
+				e.byte(0xc1); e.byte(0xe9); e.byte(memory::page_bits);	// shr ecx,12
+				e.byte(0x81); e.byte(0xe1); e.dword((1u << memory::table_bits) - 1);	// and ecx,0x3ff
+				e.byte(0x49); e.byte(0x8b); e.byte(0x0c); e.byte(0xc8);	// mov rcx,[r8+rcx*8]
+				e.byte(0x48); e.byte(0x85); e.byte(0xc9);	// test rcx,rcx
+				bail.push_back(std::make_pair(e.jcc(e.cc_e), n));
+				e.byte(0x89); e.byte(0xd0);	// mov eax,edx, the offset in the page
+
+				if (store)
+				{
+					// bail if either end of the store lands on watched code
+					for (uint8_t end = 0; end < width; end += width - 1)
+					{
+						e.byte(0x8d); e.byte(0x50); e.byte(end);	// lea edx,[rax+end]
+						e.byte(0xc1); e.byte(0xea); e.byte(2);	// shr edx,2
+						e.byte(0x0f); e.byte(0xa3); e.byte(0x91);	// bt [rcx+code_watch],edx
+						e.dword(offsetof(memory::page, code_watch));
+						bail.push_back(std::make_pair(e.jcc(e.cc_b), n));
+						if (width == 1)
+							break;
+					}
+
+					// bail on the first store to a page since the last snapshot so
+					// that the interpreter can add it to the dirty pages
+					e.byte(0x80); e.byte(0xb9);	// cmp byte [rcx+dirty],0
+					e.dword(offsetof(memory::page, dirty)); e.byte(0);
+					bail.push_back(std::make_pair(e.jcc(e.cc_e), n));
+				}
+
+				switch (d.op)
+				{
+				case h::op_exec_lw:	e.byte(0x8b); break;
+				case h::op_exec_lh:	e.byte(0x0f); e.byte(0xbf); break;
+				case h::op_exec_lhu:	e.byte(0x0f); e.byte(0xb7); break;
+				case h::op_exec_lb:	e.byte(0x0f); e.byte(0xbe); break;
+				case h::op_exec_lbu:	e.byte(0x0f); e.byte(0xb6); break;
+				default:
+					e.load_reg(e.edx, d.rs2);
+					if (d.op == h::op_exec_sh)
+						e.byte(0x66);
+					e.byte(d.op == h::op_exec_sb ? 0x88 : 0x89);
+					break;
+				}
+				// modrm/sib for [rcx+rax] with eax or edx as the register
+				e.byte(store ? 0x14 : 0x04); e.byte(0x01);
+				if (!store)
+					e.store_reg(e.eax, d.rd);
+				break;
+			}
+
+		case h::op_exec_addi:
+		case h::op_exec_xor:
+		case h::op_exec_or:
+		case h::op_exec_andi:
+			e.load_reg(e.eax, d.rs1);
+			e.alu_eax_imm(d.op == h::op_exec_addi ? 0x05 : d.op == h::op_exec_xor ? 0x35 :
+				d.op == h::op_exec_or ? 0x0d : 0x25, d.imm);
+			e.store_reg(e.eax, d.rd);
+			break;
+		case h::op_exec_slti:
+		case h::op_exec_sltiu:
+			e.load_reg(e.eax, d.rs1);
+			e.alu_eax_imm(0x3d, d.imm);	// cmp eax,imm32
+			e.setcc_eax(d.op == h::op_exec_slti ? e.cc_l : e.cc_b);
+			e.store_reg(e.eax, d.rd);
+			break;
+		case h::op_exec_slli:
+		case h::op_exec_srli:
+		case h::op_exec_srai:
+			e.load_reg(e.eax, d.rs1);
+			e.shift_imm(d.op == h::op_exec_slli ? 4 : d.op == h::op_exec_srli ? 5 : 7, d.imm & 0x1f);
+			e.store_reg(e.eax, d.rd);
+			break;
+
+		case h::op_exec_add:
+		case h::op_exec_sub:
+		case h::op_exec_xorr:
+		case h::op_exec_orr:
+		case h::op_exec_and:
+			e.load_reg(e.eax, d.rs1);
+			e.load_reg(e.ecx, d.rs2);
+			e.alu_eax_ecx(d.op == h::op_exec_add ? 0x01 : d.op == h::op_exec_sub ? 0x29 :
+				d.op == h::op_exec_xorr ? 0x31 : d.op == h::op_exec_orr ? 0x09 : 0x21);
+			e.store_reg(e.eax, d.rd);
+			break;
+		case h::op_exec_slt:
+		case h::op_exec_sltu:
+			e.load_reg(e.eax, d.rs1);
+			e.load_reg(e.ecx, d.rs2);
+			e.byte(0x39); e.byte(0xc8);	// cmp eax,ecx
+			e.setcc_eax(d.op == h::op_exec_slt ? e.cc_l : e.cc_b);
+			e.store_reg(e.eax, d.rd);
+			break;
+		case h::op_exec_sll:
+		case h::op_exec_srl:
+		case h::op_exec_sra:
+			// x86 masks the count to 5 bits, as the interpreter's shifts do
+			e.load_reg(e.eax, d.rs1);
+			e.load_reg(e.ecx, d.rs2);
+			e.shift_cl(d.op == h::op_exec_sll ? 4 : d.op == h::op_exec_srl ? 5 : 7);
+			e.store_reg(e.eax, d.rd);
+			break;
+
+		default:
+			// csrrs, ebreak, lr.w, sc.w, the AMOs and illegal insns are left
+			// 	to the interpreter
+			e.exit(count_off, n, pc);
+			ended = true;
+			continue;
+		}
+		mem.watch_code(pc);
+		++n;
+	}
+
+	if (n == 0)
+	{
+		b.heat = -1;
+		return;
+	}
+	if (!ended)
+		e.exit(count_off, n, addr + 4 * n);
+
+	// the insns before the one that bailed were retired
+	for (auto& j : bail)
+	{
+		e.patch(j.first);
+		e.exit(count_off, j.second, addr + 4 * j.second);
+	}
+
+	if (code_used + e.buf.size() > code_size)
+	{
+		// b is lost with the rest; the next visit counts up to hot again
+		flush();
+		return;
+	}
+	// b went with the rest of the blocks if this fails
+	if (!writable && !set_writable(true))
+		return;
+	memcpy(code + code_used, e.buf.data(), e.buf.size());
+	b.code = reinterpret_cast<block_fn>(code + code_used);
+	b.ninsns = n;
+	code_used += e.buf.size();
+	++translations;
+#else
+	(void)hart;
+	(void)addr;
+	b.heat = -1;
+#endif
+}
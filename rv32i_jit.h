@@ -0,0 +1,87 @@
+#ifndef RV32I_JIT_H
+#define RV32I_JIT_H
+#include "rv32i_hart.h"
+
+/**
+ * Translates hot RV32I basic blocks of a hart into x86-64 code.
+ *
+ * Generated code reads and writes the registerfile array in place and walks
+ * 	the memory page table itself.  A load or store that is out of range,
+ * 	straddles two pages, hits a page that was never stored to, stores over
+ * 	watched code or is the first store to a page since the last memory
+ * 	snapshot leaves the block just before that insn so that the
+ * 	interpreter can run it through memory.  CSR, ebreak and illegal
+ * 	insns are never translated.
+ *
+ * The code buffer is never writable and executable at once: it is made
+ * 	read-write to copy new blocks in and read-execute before running them.
+ *
+ * On hosts other than x86-64 Linux run() just uses the threaded interpreter.
+ **/
+class rv32i_jit
+{
+public:
+	rv32i_jit();
+	~rv32i_jit();
+
+	/**
+	 * @brief Run hart until it halts or its insn counter reaches exec_limit.
+	 * @param hart The hart to run.  The same jit must not be used with
+	 * 	more than one hart.
+	 * @param exec_limit The insn count at which to stop, or 0 for no limit.
+	 **/
+	void run(rv32i_hart& hart, uint64_t exec_limit);
+
+	/// @return The number of blocks translated so far.
+	uint64_t get_translations() const { return translations; }
+
+private:
+	static constexpr size_t code_size = 16 << 20;	///< bytes of code buffer
+	static constexpr int hot_threshold = 16;	///< visits before a block is translated
+	static constexpr size_t block_max_size = 64;	///< max insns in a block
+
+	/**
+	 * Values the generated code needs besides the registers.  rdi points at
+	 * 	the registers and rsi at this while a block runs.
+	 **/
+	struct context
+	{
+		const std::atomic<memory::page_table*>* page_dir;
+		uint64_t mem_size;
+		uint32_t count;	///< set by the block to the insns it retired
+	};
+
+	/// A block of generated code returns the next pc.
+	typedef uint32_t (*block_fn)(int32_t* regs, context* ctx);
+
+	struct block
+	{
+		block_fn code = { nullptr };
+		uint32_t ninsns = { 0 };	///< the most insns the block can retire
+		int heat = { 0 };
+	};
+
+	/// @brief Translate the block at addr into b, or mark b as never translatable.
+	void translate(rv32i_hart& hart, uint32_t addr, block& b);
+
+	/// @brief Interpret insns up to the next control transfer.
+	void interpret_block(rv32i_hart& hart, uint64_t exec_limit);
+
+	void flush();
+
+	/**
+	 * @brief Make the code buffer writable but not executable, or the other
+	 * 	way round.  If that fails the buffer is dropped and run() interprets.
+	 * @return false If it failed.
+	 **/
+	bool set_writable(bool w);
+
+	uint8_t* code = { nullptr };	///< code buffer, null if unavailable
+	bool writable = { true };	///< code is read-write rather than read-execute
+	size_t code_used = { 0 };
+	std::unordered_map<uint32_t, block> blocks;	///< by start pc
+	uint32_t generation = { 0 };	///< mem code generation the blocks match
+	uint64_t translations = { 0 };
+};
+
+#endif // RV32I_JIT_H
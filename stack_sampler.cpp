@@ -0,0 +1,88 @@
+#include "stack_sampler.h"
+#include "hex.h"
+#include <algorithm>
+
+constexpr size_t stack_sampler::max_depth;
+constexpr size_t stack_sampler::max_unwind;
+
+stack_sampler::stack_sampler(uint64_t p) : period(std::max<uint64_t>(p, 1))
+{
+}
+
+uint64_t stack_sampler::next_interval()
+{
+	// xorshift64
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return std::max<uint64_t>(1, period / 2 + rng % (period + 1));
+}
+
+void stack_sampler::start(uint32_t pc)
+{
+	started = true;
+	root = pc;
+	frames.clear();
+}
+
+void stack_sampler::call(uint32_t target, uint32_t ret)
+{
+	if (frames.size() < max_depth)
+		frames.push_back({ target, ret });
+}
+
+void stack_sampler::ret(uint32_t target)
+{
+	size_t stop = frames.size() > max_unwind ? frames.size() - max_unwind : 0;
+	for (size_t i = frames.size(); i > stop; i--)
+	{
+		if (frames[i - 1].ret == target)
+		{
+			frames.resize(i - 1);
+			return;
+		}
+	}
+}
+
+void stack_sampler::sample(uint32_t pc)
+{
+	std::vector<uint32_t> key;
+	key.reserve(frames.size() + 2);
+	key.push_back(root);
+	for (const frame& f : frames)
+		key.push_back(f.entry);
+	key.push_back(pc);
+	stacks[key]++;
+	samples++;
+}
+
+void stack_sampler::write_folded(std::ostream& os, const elf32* elf) const
+{
+	auto name = [elf](uint32_t addr)
+	{
+		const elf32::symbol* sym = elf ? elf->find_symbol(addr) : nullptr;
+		return sym ? sym->name : hex::to_hex0x32(addr);
+	};
+
+	// stacks that differ only in the pc can name the same functions
+	std::map<std::string, uint64_t> lines;
+	bool symbols = elf && !elf->get_symbols().empty();
+	for (const auto& s : stacks)
+	{
+		const std::vector<uint32_t>& key = s.first;
+		std::string line = name(key[0]);
+		std::string top = line;
+		for (size_t i = 1; i + 1 < key.size(); i++)
+		{
+			top = name(key[i]);
+			line += ";" + top;
+		}
+		std::string leaf = name(key.back());
+		if (!symbols || leaf != top)
+			line += ";" + leaf;
+		lines[line] += s.second;
+	}
+
+	for (const auto& l : lines)
+		os << l.first << " " << l.second << "\n";
+}
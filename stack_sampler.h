@@ -0,0 +1,80 @@
+#ifndef STACK_SAMPLER_H
+#define STACK_SAMPLER_H
+#include "elf32.h"
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <vector>
+
+/**
+ * A sampling profiler that keeps a shadow call stack for a hart and counts
+ * 	the stacks it finds each time it is asked for a sample.
+ *
+ * A jal or jalr that links to ra is a call, and a jalr to ra that links to
+ * 	x0 is a return.  A return pops back to the newest frame it returns
+ * 	into, so a longjmp or an unwound frame does not leave the stack wrong
+ * 	for good.  A return that matches none of the newest frames is ignored.
+ **/
+class stack_sampler
+{
+public:
+	/**
+	 * @param period The mean number of insns between samples.  Each gap is
+	 * 	picked at random from period / 2 up to 3 * period / 2 so that the
+	 * 	samples do not fall in step with a loop.
+	 **/
+	explicit stack_sampler(uint64_t period);
+
+	/// @return The number of insns to run before the next sample.
+	uint64_t next_interval();
+
+	/// @return true Once start() has been called.
+	bool is_started() const { return started; }
+
+	/// @brief Clear the stack and start it in the code at pc.
+	void start(uint32_t pc);
+
+	/// @brief Note a call to target that will return to ret.
+	void call(uint32_t target, uint32_t ret);
+
+	/// @brief Note a return to target.
+	void ret(uint32_t target);
+
+	/// @brief Count the current stack, with the hart at pc.
+	void sample(uint32_t pc);
+
+	/// @return The number of samples taken.
+	uint64_t get_samples() const { return samples; }
+
+	/**
+	 * @brief Write one collapsed-stack line per distinct stack, in the form
+	 * 	"outer;inner;leaf count" that flamegraph tools read.
+	 *
+	 * Each frame is named by the symbol of the function that was called,
+	 * 	or its address in hex when there is no symbol for it.  With
+	 * 	symbols, the function the hart was in is added as the leaf when it
+	 * 	is not the one last called.  Without, the pc itself is the leaf.
+	 * @param elf The symbols, or null.
+	 **/
+	void write_folded(std::ostream& os, const elf32* elf) const;
+
+	static constexpr size_t max_depth = 4096;	///< deeper calls are not followed
+	static constexpr size_t max_unwind = 16;	///< frames a return may pop at once
+
+private:
+	struct frame
+	{
+		uint32_t entry;	///< the address called
+		uint32_t ret;	///< where it returns to
+	};
+
+	uint64_t period;
+	uint64_t rng = { 0x9e3779b97f4a7c15ull };
+	bool started = { false };
+	uint32_t root = { 0 };	///< where the hart was when started
+	std::vector<frame> frames;
+	uint64_t samples = { 0 };
+	std::map<std::vector<uint32_t>, uint64_t> stacks;	///< root, entries, pc
+};
+
+#endif // STACK_SAMPLER_H
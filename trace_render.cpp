@@ -0,0 +1,152 @@
+//*********************************
+//
+// RISC-V Simulator
+//
+// Turns a binary trace written by rv32i -w back into the text that -i and
+// -r print, optionally only for the insns in a range of addresses.
+//
+//*********************************
+#include <iostream>
+#include <unistd.h>
+#include <stdlib.h>
+#include "rv32i_hart.h"
+#include "trace_writer.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+/**
+ * @brief Standard errors printed when the command line is used improperly.
+ **/
+static void usage()
+{
+	cerr << "Usage : trace_render [-i] [-r] [-p hex-lo:hex-hi] infile\n";
+	cerr << "-i show instruction printing ( the default when -r is not given )\n";
+	cerr << "-r show register printing\n";
+	cerr << "-p only show the insns at addresses from lo up to but not including hi\n";
+	exit(1);
+}
+
+namespace
+{
+	/// @return The bytes of memory that insn reads or writes, if it does.
+	int access_size(uint32_t insn)
+	{
+		uint32_t opcode = insn & 0x7f;
+		if (opcode == 0b0000011 || opcode == 0b0100011)	// loads and stores
+			return 1 << (insn >> 12 & 3);
+		return 4;
+	}
+
+	/// @brief Store the low len bytes of val at addr, skipping any outside mem.
+	void poke(memory& mem, uint32_t addr, uint32_t val, int len)
+	{
+		for (int i = 0; i < len; i++, val >>= 8)
+			if (uint64_t(addr) + i < mem.get_size())
+				mem.set8(addr + i, val);
+	}
+}
+
+/**
+ * @brief usage: trace_render [options] infile
+ *
+ * Each insn is rendered by running it on a hart of its own with the
+ * 	registers the trace says it had, the insn itself and any value that it
+ * 	read stored into a scratch memory, so the text is the same as the
+ * 	simulator's and the program is not needed.
+ **/
+int main(int argc, char **argv)
+{
+	bool iFlag = false;
+	bool rFlag = false;
+	uint32_t lo = 0;
+	uint64_t hi = uint64_t(1) << 32;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "irp:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i': iFlag = true; break;
+		case 'r': rFlag = true; break;
+		case 'p':
+			{
+				std::istringstream iss(optarg);
+				char colon = 0;
+				iss >> std::hex >> lo >> colon >> hi;
+				if (colon != ':' || iss.fail() || hi <= lo)
+					usage();
+				break;
+			}
+		default: usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+	if (!rFlag)
+		iFlag = true;
+
+	std::ifstream in(argv[optind], std::ios::binary);
+	if (in.fail())
+	{
+		cerr << "Can’t open file '" << argv[optind] << "' for reading." << endl;
+		usage();
+	}
+	binary_trace_reader reader(in);
+	if (!reader.read_header())
+	{
+		cerr << "'" << argv[optind] << "' is not a binary trace." << endl;
+		return 1;
+	}
+
+	memory mem(reader.get_mem_size());
+	std::vector<std::unique_ptr<rv32i_hart>> harts;
+	trace_writer writer(stdout);
+	std::ostream out(&writer);
+
+	trace_record r;
+	rv32i_hart::state s;
+	while (reader.next(r))
+	{
+		if (r.pc < lo || r.pc >= hi)
+			continue;
+
+		while (r.hart >= harts.size())
+		{
+			harts.emplace_back(new rv32i_hart(mem));
+			harts.back()->set_mhartid(harts.size() - 1);
+			harts.back()->set_show_instructions(iFlag);
+			harts.back()->set_show_registers(rFlag);
+			harts.back()->set_trace_stream(&out);
+		}
+
+		// the insn, and whatever it read, are where it expects them
+		if (uint64_t(r.pc) + 4 <= mem.get_size() && mem.get32(r.pc) != r.insn)
+			mem.set32(r.pc, r.insn);
+		if (r.mem)
+			poke(mem, r.mem_addr, r.mem_value, access_size(r.insn));
+
+		// an sc.w that stored has a reservation that its store matches
+		const int32_t* regs = reader.get_regs(r.hart);
+		for (int i = 1; i < 32; i++)
+			s.regs.set(i, regs[i]);
+		s.pc = r.pc;
+		s.halt = false;
+		s.insn_counter = 0;
+		s.reserved = r.mem;
+		s.reservation_addr = r.mem_addr;
+		s.reservation_value = r.mem_value;
+		harts[r.hart]->restore_state(s);
+
+		harts[r.hart]->tick(reader.get_nharts() > 1 ? "[" + std::to_string(r.hart) + "]" : "");
+	}
+	out.flush();
+
+	if (reader.is_truncated())
+	{
+		cerr << "The trace ends with a record that is cut short or not valid." << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include "trace_writer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+	/// How long the writer thread sleeps when it finds the ring empty.
+	const std::chrono::microseconds idle_wait(200);
+}
+
+trace_writer::trace_writer(FILE* o, size_t ring_size, full_policy p)
+	: out(o), policy(p), stage(new char[stage_size])
+{
+	size_t size = stage_size;
+	while (size < ring_size)
+		size <<= 1;
+	ring.reset(new char[size]);
+	ring_mask = size - 1;
+
+	setp(stage.get(), stage.get() + stage_size);
+	writer = std::thread(&trace_writer::drain, this);
+}
+
+trace_writer::~trace_writer()
+{
+	sync();
+	stopping.store(true, std::memory_order_release);
+	writer.join();
+}
+
+trace_writer::int_type trace_writer::overflow(int_type c)
+{
+	commit(false);
+	if (traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+	return c;
+}
+
+int trace_writer::sync()
+{
+	commit(true);
+
+	// wait for the writer thread to catch up
+	uint64_t end = head.load(std::memory_order_relaxed);
+	while (flushed.load(std::memory_order_acquire) < end)
+		std::this_thread::yield();
+	return 0;
+}
+
+void trace_writer::commit(bool all)
+{
+	char* begin = pbase();
+	char* end = pptr();
+	if (!all)
+	{
+		// keep a partial line staged so that a drop never splits a line
+		char* nl = end;
+		while (nl > begin && nl[-1] != '\n')
+			--nl;
+		if (nl > begin)
+			end = nl;
+	}
+
+	push(begin, end - begin);
+
+	size_t rest = pptr() - end;
+	memmove(begin, end, rest);
+	setp(begin, epptr());
+	pbump(rest);
+}
+
+void trace_writer::push(const char* p, size_t len)
+{
+	size_t size = ring_mask + 1;
+	uint64_t h = head.load(std::memory_order_relaxed);
+	while (len > 0)
+	{
+		size_t room = size - (h - tail.load(std::memory_order_acquire));
+		if (room < std::min(len, size))
+		{
+			if (policy == drop_when_full)
+			{
+				dropped += len;
+				return;
+			}
+			std::this_thread::yield();
+			continue;
+		}
+
+		// copy up to the end of the ring, then wrap for the rest
+		size_t n = std::min(len, room);
+		size_t off = h & ring_mask;
+		size_t first = std::min(n, size - off);
+		memcpy(&ring[off], p, first);
+		memcpy(&ring[0], p + first, n - first);
+		h += n;
+		head.store(h, std::memory_order_release);
+		p += n;
+		len -= n;
+	}
+}
+
+void trace_writer::drain()
+{
+	size_t size = ring_mask + 1;
+	uint64_t t = tail.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		uint64_t h = head.load(std::memory_order_acquire);
+		if (h == t)
+		{
+			if (stopping.load(std::memory_order_acquire) && h == head.load(std::memory_order_acquire))
+				return;
+			std::this_thread::sleep_for(idle_wait);
+			continue;
+		}
+
+		while (t < h)
+		{
+			size_t off = t & ring_mask;
+			size_t n = std::min<uint64_t>(h - t, size - off);
+			fwrite(&ring[off], 1, n, out);
+			t += n;
+			tail.store(t, std::memory_order_release);
+		}
+
+		// caught up: push it out so that sync() knows it has landed
+		if (head.load(std::memory_order_acquire) == t)
+		{
+			fflush(out);
+			flushed.store(t, std::memory_order_release);
+		}
+	}
+}
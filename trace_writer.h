@@ -0,0 +1,86 @@
+#ifndef TRACE_WRITER_H
+#define TRACE_WRITER_H
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <streambuf>
+#include <thread>
+
+/**
+ * A stream buffer that hands trace output to a background thread, which
+ * 	writes it to a FILE in large blocks.
+ *
+ * Lines are staged in the stream's own put area and then copied whole into
+ * 	a single-producer/single-consumer ring, so the thread producing the
+ * 	trace only waits for I/O when the ring is full and the policy says to.
+ * 	Only one thread may write to the stream.  flush() on the stream waits
+ * 	until everything written so far has reached the FILE and been fflushed,
+ * 	so output written to the same FILE by other means should be preceded
+ * 	by one.
+ **/
+class trace_writer : public std::streambuf
+{
+public:
+	/// What to do with a line when the ring has no room for it.
+	enum full_policy
+	{
+		wait_when_full,	///< wait for the writer thread to make room
+		drop_when_full	///< throw the lines away and count them
+	};
+
+	/**
+	 * @param out Where the trace goes.  It must stay open until the
+	 * 	trace_writer is destroyed.
+	 * @param ring_size The bytes buffered between the two threads, rounded
+	 * 	up to a power of two.
+	 * @param policy What to do when the ring is full.
+	 **/
+	trace_writer(FILE* out, size_t ring_size = default_ring_size, full_policy policy = wait_when_full);
+
+	/// @brief Write out everything buffered and stop the writer thread.
+	~trace_writer();
+
+	trace_writer(const trace_writer&) = delete;
+	trace_writer& operator=(const trace_writer&) = delete;
+
+	/// @return The bytes thrown away under drop_when_full.
+	uint64_t get_dropped() const { return dropped; }
+
+	static constexpr size_t default_ring_size = 4 << 20;
+
+protected:
+	int_type overflow(int_type c) override;
+	int sync() override;
+
+private:
+	static constexpr size_t stage_size = 64 << 10;	///< bytes of put area
+
+	/**
+	 * @brief Move the staged lines into the ring.
+	 * @param all Move a trailing partial line too, rather than keeping it
+	 * 	staged until its end arrives.
+	 **/
+	void commit(bool all);
+
+	/// @brief Copy len bytes into the ring, or drop them if it is full.
+	void push(const char* p, size_t len);
+
+	/// @brief The writer thread: copy the ring out to the FILE until stopped.
+	void drain();
+
+	FILE* out;
+	full_policy policy;
+	std::unique_ptr<char[]> stage;
+	std::unique_ptr<char[]> ring;
+	size_t ring_mask;	///< ring size - 1
+	uint64_t dropped = { 0 };
+
+	// positions only ever grow; the ring offset is pos & ring_mask
+	std::atomic<uint64_t> head = { 0 };	///< end of the bytes pushed, written by the producer
+	std::atomic<uint64_t> tail = { 0 };	///< end of the bytes written out, written by drain()
+	std::atomic<uint64_t> flushed = { 0 };	///< end of the bytes fflushed, written by drain()
+	std::atomic<bool> stopping = { false };
+	std::thread writer;
+};
+
+#endif // TRACE_WRITER_H